@@ -0,0 +1,188 @@
+/*线程池请求队列的微基准：无锁环形缓冲(mpmc_queue)对比原来的list+互斥锁+信号量。
+ *线程数为1时同一线程交替入队出队；大于1时一半线程入队、一半线程出队，
+ *入队方放完后每个出队线程收到一个0值结束，出队方累加取到的值校验没有丢失或重复。
+ *用法: mpmc_bench [每轮元素个数] [队列容量]*/
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include "../threadpool/mpmc_queue.h"
+#include "../lock/locker.h"
+
+using namespace std;
+
+static const int THREAD_COUNTS[] = {1, 2, 4, 8, 16, 32, 64};
+static const int SPIN_TRIES = 128;
+
+//改动前线程池的队列：互斥锁保护list，信号量计数
+class locked_queue {
+public:
+    explicit locked_queue(size_t capacity) : m_capacity(capacity) {}
+
+    bool push(long item) {
+        m_lock.lock();
+        if (m_list.size() >= m_capacity) {
+            m_lock.unlock();
+            return false;
+        }
+        m_list.push_back(item);
+        m_lock.unlock();
+        m_stat.post();
+        return true;
+    }
+
+    bool pop(long &item) {
+        m_lock.lock();
+        if (m_list.empty()) {
+            m_lock.unlock();
+            return false;
+        }
+        item = m_list.front();
+        m_list.pop_front();
+        m_lock.unlock();
+        return true;
+    }
+
+    //工作线程在信号量上睡眠，和原来的run一样
+    long take() {
+        long item;
+        m_stat.wait();
+        while (!pop(item))
+            sched_yield();
+        return item;
+    }
+
+private:
+    size_t m_capacity;
+    list<long> m_list;
+    locker m_lock;
+    sem m_stat;
+};
+
+//无锁队列：取不到时先自旋，再让出CPU
+class ring_queue {
+public:
+    explicit ring_queue(size_t capacity) : m_queue(capacity) {}
+
+    bool push(long item) {
+        return m_queue.push(item);
+    }
+
+    bool pop(long &item) {
+        return m_queue.pop(item);
+    }
+
+    long take() {
+        long item;
+        for (int spin = 0; !m_queue.pop(item); ++spin) {
+            if (spin < SPIN_TRIES)
+                cpu_relax();
+            else
+                sched_yield();
+        }
+        return item;
+    }
+
+private:
+    mpmc_queue<long> m_queue;
+};
+
+template<typename Queue>
+struct bench_args {
+    Queue *queue;
+    long count;
+    long sum;
+};
+
+template<typename Queue>
+static void *producer(void *arg) {
+    bench_args<Queue> *args = (bench_args<Queue> *) arg;
+    for (long i = 1; i <= args->count; ++i)
+        while (!args->queue->push(i))
+            sched_yield();
+    return NULL;
+}
+
+template<typename Queue>
+static void *consumer(void *arg) {
+    bench_args<Queue> *args = (bench_args<Queue> *) arg;
+    long item;
+    while ((item = args->queue->take()) != 0)
+        args->sum += item;
+    return NULL;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//返回每秒完成的入队+出队对数(百万)，校验失败返回负数
+template<typename Queue>
+static double run(int threads, long items, size_t capacity) {
+    Queue queue(capacity);
+    if (threads == 1) {
+        long item = 0, sum = 0;
+        double start = now();
+        for (long i = 1; i <= items; ++i) {
+            queue.push(i);
+            queue.pop(item);
+            sum += item;
+        }
+        double elapsed = now() - start;
+        return sum == items * (items + 1) / 2 ? items / elapsed / 1e6 : -1;
+    }
+
+    int producers = threads / 2, consumers = threads - producers;
+    long per_producer = items / producers;
+    vector<bench_args<Queue> > args(threads);
+    vector<pthread_t> ids(threads);
+    double start = now();
+    for (int i = 0; i < threads; ++i) {
+        args[i].queue = &queue;
+        args[i].count = per_producer;
+        args[i].sum = 0;
+        pthread_create(&ids[i], NULL, i < producers ? producer<Queue> : consumer<Queue>, &args[i]);
+    }
+    for (int i = 0; i < producers; ++i)
+        pthread_join(ids[i], NULL);
+    for (int i = 0; i < consumers; ++i)
+        while (!queue.push(0))
+            sched_yield();
+    long sum = 0;
+    for (int i = producers; i < threads; ++i) {
+        pthread_join(ids[i], NULL);
+        sum += args[i].sum;
+    }
+    double elapsed = now() - start;
+    long expect = producers * (per_producer * (per_producer + 1) / 2);
+    return sum == expect ? producers * per_producer / elapsed / 1e6 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    long items = argc > 1 ? atol(argv[1]) : 2000000;
+    size_t capacity = argc > 2 ? atol(argv[2]) : 10000;
+    if (items <= 0 || capacity == 0) {
+        fprintf(stderr, "usage: %s [items] [capacity]\n", argv[0]);
+        return 2;
+    }
+
+    printf("items=%ld capacity=%zu (Mops/s, 一次入队+一次出队算一次)\n", items, capacity);
+    printf("%8s %12s %12s\n", "threads", "list+lock", "mpmc_queue");
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]); ++i) {
+        int threads = THREAD_COUNTS[i];
+        double locked = run<locked_queue>(threads, items, capacity);
+        double ring = run<ring_queue>(threads, items, capacity);
+        ok = ok && locked > 0 && ring > 0;
+        printf("%8d %12.2f %12.2f\n", threads, locked, ring);
+    }
+    if (!ok)
+        fprintf(stderr, "checksum mismatch\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,104 @@
+/*定时器微基准：分层时间轮插入、调整和到期处理的耗时。
+ *插入时到期时间在[1, 跨度]秒内随机分布，覆盖第0层到第2层；
+ *调整分推后(活跃连接的常见情况，节点不动)和提前(要移到新槽)两种；
+ *到期一次tick到所有定时器过期，回调次数必须等于定时器个数。
+ *用法: timer_bench [定时器个数] [到期时间跨度(秒)]*/
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include "../timer/lst_timer.h"
+#include "../http/http_conn.h"
+
+using namespace std;
+
+/*lst_timer.cpp中的cb_func和tick会用到http_conn的这几个静态成员，
+ *基准只测时间轮本身，不链接整个服务器，这里给出空实现*/
+int http_conn::m_user_count = 0;
+
+bool http_conn::busy(int) {
+    return false;
+}
+
+void http_conn::unpark(int) {}
+
+void http_conn::release_client(int) {}
+
+static long fired = 0;
+
+static void on_expire(client_data *) {
+    ++fired;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double elapsed, long count) {
+    printf("%-16s %10.1f ms %10.1f ns/op\n", name, elapsed * 1e3, elapsed * 1e9 / count);
+}
+
+int main(int argc, char *argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 100000;
+    long span = argc > 2 ? atol(argv[2]) : 300;
+    if (count <= 0 || span <= 1) {
+        fprintf(stderr, "usage: %s [timers] [span]\n", argv[0]);
+        return 2;
+    }
+
+    srand(1);
+    time_wheel wheel;
+    time_t base = time(NULL);
+    vector<client_data> users(count);
+    vector<util_timer *> timers(count);
+    vector<time_t> expires(count);
+    for (long i = 0; i < count; ++i) {
+        users[i].sockfd = (int) i;
+        users[i].phase = PHASE_OTHER;
+        expires[i] = base + 1 + rand() % span;
+    }
+    printf("timers=%ld span=%lds\n", count, span);
+
+    double start = now();
+    for (long i = 0; i < count; ++i) {
+        util_timer *timer = wheel.alloc_timer();
+        timer->expire = expires[i];
+        timer->cb_func = on_expire;
+        timer->user_data = &users[i];
+        users[i].timer = timer;
+        wheel.add_timer(timer);
+        timers[i] = timer;
+    }
+    report("insert", now() - start, count);
+
+    for (long i = 0; i < count; ++i)
+        expires[i] += 1 + rand() % span;
+    start = now();
+    for (long i = 0; i < count; ++i) {
+        timers[i]->expire = expires[i];
+        wheel.adjust_timer(timers[i]);
+    }
+    report("adjust (later)", now() - start, count);
+
+    //提前到原来的一半，仍在base之后
+    for (long i = 0; i < count; ++i)
+        expires[i] = base + 1 + (timers[i]->expire - base) / 2;
+    start = now();
+    for (long i = 0; i < count; ++i) {
+        timers[i]->expire = expires[i];
+        wheel.adjust_timer(timers[i]);
+    }
+    report("adjust (earlier)", now() - start, count);
+
+    start = now();
+    wheel.tick(base + 2 * span + 1);
+    report("expire", now() - start, count);
+
+    if (fired != count) {
+        fprintf(stderr, "expired %ld of %ld timers\n", fired, count);
+        return 1;
+    }
+    return 0;
+}
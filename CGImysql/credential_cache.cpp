@@ -0,0 +1,124 @@
+#include "credential_cache.h"
+#include "sql_connection_pool.h"
+
+#include <vector>
+
+bool credential_cache::load() {
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_pool);
+    if (!mysql)
+        return false;
+
+    //在user表中检索username，passwd数据
+    if (mysql_query(mysql, "SELECT username,passwd FROM user")) {
+        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
+        mysqlcon.broken();
+        return false;
+    }
+    MYSQL_RES *result = mysql_store_result(mysql);
+    if (!result)
+        return false;
+    while (MYSQL_ROW row = mysql_fetch_row(result)) {
+        if (row[0] && row[1])
+            put(row[0], true, row[1]);
+    }
+    mysql_free_result(result);
+    return true;
+}
+
+bool credential_cache::query(const string &name, bool &exists, string &password) {
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_pool);
+    if (!mysql)
+        return false;
+
+    vector<char> escaped(name.size() * 2 + 1);
+    mysql_real_escape_string(mysql, &escaped[0], name.c_str(), name.size());
+    string sql = string("SELECT passwd FROM user WHERE username='") + &escaped[0] + "'";
+    if (mysql_query(mysql, sql.c_str())) {
+        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
+        mysqlcon.broken();
+        return false;
+    }
+    MYSQL_RES *result = mysql_store_result(mysql);
+    if (!result)
+        return false;
+    MYSQL_ROW row = mysql_fetch_row(result);
+    exists = row && row[0];
+    if (exists)
+        password = row[0];
+    mysql_free_result(result);
+    return true;
+}
+
+void credential_cache::put(const string &name, bool exists, const string &password) {
+    shard &s = shard_of(name);
+    s.lock.wrlock();
+    auto it = s.users.find(name);
+    if (it != s.users.end() && !it->second.exists)
+        --s.negatives;
+    if (!exists) {
+        //不存在的用户名可能来自随意的探测，数量过多时整体丢弃
+        if (s.negatives >= MAX_NEGATIVE) {
+            for (auto i = s.users.begin(); i != s.users.end();) {
+                if (!i->second.exists)
+                    i = s.users.erase(i);
+                else
+                    ++i;
+            }
+            s.negatives = 0;
+        }
+        ++s.negatives;
+    }
+    entry &e = s.users[name];
+    e.exists = exists;
+    e.password = password;
+    e.expire = exists ? 0 : time(NULL) + NEGATIVE_TTL;
+    s.lock.unlock();
+}
+
+credential_cache::RESULT credential_cache::verify(const string &name, const string &password) {
+    shard &s = shard_of(name);
+    s.lock.rdlock();
+    auto it = s.users.find(name);
+    if (it != s.users.end() && (it->second.exists || time(NULL) < it->second.expire)) {
+        RESULT ret = !it->second.exists ? NO_USER : it->second.password == password ? OK : WRONG_PASSWORD;
+        s.lock.unlock();
+        return ret;
+    }
+    s.lock.unlock();
+
+    bool exists = false;
+    string stored;
+    if (!query(name, exists, stored))
+        return DB_ERROR;
+    put(name, exists, stored);
+    return !exists ? NO_USER : stored == password ? OK : WRONG_PASSWORD;
+}
+
+bool credential_cache::add_user(const string &name, const string &password, RESULT &result) {
+    result = verify(name, password);
+    if (result != NO_USER)
+        return false;
+
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_pool);
+    if (!mysql) {
+        result = DB_ERROR;
+        return false;
+    }
+    vector<char> escaped_name(name.size() * 2 + 1), escaped_password(password.size() * 2 + 1);
+    mysql_real_escape_string(mysql, &escaped_name[0], name.c_str(), name.size());
+    mysql_real_escape_string(mysql, &escaped_password[0], password.c_str(), password.size());
+    string sql = string("INSERT INTO user(username, passwd) VALUES('") + &escaped_name[0] + "', '" +
+                 &escaped_password[0] + "')";
+    //并发注册同一用户名时由数据库的唯一约束裁决
+    if (mysql_query(mysql, sql.c_str())) {
+        LOG_ERROR("INSERT error:%s\n", mysql_error(mysql));
+        result = DB_ERROR;
+        return false;
+    }
+    put(name, true, password);
+    result = OK;
+    return true;
+}
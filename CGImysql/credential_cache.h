@@ -0,0 +1,71 @@
+#ifndef CREDENTIAL_CACHE_H
+#define CREDENTIAL_CACHE_H
+
+#include <string>
+#include <ctime>
+#include <unordered_map>
+#include "../lock/locker.h"
+
+using namespace std;
+
+class connection_pool;
+
+/*用户名到密码的缓存，按用户名哈希分片，每个分片一把读写锁。
+ *登录只取读锁，不同用户的登录互不阻塞；未命中时查一次数据库并把结果(包括用户不存在)记下来*/
+class credential_cache {
+public:
+    enum RESULT {
+        OK = 0,
+        WRONG_PASSWORD,
+        NO_USER,
+        DB_ERROR
+    };
+
+    static const int SHARDS = 16;
+    static const int NEGATIVE_TTL = 10;         //不存在的用户名缓存的秒数
+    static const size_t MAX_NEGATIVE = 1024;    //每个分片最多记录的不存在用户名
+
+    credential_cache(connection_pool *pool, int close_log) : m_pool(pool), m_close_log(close_log) {}
+
+    ~credential_cache() {}
+
+    //启动时把user表整体载入
+    bool load();
+
+    //校验登录
+    RESULT verify(const string &name, const string &password);
+
+    //注册新用户，用户名已存在时返回false
+    bool add_user(const string &name, const string &password, RESULT &result);
+
+private:
+    struct entry {
+        bool exists;
+        string password;
+        time_t expire;      //不存在的记录的过期时间
+    };
+
+    struct shard {
+        rwlocker lock;
+        unordered_map<string, entry> users;
+        size_t negatives;
+
+        shard() : negatives(0) {}
+    };
+
+    shard &shard_of(const string &name) {
+        return m_shards[hash<string>()(name) % SHARDS];
+    }
+
+    //查数据库，exists返回用户是否存在
+    bool query(const string &name, bool &exists, string &password);
+
+    void put(const string &name, bool exists, const string &password);
+
+private:
+    connection_pool *m_pool;
+    shard m_shards[SHARDS];
+    int m_close_log;
+};
+
+#endif
@@ -0,0 +1,157 @@
+#include "sql_connection_pool.h"
+
+pthread_key_t connection_pool::m_thread_key;
+
+connection_pool::connection_pool() : m_MaxConn(0), m_FreeConn(0) {
+}
+
+connection_pool::~connection_pool() {
+    DestroyPool();
+    mysql_library_end();
+}
+
+void connection_pool::library_init() {
+    //mysql_init在库未初始化时会顺带初始化，这一步不是线程安全的，工作线程并发重连前必须先做
+    mysql_library_init(0, NULL, NULL);
+    pthread_key_create(&m_thread_key, thread_end);
+}
+
+void connection_pool::thread_init() {
+    if (pthread_getspecific(m_thread_key))
+        return;
+    mysql_thread_init();
+    pthread_setspecific(m_thread_key, (void *) 1);
+}
+
+void connection_pool::thread_end(void *arg) {
+    (void) arg;
+    mysql_thread_end();
+}
+
+MYSQL *connection_pool::connect() {
+    thread_init();
+    MYSQL *con = mysql_init(NULL);
+    if (con == NULL) {
+        LOG_ERROR("MySQL Error: mysql_init");
+        return NULL;
+    }
+    if (mysql_real_connect(con, m_url.c_str(), m_User.c_str(), m_PassWord.c_str(), m_DatabaseName.c_str(),
+                           m_Port, NULL, 0) == NULL) {
+        LOG_ERROR("MySQL Error: %s", mysql_error(con));
+        mysql_close(con);
+        return NULL;
+    }
+    return con;
+}
+
+bool connection_pool::init(string url, string User, string PassWord, string DBName, int Port, int MaxConn,
+                           int close_log) {
+    m_url = url;
+    m_Port = Port;
+    m_User = User;
+    m_PassWord = PassWord;
+    m_DatabaseName = DBName;
+    m_close_log = close_log;
+
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, library_init);
+
+    int connected = 0;
+    time_t now = time(NULL);
+    for (int i = 0; i < MaxConn; i++) {
+        slot s;
+        s.conn = connect();
+        s.last_used = now;
+        if (s.conn)
+            ++connected;
+        connList.push_back(s);
+        ++m_FreeConn;
+        reserve.post();
+    }
+    m_MaxConn = m_FreeConn;
+    return connected > 0;
+}
+
+MYSQL *connection_pool::GetConnection() {
+    //连接数有上限，全部被占用时等待归还
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += WAIT_TIMEOUT;
+    if (m_MaxConn == 0)
+        return NULL;
+    if (!reserve.timedwait(t))
+        return NULL;
+
+    lock.lock();
+    slot s = connList.front();
+    connList.pop_front();
+    --m_FreeConn;
+    lock.unlock();
+
+    //连接可能由别的线程建立，本线程使用前也要初始化线程相关的状态
+    thread_init();
+
+    //长时间空闲的连接可能已被服务端断开，先ping，失败时重连
+    time_t now = time(NULL);
+    if (s.conn && now - s.last_used >= IDLE_CHECK && mysql_ping(s.conn) != 0) {
+        mysql_close(s.conn);
+        s.conn = NULL;
+    }
+    if (!s.conn)
+        s.conn = connect();
+    if (!s.conn) {
+        lock.lock();
+        s.last_used = now;
+        connList.push_back(s);
+        ++m_FreeConn;
+        lock.unlock();
+        reserve.post();
+    }
+    return s.conn;
+}
+
+void connection_pool::ReleaseConnection(MYSQL *con, bool broken) {
+    if (NULL == con)
+        return;
+    slot s;
+    s.conn = con;
+    s.last_used = time(NULL);
+    if (broken) {
+        mysql_close(con);
+        s.conn = NULL;
+    }
+
+    lock.lock();
+    connList.push_front(s);
+    ++m_FreeConn;
+    lock.unlock();
+
+    reserve.post();
+}
+
+void connection_pool::DestroyPool() {
+    lock.lock();
+    for (slot &s : connList) {
+        if (s.conn)
+            mysql_close(s.conn);
+    }
+    connList.clear();
+    m_FreeConn = 0;
+    lock.unlock();
+}
+
+int connection_pool::GetFreeConn() {
+    return this->m_FreeConn;
+}
+
+connectionRAII::connectionRAII(MYSQL **SQL, connection_pool *connPool) {
+    *SQL = connPool->GetConnection();
+
+    conRAII = *SQL;
+    poolRAII = connPool;
+    brokenRAII = false;
+}
+
+connectionRAII::~connectionRAII() {
+    poolRAII->ReleaseConnection(conRAII, brokenRAII);
+}
@@ -0,0 +1,89 @@
+#ifndef _CONNECTION_POOL_
+#define _CONNECTION_POOL_
+
+#include <list>
+#include <string>
+#include <ctime>
+#include <pthread.h>
+#include <mysql/mysql.h>
+#include "../lock/locker.h"
+#include "../log/log.h"
+
+using namespace std;
+
+//数据库连接池，连接数固定为MaxConn，断开的连接在取用时重连
+class connection_pool {
+public:
+    static const int IDLE_CHECK = 30;    //空闲超过该秒数的连接取用前先ping
+    static const int WAIT_TIMEOUT = 3;   //所有连接都被占用时最多等待的秒数
+
+    connection_pool();
+
+    ~connection_pool();
+
+    //建立MaxConn个连接，数据库暂时连不上的位置留空，取用时再连，一个都连不上时返回false
+    bool init(string url, string User, string PassWord, string DataBaseName, int Port, int MaxConn, int close_log);
+
+    //取出一个可用连接，等待超时或重连失败时返回NULL
+    MYSQL *GetConnection();
+
+    //归还连接，broken为true时关闭它，下次取用时重连
+    void ReleaseConnection(MYSQL *conn, bool broken = false);
+
+    //当前空闲的连接数
+    int GetFreeConn();
+
+private:
+    MYSQL *connect();
+
+    void DestroyPool();
+
+    //进程内只做一次：初始化客户端库，创建按线程清理的key
+    static void library_init();
+
+    //线程第一次使用客户端库时初始化，线程退出时由key的析构函数调用mysql_thread_end
+    static void thread_init();
+
+    static void thread_end(void *arg);
+
+    static pthread_key_t m_thread_key;
+
+private:
+    struct slot {
+        MYSQL *conn;        //为NULL时表示尚未连上
+        time_t last_used;
+    };
+
+    int m_MaxConn;
+    int m_FreeConn;
+    locker lock;
+    list<slot> connList;
+    sem reserve;
+
+    string m_url;
+    int m_Port;
+    string m_User;
+    string m_PassWord;
+    string m_DatabaseName;
+    int m_close_log;
+};
+
+//在作用域内持有一个连接，离开时自动归还
+class connectionRAII {
+public:
+    connectionRAII(MYSQL **con, connection_pool *connPool);
+
+    ~connectionRAII();
+
+    //查询出错后调用，连接归还时关闭
+    void broken() {
+        brokenRAII = true;
+    }
+
+private:
+    MYSQL *conRAII;
+    connection_pool *poolRAII;
+    bool brokenRAII;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "file_cache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+
+file_cache::file_cache(size_t max_bytes, size_t max_file_size, int valid) : m_max_bytes(max_bytes),
+                                                                            m_max_file_size(max_file_size),
+                                                                            m_valid(valid),
+                                                                            m_bytes(0) {
+}
+
+file_cache::~file_cache() {
+    m_lock.lock();
+    while (!m_lru.empty())
+        erase(m_lru.back());
+    m_lock.unlock();
+}
+
+file_entry *file_cache::acquire(const char *path, bool can_stat) {
+    m_lock.lock();
+    auto it = m_index.find(path);
+    if (it == m_index.end()) {
+        m_lock.unlock();
+        return NULL;
+    }
+    file_entry *entry = *it->second;
+    entry->refs++;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    m_lock.unlock();
+
+    //超过有效期后重新stat，文件被修改或删除时丢弃旧映射
+    time_t cur = time(NULL);
+    time_t checked = entry->checked.load();
+    if (cur - checked >= m_valid) {
+        //调用者不能阻塞在磁盘上，交给可以stat的线程重新确认
+        if (!can_stat) {
+            release(entry);
+            return NULL;
+        }
+        //只有把checked换成当前时间的线程去stat，其他线程在此期间仍用旧映射
+        if (entry->checked.compare_exchange_strong(checked, cur)) {
+            struct stat st;
+            if (stat(path, &st) < 0 || st.st_ino != entry->st.st_ino || st.st_size != entry->st.st_size ||
+                st.st_mtim.tv_sec != entry->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != entry->st.st_mtim.tv_nsec ||
+                st.st_mode != entry->st.st_mode) {
+                m_lock.lock();
+                it = m_index.find(path);
+                if (it != m_index.end() && *it->second == entry)
+                    erase(entry);
+                m_lock.unlock();
+                release(entry);
+                return NULL;
+            }
+        }
+    }
+    entry->hits++;
+    entry->bytes += entry->st.st_size;
+    return entry;
+}
+
+file_entry *file_cache::load(const char *path, const struct stat &st, bool populate) {
+    if (!S_ISREG(st.st_mode) || st.st_size == 0 || (size_t) st.st_size > m_max_file_size ||
+        (size_t) st.st_size > m_max_bytes)
+        return NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (populate)
+        readahead(fd, 0, st.st_size);
+    char *addr = (char *) mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    file_entry *entry = new file_entry;
+    entry->path = path;
+    entry->addr = addr;
+    entry->st = st;
+    entry->refs = 2;
+    entry->checked = time(NULL);
+    entry->hits = populate ? 0 : 1;
+    entry->bytes = populate ? 0 : st.st_size;
+    entry->scanned = 0;
+
+    m_lock.lock();
+    //并发加载同一文件时以最后一次为准
+    auto it = m_index.find(entry->path);
+    if (it != m_index.end())
+        erase(*it->second);
+    while (m_bytes + st.st_size > m_max_bytes && !m_lru.empty())
+        erase(m_lru.back());
+    m_lru.push_front(entry);
+    m_index[entry->path] = m_lru.begin();
+    m_bytes += st.st_size;
+    m_lock.unlock();
+    return entry;
+}
+
+void file_cache::release(file_entry *entry) {
+    if (--entry->refs == 0) {
+        munmap(entry->addr, entry->st.st_size);
+        delete entry;
+    }
+}
+
+vector<file_entry *> file_cache::top(int n) {
+    //先取出计数快照再排序，避免排序过程中计数被其他线程修改
+    struct ranked_entry {
+        long hits;
+        long bytes;
+        file_entry *entry;
+    };
+    vector<ranked_entry> ranked;
+    m_lock.lock();
+    for (file_entry *entry : m_lru) {
+        entry->refs++;
+        ranked.push_back({entry->hits.load(), entry->bytes.load(), entry});
+    }
+    m_lock.unlock();
+
+    //请求次数相同时发送字节多的更热，冷启动时缺页的代价更大
+    sort(ranked.begin(), ranked.end(), [](const ranked_entry &a, const ranked_entry &b) {
+        return a.hits != b.hits ? a.hits > b.hits : a.bytes > b.bytes;
+    });
+    vector<file_entry *> entries;
+    for (size_t i = 0; i < ranked.size(); ++i) {
+        file_entry *entry = ranked[i].entry;
+        entry->hits = entry->hits / 2;
+        entry->bytes = entry->bytes / 2;
+        if (i < (size_t) n && ranked[i].hits > 0)
+            entries.push_back(entry);
+        else
+            release(entry);
+    }
+    return entries;
+}
+
+void file_cache::erase(file_entry *entry) {
+    auto it = m_index.find(entry->path);
+    m_lru.erase(it->second);
+    m_index.erase(it);
+    m_bytes -= entry->st.st_size;
+    release(entry);
+}
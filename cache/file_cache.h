@@ -0,0 +1,61 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <list>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <unordered_map>
+#include <ctime>
+#include <sys/stat.h>
+#include "../lock/locker.h"
+
+using namespace std;
+
+//一个已映射的静态文件，缓存本身和每个正在发送它的连接各持有一个引用
+struct file_entry {
+    string path;
+    char *addr;
+    struct stat st;
+    atomic<int> refs;
+    atomic<time_t> checked;   //最近一次确认文件未变化的时间，由CAS成功的线程负责重新stat
+    atomic<long> hits;        //请求次数，用于统计热点文件
+    atomic<long> bytes;       //发送字节数
+    atomic<int> scanned;      //HTML子资源扫描状态: 0未扫描 1扫描中 2已完成
+    string preload;           //扫描完成后生成的Link预加载头，scanned为2后只读
+};
+
+class file_cache {
+public:
+    /*max_bytes是缓存映射的总字节数上限，max_file_size以上的文件不缓存，valid秒内不重新stat*/
+    file_cache(size_t max_bytes, size_t max_file_size = 4 * 1024 * 1024, int valid = 5);
+
+    ~file_cache();
+
+    /*命中时返回增加了引用的条目，并计入一次请求；文件已变化或未缓存时返回NULL。
+     *can_stat为false时(主线程直接应答)条目到了重新确认的时间也返回NULL，不在调用线程中stat*/
+    file_entry *acquire(const char *path, bool can_stat = true);
+
+    //映射文件并加入缓存，populate为true时预读整个文件并预先建立页表
+    file_entry *load(const char *path, const struct stat &st, bool populate = false);
+
+    void release(file_entry *entry);
+
+    //按请求次数(相同时按发送字节数)返回最热的n个文件，并将计数减半使统计跟随近期流量
+    vector<file_entry *> top(int n);
+
+private:
+    //从索引中摘除entry并释放缓存持有的引用，调用者需持有m_lock
+    void erase(file_entry *entry);
+
+private:
+    size_t m_max_bytes;
+    size_t m_max_file_size;
+    int m_valid;
+    size_t m_bytes;
+    list<file_entry *> m_lru;                                   //表头为最近使用
+    unordered_map<string, list<file_entry *>::iterator> m_index;
+    locker m_lock;
+};
+
+#endif
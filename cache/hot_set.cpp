@@ -0,0 +1,128 @@
+#include "hot_set.h"
+
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+//预热线程共享的待加载列表
+struct prefetch_job {
+    file_cache *cache;
+    vector<string> paths;
+    atomic<size_t> next;
+    atomic<int> loaded;
+};
+
+hot_set::hot_set(file_cache *cache, const string &file, int interval, int max_files) : m_cache(cache),
+                                                                                      m_file(file),
+                                                                                      m_interval(interval),
+                                                                                      m_max_files(max_files),
+                                                                                      m_started(false),
+                                                                                      m_stop(false) {
+}
+
+hot_set::~hot_set() {
+    if (m_started) {
+        m_stop_lock.lock();
+        m_stop = true;
+        m_stop_cond.broadcast();
+        m_stop_lock.unlock();
+        pthread_join(m_thread, NULL);
+    }
+}
+
+int hot_set::warm(int thread_number) {
+    ifstream in(m_file);
+    if (!in)
+        return 0;
+
+    prefetch_job job;
+    job.cache = m_cache;
+    job.next = 0;
+    job.loaded = 0;
+    string line;
+    while (getline(in, line)) {
+        //每行格式: 请求次数 发送字节数 文件路径
+        istringstream fields(line);
+        long hits, bytes;
+        string path;
+        if (fields >> hits >> bytes && getline(fields >> ws, path) && !path.empty())
+            job.paths.push_back(path);
+    }
+
+    if (thread_number <= 0)
+        thread_number = 1;
+    pthread_t *threads = new pthread_t[thread_number];
+    int started = 0;
+    for (int i = 0; i < thread_number; ++i) {
+        if (pthread_create(threads + started, NULL, prefetcher, &job) == 0)
+            ++started;
+    }
+    if (started == 0)
+        prefetcher(&job);
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    delete[] threads;
+    return job.loaded;
+}
+
+void *hot_set::prefetcher(void *arg) {
+    prefetch_job *job = (prefetch_job *) arg;
+    while (true) {
+        size_t i = job->next++;
+        if (i >= job->paths.size())
+            break;
+        const char *path = job->paths[i].c_str();
+        struct stat st;
+        if (stat(path, &st) < 0 || !(st.st_mode & S_IROTH))
+            continue;
+        //readahead + MAP_POPULATE，文件数据、元数据和映射都在开始监听前就绪
+        file_entry *entry = job->cache->load(path, st, true);
+        if (entry) {
+            job->cache->release(entry);
+            job->loaded++;
+        }
+    }
+    return job;
+}
+
+void hot_set::start() {
+    m_started = pthread_create(&m_thread, NULL, recorder, this) == 0;
+}
+
+void *hot_set::recorder(void *arg) {
+    hot_set *set = (hot_set *) arg;
+    set->m_stop_lock.lock();
+    while (!set->m_stop) {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += set->m_interval;
+        set->m_stop_cond.timewait(set->m_stop_lock.get(), t);
+        if (set->m_stop)
+            break;
+        set->m_stop_lock.unlock();
+        set->save();
+        set->m_stop_lock.lock();
+    }
+    set->m_stop_lock.unlock();
+    return set;
+}
+
+bool hot_set::save() {
+    vector<file_entry *> entries = m_cache->top(m_max_files);
+
+    //先写临时文件再rename，进程在写入中途退出也不会留下残缺的快照
+    string tmp = m_file + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    bool ok = fp != NULL;
+    for (file_entry *entry : entries) {
+        if (fp)
+            fprintf(fp, "%ld %ld %s\n", entry->hits.load(), entry->bytes.load(), entry->path.c_str());
+        m_cache->release(entry);
+    }
+    if (!fp)
+        return false;
+    ok = fclose(fp) == 0 && ok;
+    return ok && rename(tmp.c_str(), m_file.c_str()) == 0;
+}
@@ -0,0 +1,46 @@
+#ifndef HOT_SET_H
+#define HOT_SET_H
+
+#include <string>
+#include <pthread.h>
+#include "file_cache.h"
+#include "../lock/locker.h"
+
+using namespace std;
+
+//周期性地把最热的静态文件记录到快照，重启时据此预热文件缓存
+class hot_set {
+public:
+    /*file是快照文件路径，每interval秒记录一次请求次数最多的max_files个文件*/
+    hot_set(file_cache *cache, const string &file, int interval = 60, int max_files = 1000);
+
+    //停止并join后台线程，之后才能释放文件缓存
+    ~hot_set();
+
+    //读取快照并用thread_number个线程并行预读、映射其中的文件，全部完成后返回
+    int warm(int thread_number = 4);
+
+    //启动后台线程定期写快照
+    void start();
+
+    //立即写一次快照
+    bool save();
+
+private:
+    static void *recorder(void *arg);
+
+    static void *prefetcher(void *arg);
+
+private:
+    file_cache *m_cache;
+    string m_file;
+    int m_interval;
+    int m_max_files;
+    bool m_started;
+    bool m_stop;
+    locker m_stop_lock;
+    cond m_stop_cond;
+    pthread_t m_thread;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include "neg_cache.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+neg_cache::neg_cache(int max_size, int ttl) : m_max_size(max_size), m_ttl(ttl) {
+    //inotify不可用时只依赖TTL失效
+    m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+neg_cache::~neg_cache() {
+    if (m_inotify_fd >= 0)
+        close(m_inotify_fd);
+}
+
+bool neg_cache::lookup(const char *path) {
+    time_t cur = time(NULL);
+    m_lock.lock();
+    auto it = m_index.find(path);
+    if (it == m_index.end()) {
+        m_lock.unlock();
+        return false;
+    }
+    if (it->second->expire <= cur) {
+        m_lru.erase(it->second);
+        m_index.erase(it);
+        m_lock.unlock();
+        return false;
+    }
+    m_lock.unlock();
+    return true;
+}
+
+void neg_cache::insert(const char *path) {
+    string key(path);
+    time_t expire = time(NULL) + m_ttl;
+    m_lock.lock();
+    auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        it->second->expire = expire;
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        m_lock.unlock();
+        return;
+    }
+    if ((int) m_index.size() >= m_max_size) {
+        m_index.erase(m_lru.back().path);
+        m_lru.pop_back();
+    }
+    m_lru.push_front({key, expire});
+    m_index[key] = m_lru.begin();
+    m_lock.unlock();
+
+    watch_parent(key);
+}
+
+void neg_cache::watch_parent(const string &path) {
+    if (m_inotify_fd < 0)
+        return;
+    //同一目录重复添加时内核返回同一个watch，不会累积
+    const uint32_t mask = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+    string dir = path;
+    while (true) {
+        size_t pos = dir.rfind('/');
+        if (pos == string::npos)
+            return;
+        dir.resize(pos == 0 ? 1 : pos);
+        if (inotify_add_watch(m_inotify_fd, dir.c_str(), mask) >= 0 || errno != ENOENT || pos == 0)
+            return;
+    }
+}
+
+void neg_cache::handle_events() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while (read(m_inotify_fd, buf, sizeof(buf)) > 0)
+        changed = true;
+    //目录下新增文件或子目录，之前记录的不存在路径可能已经失效
+    if (changed)
+        clear();
+}
+
+void neg_cache::clear() {
+    m_lock.lock();
+    m_index.clear();
+    m_lru.clear();
+    m_lock.unlock();
+}
@@ -0,0 +1,53 @@
+#ifndef NEG_CACHE_H
+#define NEG_CACHE_H
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <ctime>
+#include "../lock/locker.h"
+
+using namespace std;
+
+//最近确认不存在的文件路径，命中时跳过stat直接返回404
+class neg_cache {
+public:
+    /*max_size是最多缓存的路径数，ttl是每条记录的有效秒数*/
+    neg_cache(int max_size = 4096, int ttl = 10);
+
+    ~neg_cache();
+
+    //路径最近被确认不存在且未过期时返回true
+    bool lookup(const char *path);
+
+    void insert(const char *path);
+
+    //inotify描述符，由主循环注册到epoll中
+    int get_fd() const {
+        return m_inotify_fd;
+    }
+
+    //读取inotify事件，被监视目录中有新文件出现时清空缓存
+    void handle_events();
+
+private:
+    //监视离path最近的已存在的上级目录
+    void watch_parent(const string &path);
+
+    void clear();
+
+private:
+    struct entry {
+        string path;
+        time_t expire;
+    };
+
+    int m_max_size;
+    int m_ttl;
+    int m_inotify_fd;
+    list<entry> m_lru;                                   //表头为最近插入
+    unordered_map<string, list<entry>::iterator> m_index;
+    locker m_lock;
+};
+
+#endif
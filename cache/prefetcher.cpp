@@ -0,0 +1,154 @@
+#include "prefetcher.h"
+
+#include <cctype>
+#include <cstring>
+#include <strings.h>
+#include <vector>
+
+html_prefetcher::html_prefetcher(file_cache *cache, bool preload, int max_requests)
+        : m_cache(cache), m_preload(preload), m_jobs(this, &html_prefetcher::handle, 1, max_requests) {
+}
+
+html_prefetcher::~html_prefetcher() {
+    m_jobs.stop();
+}
+
+void html_prefetcher::submit(file_entry *page, const char *url, const char *root) {
+    //每个file_entry对应文件的一个版本，文件修改后会生成新的条目重新扫描
+    int expected = 0;
+    if (!page->scanned.compare_exchange_strong(expected, 1))
+        return;
+
+    const char *slash = strrchr(url, '/');
+    scan_request request;
+    request.page = page;
+    request.url_dir = string(url, slash ? slash - url + 1 : 0);
+    request.root = root;
+
+    //扫描期间页面的映射不能被释放，队列满时放弃这次扫描，下次请求再提交
+    page->refs++;
+    if (!m_jobs.push(request)) {
+        page->scanned = 0;
+        m_cache->release(page);
+    }
+}
+
+void html_prefetcher::handle(scan_request &request) {
+    scan(request);
+    m_cache->release(request.page);
+}
+
+//在[p, end)中查找标签内的属性值，找不到时返回false
+static bool find_attr(const char *p, const char *end, const char *name, string &value) {
+    size_t name_len = strlen(name);
+    for (; p + name_len < end; ++p) {
+        if (strncasecmp(p, name, name_len) != 0 || !isspace((unsigned char) p[-1]))
+            continue;
+        const char *q = p + name_len;
+        while (q < end && isspace((unsigned char) *q))
+            ++q;
+        if (q >= end || *q != '=')
+            continue;
+        ++q;
+        while (q < end && isspace((unsigned char) *q))
+            ++q;
+        char quote = (q < end && (*q == '"' || *q == '\'')) ? *q++ : 0;
+        const char *v = q;
+        while (q < end && (quote ? *q != quote : !isspace((unsigned char) *q) && *q != '>'))
+            ++q;
+        value.assign(v, q - v);
+        return true;
+    }
+    return false;
+}
+
+void html_prefetcher::scan(const scan_request &request) {
+    const char *p = request.page->addr;
+    const char *end = p + request.page->st.st_size;
+    string preload;
+    int refs = 0;
+
+    while (refs < MAX_REFS && (p = (const char *) memchr(p, '<', end - p)) != NULL) {
+        const char *tag_end = (const char *) memchr(p, '>', end - p);
+        if (!tag_end)
+            break;
+
+        //只关心<link href>、<script src>和<img src>
+        string ref, rel;
+        const char *as = NULL;
+        if (strncasecmp(p, "<link", 5) == 0 && isspace((unsigned char) p[5])) {
+            if (find_attr(p + 5, tag_end, "rel", rel) && strcasecmp(rel.c_str(), "stylesheet") == 0 &&
+                find_attr(p + 5, tag_end, "href", ref))
+                as = "style";
+        } else if (strncasecmp(p, "<script", 7) == 0 && isspace((unsigned char) p[7])) {
+            if (find_attr(p + 7, tag_end, "src", ref))
+                as = "script";
+        } else if (strncasecmp(p, "<img", 4) == 0 && isspace((unsigned char) p[4])) {
+            if (find_attr(p + 4, tag_end, "src", ref))
+                as = "image";
+        }
+        p = tag_end + 1;
+
+        string path;
+        if (!as || !resolve(request.url_dir, ref, path) || !warm(request.root + path))
+            continue;
+        ++refs;
+
+        string link = "<" + path + ">; rel=preload; as=" + as;
+        if (preload.size() + link.size() + 2 <= MAX_PRELOAD_LEN)
+            preload += (preload.empty() ? "" : ", ") + link;
+    }
+
+    request.page->preload = preload;
+    request.page->scanned = 2;
+}
+
+bool html_prefetcher::resolve(const string &url_dir, const string &ref, string &path) {
+    //跳过外部链接、协议相对地址、data:等非本站资源
+    if (ref.empty() || ref.find("://") != string::npos || ref.compare(0, 2, "//") == 0 ||
+        ref.find(':') != string::npos || ref[0] == '#')
+        return false;
+    string raw = ref.substr(0, ref.find_first_of("?#"));
+    if (raw.empty())
+        return false;
+    if (raw[0] != '/')
+        raw = url_dir + raw;
+
+    //规范化"."和".."，不允许越过站点根目录
+    vector<string> segments;
+    size_t pos = 1;
+    while (pos <= raw.size()) {
+        size_t next = raw.find('/', pos);
+        if (next == string::npos)
+            next = raw.size();
+        string segment = raw.substr(pos, next - pos);
+        if (segment == "..") {
+            if (segments.empty())
+                return false;
+            segments.pop_back();
+        } else if (!segment.empty() && segment != ".") {
+            segments.push_back(segment);
+        }
+        pos = next + 1;
+    }
+    if (segments.empty())
+        return false;
+    path.clear();
+    for (size_t i = 0; i < segments.size(); ++i)
+        path += "/" + segments[i];
+    return true;
+}
+
+bool html_prefetcher::warm(const string &real_file) {
+    file_entry *entry = m_cache->acquire(real_file.c_str());
+    if (!entry) {
+        struct stat st;
+        if (stat(real_file.c_str(), &st) < 0 || !(st.st_mode & S_IROTH) || !S_ISREG(st.st_mode))
+            return false;
+        entry = m_cache->load(real_file.c_str(), st, true);
+        if (!entry)
+            return false;
+    }
+    m_cache->release(entry);
+    return true;
+}
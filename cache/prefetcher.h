@@ -0,0 +1,54 @@
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <string>
+#include "file_cache.h"
+#include "../threadpool/job_queue.h"
+
+using namespace std;
+
+//后台解析已发送的HTML页面，把其中引用的CSS/JS/图片提前载入文件缓存
+class html_prefetcher {
+public:
+    //每个页面最多预热的子资源数
+    static const int MAX_REFS = 32;
+    //Link预加载头的最大长度，需要放得进http_conn的写缓冲区
+    static const size_t MAX_PRELOAD_LEN = 480;
+
+    /*preload为true时为扫描过的页面生成Link: rel=preload响应头*/
+    html_prefetcher(file_cache *cache, bool preload, int max_requests = 1000);
+
+    //扫描完已提交的页面后join后台线程，之后才能释放文件缓存
+    ~html_prefetcher();
+
+    //提交一次扫描，同一版本的页面只会被扫描一次；url为页面的请求路径，root为所在站点根目录
+    void submit(file_entry *page, const char *url, const char *root);
+
+    bool preload() const {
+        return m_preload;
+    }
+
+private:
+    struct scan_request {
+        file_entry *page;
+        string url_dir;   //页面所在目录的请求路径，以'/'结尾
+        string root;
+    };
+
+    void handle(scan_request &request);
+
+    void scan(const scan_request &request);
+
+    //把页面中的引用解析为站点内的规范请求路径，外部链接返回false
+    static bool resolve(const string &url_dir, const string &ref, string &path);
+
+    //将子资源载入文件缓存，文件不存在或不可读时返回false
+    bool warm(const string &real_file);
+
+private:
+    file_cache *m_cache;
+    bool m_preload;
+    job_queue<html_prefetcher, scan_request> m_jobs;
+};
+
+#endif
@@ -1,5 +1,8 @@
 #include "config.h"
 
+#include <fstream>
+#include <sstream>
+
 Config::Config() {
     //端口号,默认9006
     PORT = 9006;
@@ -19,9 +22,63 @@ Config::Config() {
     //优雅关闭链接，默认不使用
     OPT_LINGER = 0;
 
+    //数据库连接池数量,默认8,0表示不启用登录校验
+    sql_num = 8;
+
+    //需要修改的数据库信息,登录名,密码,库名
+    sql_user = "root";
+    sql_passwd = "root";
+    sql_database = "qgydb";
+
+    //登录会话有效期,默认1800秒,0表示不启用
+    session_ttl = 1800;
+
+    //会话快照路径,默认不启用
+    session_file = "";
+
+    //单IP并发连接数上限,默认0不限制
+    max_conns_per_ip = 0;
+
+    //单IP每秒请求数上限,默认0不限制
+    rate_per_ip = 0;
+
+    //连接各阶段超时,默认首字节15秒,请求头30秒,请求体和响应不低于1KB/s,keep-alive空闲15秒
+    timeouts.first_byte = 15;
+    timeouts.header = 30;
+    timeouts.body_rate = 1024;
+    timeouts.write_rate = 1024;
+    timeouts.idle = 15;
+
+    //每次写事件的发送预算,默认256KB,0表示发到EAGAIN为止
+    write_budget_kb = 256;
+
+    //短剩余优先,默认不启用,按就绪顺序发送
+    srpt = 0;
+
+    //主线程直接应答,默认启用
+    inline_reply = 1;
+
     //线程池内的线程数量,默认8
     thread_num = 8;
 
+    //最多线程数,默认0与thread_num相同,线程数固定
+    max_thread_num = 0;
+
+    //工作窃取,默认不启用,所有线程共用一个队列
+    work_stealing = 0;
+
+    //公平调度,默认不启用,先到先处理
+    fair_sched = 0;
+
+    //磁盘I/O线程数量,默认2,0表示不启用
+    io_thread_num = 2;
+
+    //负缓存大小,默认4096,0表示不启用
+    neg_cache_size = 4096;
+
+    //负缓存有效期,默认10秒,0表示不启用
+    neg_cache_ttl = 10;
+
     //关闭日志,默认不关闭
     close_log = 0;
 
@@ -30,12 +87,31 @@ Config::Config() {
 
     web_root = "/www";
 
-    proxy_config["localhost"] = "www.baidu.com:80";
+    //虚拟主机配置文件,默认不启用
+    vhost_file = "";
+
+    //文件缓存大小,默认64MB,0表示不启用
+    file_cache_mb = 64;
+
+    //热点文件快照路径,默认不启用
+    hot_set_file = "";
+
+    //HTML子资源预取,默认不启用
+    prefetch_mode = 0;
+
+    //代理响应缓存大小,默认32MB,0表示不启用
+    response_cache_mb = 32;
+
+    //请求体或响应体不小于64KB时用splice转发,0表示不启用
+    splice_kb = 64;
+
+    //FastCGI应用地址,默认不启用
+    fcgi_address = "";
 }
 
 void Config::parse_arg(int argc, char *argv[]) {
     int opt;
-    const char *str = "p:l:m:o:t:c:a:d";
+    const char *str = "p:l:m:o:s:t:i:e:n:c:a:dv:F:H:P:x:R:S:f:T:D:N:r:W:M:Q:O:B:E:I:";
     while ((opt = getopt(argc, argv, str)) != -1) {
         switch (opt) {
             case 'p': {
@@ -54,10 +130,26 @@ void Config::parse_arg(int argc, char *argv[]) {
                 OPT_LINGER = atoi(optarg);
                 break;
             }
+            case 's': {
+                sql_num = atoi(optarg);
+                break;
+            }
             case 't': {
                 thread_num = atoi(optarg);
                 break;
             }
+            case 'i': {
+                io_thread_num = atoi(optarg);
+                break;
+            }
+            case 'e': {
+                neg_cache_size = atoi(optarg);
+                break;
+            }
+            case 'n': {
+                neg_cache_ttl = atoi(optarg);
+                break;
+            }
             case 'c': {
                 close_log = atoi(optarg);
                 break;
@@ -66,6 +158,85 @@ void Config::parse_arg(int argc, char *argv[]) {
                 actor_model = atoi(optarg);
                 break;
             }
+            case 'v': {
+                vhost_file = string(optarg);
+                break;
+            }
+            case 'F': {
+                file_cache_mb = atoi(optarg);
+                break;
+            }
+            case 'H': {
+                hot_set_file = string(optarg);
+                break;
+            }
+            case 'P': {
+                prefetch_mode = atoi(optarg);
+                break;
+            }
+            case 'x': {
+                if (!load_proxy_config(optarg))
+                    fprintf(stderr, "load proxy config %s failed\n", optarg);
+                break;
+            }
+            case 'R': {
+                response_cache_mb = atoi(optarg);
+                break;
+            }
+            case 'S': {
+                splice_kb = atoi(optarg);
+                break;
+            }
+            case 'f': {
+                fcgi_address = string(optarg);
+                break;
+            }
+            case 'T': {
+                session_ttl = atoi(optarg);
+                break;
+            }
+            case 'D': {
+                session_file = string(optarg);
+                break;
+            }
+            case 'N': {
+                max_conns_per_ip = atoi(optarg);
+                break;
+            }
+            case 'r': {
+                rate_per_ip = atoi(optarg);
+                break;
+            }
+            case 'M': {
+                max_thread_num = atoi(optarg);
+                break;
+            }
+            case 'Q': {
+                fair_sched = atoi(optarg);
+                break;
+            }
+            case 'W': {
+                work_stealing = atoi(optarg);
+                break;
+            }
+            case 'B': {
+                write_budget_kb = atoi(optarg);
+                break;
+            }
+            case 'E': {
+                srpt = atoi(optarg);
+                break;
+            }
+            case 'I': {
+                inline_reply = atoi(optarg);
+                break;
+            }
+            case 'O': {
+                //首字节秒数,请求头秒数,请求体速率,响应速率,空闲秒数，省略的项保持默认
+                sscanf(optarg, "%d,%d,%d,%d,%d", &timeouts.first_byte, &timeouts.header, &timeouts.body_rate,
+                       &timeouts.write_rate, &timeouts.idle);
+                break;
+            }
             case 'd':{
                 web_root = string(optarg);
             }
@@ -73,4 +244,24 @@ void Config::parse_arg(int argc, char *argv[]) {
                 break;
         }
     }
-}
\ No newline at end of file
+}
+
+bool Config::load_proxy_config(const char *file_name) {
+    ifstream in(file_name);
+    if (!in)
+        return false;
+    //配置文件替换默认的代理配置
+    proxy_config.clear();
+    string line;
+    while (getline(in, line)) {
+        //每行为"Host 后端列表 [调度策略] [探测路径]"，Host之后的部分整体交给upstream_pool解析
+        istringstream fields(line);
+        string host, target, word;
+        if (!(fields >> host >> target) || host[0] == '#')
+            continue;
+        while (fields >> word)
+            target.append(" ").append(word);
+        proxy_config[host] = target;
+    }
+    return true;
+}
@@ -13,6 +13,9 @@ public:
 
     void parse_arg(int argc, char *argv[]);
 
+    //从文件加载反向代理配置，每行为"Host 上游地址:端口"
+    bool load_proxy_config(const char *file_name);
+
     //端口号
     int PORT;
 
@@ -31,9 +34,59 @@ public:
     //优雅关闭链接
     int OPT_LINGER;
 
+    //数据库连接池数量
+    int sql_num;
+
+    //数据库登录名、密码和库名
+    string sql_user;
+    string sql_passwd;
+    string sql_database;
+
+    //登录会话的空闲有效秒数
+    int session_ttl;
+
+    //会话快照文件
+    string session_file;
+
+    //单个客户端IP的最大并发连接数
+    int max_conns_per_ip;
+
+    //单个客户端IP每秒的请求数
+    int rate_per_ip;
+
+    //连接各阶段的超时
+    conn_timeouts timeouts;
+
+    //每次写事件最多发送的KB数
+    int write_budget_kb;
+
+    //是否优先发送剩余字节少的响应
+    int srpt;
+
+    //是否在主线程中直接应答缓存命中和出错的请求
+    int inline_reply;
+
     //线程池内的线程数量
     int thread_num;
 
+    //线程池排队过久时最多扩充到的线程数
+    int max_thread_num;
+
+    //线程池是否使用每线程队列加工作窃取
+    int work_stealing;
+
+    //线程池是否按请求类别和客户端公平调度
+    int fair_sched;
+
+    //磁盘I/O线程数量
+    int io_thread_num;
+
+    //负缓存最多记录的路径数
+    int neg_cache_size;
+
+    //负缓存记录的有效秒数
+    int neg_cache_ttl;
+
     //是否关闭日志
     int close_log;
 
@@ -42,7 +95,28 @@ public:
 
     string web_root;
 
+    //虚拟主机配置文件
+    string vhost_file;
+
+    //文件缓存大小(MB)
+    int file_cache_mb;
+
+    //热点文件快照
+    string hot_set_file;
+
+    //HTML子资源预取模式
+    int prefetch_mode;
+
     map<string, string> proxy_config;
+
+    //代理响应缓存大小(MB)
+    int response_cache_mb;
+
+    //代理转发改用splice的最小body大小(KB)
+    int splice_kb;
+
+    //FastCGI应用地址，unix:/path或host:port，为空时不启用
+    string fcgi_address;
 };
 
 #endif
\ No newline at end of file
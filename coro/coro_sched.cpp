@@ -0,0 +1,81 @@
+#include "coro_sched.h"
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+coro_sched::waiter::waiter(coro_sched *sched, int fd) : m_sched(sched), m_fd(fd), m_events(0) {
+    //fd被新连接复用时，旧连接的协程可能还没结束
+    sched->cancel(fd);
+    sched->m_waiters[fd] = this;
+}
+
+coro_sched::waiter::~waiter() {
+    if (m_fd >= 0 && m_sched->m_waiters[m_fd] == this)
+        m_sched->m_waiters[m_fd] = NULL;
+}
+
+coro_sched::coro_sched(int max_fd) : m_max_fd(max_fd) {
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventfd < 0)
+        throw std::exception();
+    m_waiters = new waiter *[max_fd]();
+}
+
+coro_sched::~coro_sched() {
+    //协程帧析构时waiter会把自己从表中撤销
+    for (int fd = 0; fd < m_max_fd; ++fd) {
+        waiter *w = m_waiters[fd];
+        if (w && w->m_handle)
+            w->m_handle.destroy();
+    }
+    for (size_t i = 0; i < m_posted.size(); ++i)
+        m_posted[i].destroy();
+    delete[] m_waiters;
+    close(m_eventfd);
+}
+
+void coro_sched::resume(waiter *w, uint32_t events) {
+    w->m_events |= events;
+    if (w->m_handle) {
+        std::coroutine_handle<> h = w->m_handle;
+        w->m_handle = nullptr;
+        h.resume();
+    }
+}
+
+bool coro_sched::deliver(int fd, uint32_t events) {
+    waiter *w = m_waiters[fd];
+    if (!w)
+        return false;
+    resume(w, events);
+    return true;
+}
+
+void coro_sched::cancel(int fd) {
+    waiter *w = m_waiters[fd];
+    if (!w)
+        return;
+    m_waiters[fd] = NULL;
+    w->m_fd = -1;
+    //协程正在工作线程中时只留下CLOSED，它回到主线程后在wait上看到
+    resume(w, CLOSED);
+}
+
+void coro_sched::post(std::coroutine_handle<> h) {
+    m_posted_lock.lock();
+    m_posted.push_back(h);
+    m_posted_lock.unlock();
+    eventfd_write(m_eventfd, 1);
+}
+
+void coro_sched::run_posted() {
+    eventfd_t count;
+    eventfd_read(m_eventfd, &count);
+
+    std::vector<std::coroutine_handle<>> posted;
+    m_posted_lock.lock();
+    posted.swap(m_posted);
+    m_posted_lock.unlock();
+    for (size_t i = 0; i < posted.size(); ++i)
+        posted[i].resume();
+}
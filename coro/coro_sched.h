@@ -0,0 +1,154 @@
+#ifndef CORO_SCHED_H
+#define CORO_SCHED_H
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <vector>
+#include "../lock/locker.h"
+
+//不等待结果的协程，创建后立即运行到第一个挂起点，执行完自动释放协程帧
+struct coro_task {
+    struct promise_type {
+        coro_task get_return_object() {
+            return coro_task();
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+/*主线程上的协程调度器。每个连接一个协程，挂起在wait上等待该fd的事件，事件循环用deliver恢复它；
+ *协程可以切到工作线程执行会阻塞的逻辑，再经to_main回到主线程。
+ *除切换线程的这一段外协程只在主线程中运行，等待状态只由主线程读写，不需要加锁*/
+class coro_sched {
+public:
+    static const uint32_t CLOSED = 1u << 31;    //连接已被定时器或错误事件关闭，协程应当结束
+
+    //协程帧中的等待状态，构造时登记到fd上，析构时撤销
+    class waiter {
+    public:
+        waiter(coro_sched *sched, int fd);
+
+        ~waiter();
+
+    private:
+        friend class coro_sched;
+
+        coro_sched *m_sched;
+        int m_fd;                           //被cancel后为-1
+        uint32_t m_events;                  //协程不在等待时到达的事件，下次wait直接返回
+        std::coroutine_handle<> m_handle;   //挂起在wait上时为该协程
+    };
+
+    struct wait_awaiter {
+        waiter *w;
+
+        bool await_ready() const noexcept {
+            return w->m_events != 0;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept {
+            w->m_handle = h;
+        }
+
+        uint32_t await_resume() noexcept {
+            uint32_t events = w->m_events;
+            w->m_events = 0;
+            return events;
+        }
+    };
+
+    struct main_awaiter {
+        coro_sched *sched;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            sched->post(h);
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    //记下协程后把请求放入ready，由事件循环一起交给线程池，工作线程取到请求时恢复协程
+    template<typename T>
+    struct offload_awaiter {
+        T *request;
+        std::vector<T *> *ready;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            request->m_coro = h.address();
+            ready->push_back(request);
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    explicit coro_sched(int max_fd);
+
+    //销毁仍然挂起的协程
+    ~coro_sched();
+
+    //等待fd上的下一个epoll事件，返回事件掩码，连接被关闭时带CLOSED
+    wait_awaiter wait(waiter &w) {
+        return wait_awaiter{&w};
+    }
+
+    template<typename T>
+    static offload_awaiter<T> offload(T *request, std::vector<T *> &ready) {
+        return offload_awaiter<T>{request, &ready};
+    }
+
+    //在工作线程中调用，回到主线程继续执行
+    main_awaiter to_main() {
+        return main_awaiter{this};
+    }
+
+    //把事件交给fd上的协程，它正挂起时在当前线程恢复；fd上没有协程时返回false
+    bool deliver(int fd, uint32_t events);
+
+    //连接关闭时撤销fd上的协程，它在下一个挂起点收到CLOSED后结束
+    void cancel(int fd);
+
+    //有协程从工作线程回到主线程时可读
+    int get_fd() const {
+        return m_eventfd;
+    }
+
+    //事件循环在get_fd()可读时调用，恢复回到主线程的协程
+    void run_posted();
+
+private:
+    void post(std::coroutine_handle<> h);
+
+    static void resume(waiter *w, uint32_t events);
+
+private:
+    int m_eventfd;
+    int m_max_fd;
+    waiter **m_waiters;
+
+    locker m_posted_lock;
+    std::vector<std::coroutine_handle<>> m_posted;
+};
+
+#endif
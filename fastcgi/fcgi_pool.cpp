@@ -0,0 +1,435 @@
+#include "fcgi_pool.h"
+
+#include <unistd.h>
+#include <netdb.h>
+#include <cerrno>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//FastCGI协议常量
+enum {
+    FCGI_VERSION_1 = 1,
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+    FCGI_GET_VALUES = 9,
+    FCGI_GET_VALUES_RESULT = 10,
+    FCGI_RESPONDER = 1,
+    FCGI_KEEP_CONN = 1
+};
+
+//单条记录的最大内容长度
+static const size_t FCGI_MAX_CONTENT = 65535;
+
+//一条到应用的连接，写请求时持有写锁，读记录的工作线程持有reading标记
+struct fcgi_conn {
+    int fd;
+    atomic<bool> broken;
+    int max_reqs;
+    int active;             //占用的请求ID数，受pool锁保护
+    uint16_t next_id;
+    bool reading;
+    locker write_lock;
+    locker lock;
+    cond ready;
+    unordered_map<uint16_t, fcgi_request *> reqs;   //已中止、等待应用确认的请求对应NULL
+
+    fcgi_conn() : fd(-1), broken(true), max_reqs(1), active(0), next_id(1), reading(false) {}
+};
+
+static void put_header(string &buf, int type, uint16_t id, size_t len) {
+    unsigned char h[8] = {FCGI_VERSION_1, (unsigned char) type, (unsigned char) (id >> 8), (unsigned char) id,
+                          (unsigned char) (len >> 8), (unsigned char) len, 0, 0};
+    buf.append((char *) h, 8);
+}
+
+//把一段流数据切成不超过65535字节的记录，len为0时写入结束记录
+static void put_stream(string &buf, int type, uint16_t id, const char *data, size_t len) {
+    while (len > 0) {
+        size_t n = len < FCGI_MAX_CONTENT ? len : FCGI_MAX_CONTENT;
+        put_header(buf, type, id, n);
+        buf.append(data, n);
+        data += n;
+        len -= n;
+    }
+    put_header(buf, type, id, 0);
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, data, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//读取一条完整记录，content中不含填充
+static bool read_record(int fd, int &type, uint16_t &id, string &content) {
+    unsigned char h[8];
+    if (!read_all(fd, (char *) h, 8) || h[0] != FCGI_VERSION_1)
+        return false;
+    type = h[1];
+    id = (h[2] << 8) | h[3];
+    size_t len = (h[4] << 8) | h[5];
+    content.resize(len + h[6]);
+    if (!read_all(fd, &content[0], content.size()))
+        return false;
+    content.resize(len);
+    return true;
+}
+
+//空闲连接上不应有任何数据，可读说明对端已经关闭或出错
+static bool idle_closed(int fd) {
+    struct pollfd pfd = {fd, POLLIN | POLLRDHUP, 0};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+void fcgi_pool::add_param(string &params, const char *name, const char *value, size_t value_len) {
+    size_t lens[2] = {strlen(name), value_len};
+    for (size_t len : lens) {
+        if (len < 128) {
+            params.push_back((char) len);
+        } else {
+            params.push_back((char) ((len >> 24) | 0x80));
+            params.push_back((char) (len >> 16));
+            params.push_back((char) (len >> 8));
+            params.push_back((char) len);
+        }
+    }
+    params.append(name, lens[0]);
+    params.append(value, value_len);
+}
+
+fcgi_pool::fcgi_pool(const string &address, int size) : m_address(address), m_unix(false), m_size(size) {
+    for (int i = 0; i < m_size; ++i)
+        m_conns.push_back(new fcgi_conn);
+}
+
+fcgi_pool::~fcgi_pool() {
+    for (fcgi_conn *conn : m_conns) {
+        if (conn->fd >= 0)
+            close(conn->fd);
+        delete conn;
+    }
+}
+
+bool fcgi_pool::init() {
+    if (m_address.compare(0, 5, "unix:") == 0) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        string path = m_address.substr(5);
+        if (path.empty() || path.size() >= sizeof(addr.sun_path))
+            return false;
+        strcpy(addr.sun_path, path.c_str());
+        m_unix = true;
+        m_sockaddr.assign((char *) &addr, (char *) &addr + sizeof(addr));
+        return true;
+    }
+
+    size_t colon = m_address.rfind(':');
+    if (colon == string::npos)
+        return false;
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(m_address.substr(0, colon).c_str(), m_address.substr(colon + 1).c_str(), &hints, &result) != 0)
+        return false;
+    m_sockaddr.assign((char *) result->ai_addr, (char *) result->ai_addr + result->ai_addrlen);
+    freeaddrinfo(result);
+    return true;
+}
+
+int fcgi_pool::connect_app() {
+    int fd = socket(m_unix ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    struct timeval tv = {IO_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *) &m_sockaddr[0], m_sockaddr.size()) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!m_unix) {
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+    return fd;
+}
+
+int fcgi_pool::query_max_reqs(int fd) {
+    string params, buf;
+    add_param(params, "FCGI_MPXS_CONNS", "", 0);
+    add_param(params, "FCGI_MAX_REQS", "", 0);
+    put_header(buf, FCGI_GET_VALUES, 0, params.size());
+    buf.append(params);
+
+    //不回应FCGI_GET_VALUES的应用按不支持多路复用处理
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int type;
+    uint16_t id;
+    string content;
+    int max_reqs = 1;
+    if (write_all(fd, buf.data(), buf.size()) && read_record(fd, type, id, content) &&
+        type == FCGI_GET_VALUES_RESULT) {
+        bool mpxs = false;
+        int reqs = MAX_REQS;
+        size_t pos = 0;
+        while (pos < content.size()) {
+            size_t lens[2];
+            for (int i = 0; i < 2 && pos < content.size(); ++i) {
+                unsigned char c = content[pos];
+                if (c < 128) {
+                    lens[i] = c;
+                    pos += 1;
+                } else {
+                    lens[i] = ((c & 0x7f) << 24) | ((unsigned char) content[pos + 1] << 16) |
+                              ((unsigned char) content[pos + 2] << 8) | (unsigned char) content[pos + 3];
+                    pos += 4;
+                }
+            }
+            string name = content.substr(pos, lens[0]);
+            string value = content.substr(pos + lens[0], lens[1]);
+            pos += lens[0] + lens[1];
+            if (name == "FCGI_MPXS_CONNS")
+                mpxs = atoi(value.c_str()) == 1;
+            else if (name == "FCGI_MAX_REQS" && atoi(value.c_str()) > 0)
+                reqs = atoi(value.c_str());
+        }
+        if (mpxs)
+            max_reqs = reqs < MAX_REQS ? reqs : MAX_REQS;
+    }
+    tv.tv_sec = IO_TIMEOUT;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return max_reqs;
+}
+
+bool fcgi_pool::begin(fcgi_request &req, const string &params, const char *body, size_t len) {
+    fcgi_conn *conn = NULL;
+    bool reserved = false;      //conn是本线程重连的，请求位已经占好
+    bool reconnected = false;   //每次begin最多重连一次，应用连不上时不反复尝试
+    m_lock.lock();
+    while (!conn) {
+        for (fcgi_conn *c : m_conns) {
+            //空闲连接可能已被应用关闭，例如应用重启过
+            if (!c->broken && c->active == 0 && idle_closed(c->fd))
+                c->broken = true;
+            if (!c->broken && c->active < c->max_reqs && (!conn || c->active < conn->active))
+                conn = c;
+        }
+        //没有空闲的连接时再建一条，出错的连接等在途请求全部结束后才重连
+        fcgi_conn *slot = NULL;
+        if ((!conn || conn->active > 0) && !reconnected) {
+            for (fcgi_conn *c : m_conns) {
+                if (c->broken && c->active == 0) {
+                    slot = c;
+                    break;
+                }
+            }
+        }
+        if (slot) {
+            /*connect和FCGI_GET_VALUES最多会阻塞几十秒，先占住这条连接的请求位再放锁，
+             *其他线程照常使用别的连接，也不会重复重连它；它们看到有请求位被占会等待m_free*/
+            reconnected = true;
+            slot->active = 1;
+            int old_fd = slot->fd;
+            slot->fd = -1;
+            m_lock.unlock();
+            if (old_fd >= 0)
+                close(old_fd);
+            int fd = connect_app();
+            int max_reqs = fd >= 0 ? query_max_reqs(fd) : 1;
+            m_lock.lock();
+            m_free.broadcast();
+            if (fd >= 0) {
+                slot->fd = fd;
+                slot->max_reqs = max_reqs;
+                slot->broken = false;
+                conn = slot;
+                reserved = true;
+                break;
+            }
+            slot->active = 0;
+            //放锁期间其他连接的状态可能变了，重新选择
+            conn = NULL;
+            continue;
+        }
+        if (!conn) {
+            //所有连接都不可用且没有在途请求，说明应用连不上
+            bool busy = false;
+            for (fcgi_conn *c : m_conns)
+                busy = busy || c->active > 0;
+            if (!busy) {
+                m_lock.unlock();
+                return false;
+            }
+            m_free.wait(m_lock.get());
+        }
+    }
+    if (!reserved)
+        conn->active++;
+    m_lock.unlock();
+
+    conn->lock.lock();
+    while (conn->reqs.count(conn->next_id) || conn->next_id == 0)
+        conn->next_id++;
+    req.id = conn->next_id++;
+    req.conn = conn;
+    conn->reqs[req.id] = &req;
+    //选中之后连接可能已经被其他线程判定出错
+    if (conn->broken) {
+        req.ended = req.failed = true;
+        conn->lock.unlock();
+        return false;
+    }
+    conn->lock.unlock();
+
+    string buf;
+    unsigned char begin_body[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+    put_header(buf, FCGI_BEGIN_REQUEST, req.id, 8);
+    buf.append((char *) begin_body, 8);
+    put_stream(buf, FCGI_PARAMS, req.id, params.data(), params.size());
+    put_stream(buf, FCGI_STDIN, req.id, body, len);
+
+    //同一连接上的请求记录不能交错写入
+    conn->write_lock.lock();
+    bool ok = write_all(conn->fd, buf.data(), buf.size());
+    conn->write_lock.unlock();
+    if (!ok) {
+        conn->lock.lock();
+        fail(conn);
+        conn->lock.unlock();
+        return false;
+    }
+    return true;
+}
+
+bool fcgi_pool::read(fcgi_request &req, string &out) {
+    fcgi_conn *conn = req.conn;
+    conn->lock.lock();
+    while (req.out.empty() && !req.ended) {
+        if (conn->reading) {
+            conn->ready.wait(conn->lock.get());
+            continue;
+        }
+
+        //当前没有线程在读，由本线程读一条记录再分发给对应的请求
+        conn->reading = true;
+        conn->lock.unlock();
+        int type;
+        uint16_t id;
+        string content;
+        bool ok = read_record(conn->fd, type, id, content);
+        conn->lock.lock();
+        conn->reading = false;
+        if (!ok) {
+            fail(conn);
+        } else {
+            auto it = conn->reqs.find(id);
+            fcgi_request *owner = it == conn->reqs.end() ? NULL : it->second;
+            if (owner && type == FCGI_STDOUT)
+                owner->out.append(content);
+            else if (owner && type == FCGI_STDERR)
+                owner->err.append(content);
+            else if (owner && type == FCGI_END_REQUEST) {
+                owner->ended = true;
+                if (content.size() >= 4)
+                    owner->app_status = ((unsigned char) content[0] << 24) | ((unsigned char) content[1] << 16) |
+                                        ((unsigned char) content[2] << 8) | (unsigned char) content[3];
+            } else if (it != conn->reqs.end() && type == FCGI_END_REQUEST) {
+                //已放弃的请求终于结束，请求ID可以复用
+                conn->reqs.erase(it);
+                release(conn);
+            }
+        }
+        conn->ready.broadcast();
+    }
+    bool more = !req.out.empty();
+    out.append(req.out);
+    req.out.clear();
+    conn->lock.unlock();
+    return more;
+}
+
+void fcgi_pool::fail(fcgi_conn *conn) {
+    conn->broken = true;
+    for (auto it = conn->reqs.begin(); it != conn->reqs.end();) {
+        if (it->second) {
+            it->second->ended = true;
+            it->second->failed = true;
+            ++it;
+        } else {
+            it = conn->reqs.erase(it);
+            release(conn);
+        }
+    }
+    conn->ready.broadcast();
+}
+
+void fcgi_pool::release(fcgi_conn *conn) {
+    m_lock.lock();
+    conn->active--;
+    m_free.broadcast();
+    m_lock.unlock();
+}
+
+bool fcgi_pool::end(fcgi_request &req) {
+    fcgi_conn *conn = req.conn;
+    if (!conn)
+        return false;
+    conn->lock.lock();
+    bool ok = req.ended && !req.failed;
+    if (!req.ended && conn->reqs.size() > 1) {
+        //客户端中途断开，只中止这一个请求，其余复用同一连接的请求不受影响
+        string buf;
+        put_header(buf, FCGI_ABORT_REQUEST, req.id, 0);
+        conn->write_lock.lock();
+        bool sent = write_all(conn->fd, buf.data(), buf.size());
+        conn->write_lock.unlock();
+        if (sent) {
+            //保留请求ID直到应用发来FCGI_END_REQUEST，期间的记录直接丢弃
+            conn->reqs[req.id] = NULL;
+            conn->lock.unlock();
+            req.conn = NULL;
+            return false;
+        }
+        fail(conn);
+    } else if (!req.ended) {
+        fail(conn);
+    }
+    conn->reqs.erase(req.id);
+    conn->lock.unlock();
+    req.conn = NULL;
+    release(conn);
+    return ok;
+}
@@ -0,0 +1,81 @@
+#ifndef FCGI_POOL_H
+#define FCGI_POOL_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include "../lock/locker.h"
+
+using namespace std;
+
+struct fcgi_conn;
+
+//一个FastCGI请求，由发起请求的工作线程持有
+struct fcgi_request {
+    uint16_t id;
+    fcgi_conn *conn;
+    string out;          //已收到、尚未取走的stdout
+    string err;          //应用写到stderr的内容
+    bool ended;          //收到FCGI_END_REQUEST或连接出错
+    bool failed;         //连接出错，响应不完整
+    int app_status;
+
+    fcgi_request() : id(0), conn(NULL), ended(false), failed(false), app_status(0) {}
+};
+
+//到FastCGI应用的一组长连接，多个请求按请求ID复用同一条连接
+class fcgi_pool {
+public:
+    static const int MAX_REQS = 16;       //单条连接上同时进行的请求数上限
+    static const int IO_TIMEOUT = 30;     //读写应用连接的超时秒数
+
+    /*address为"unix:/path/to/socket"或"host:port"，size为长连接数量*/
+    fcgi_pool(const string &address, int size = 4);
+
+    ~fcgi_pool();
+
+    //解析地址，失败返回false
+    bool init();
+
+    //选择一条连接发送请求参数和请求体，所有连接都满时阻塞等待，失败返回false
+    bool begin(fcgi_request &req, const string &params, const char *body, size_t len);
+
+    /*阻塞到有新的stdout数据或请求结束，数据追加到out；请求结束且数据已经取完时返回false。
+     *同一连接上的工作线程轮流读取记录并分发给各自的请求，不需要专门的读线程*/
+    bool read(fcgi_request &req, string &out);
+
+    /*请求结束或放弃后调用，begin失败时也要调用。返回应用是否完整地结束了请求，
+     *未结束的请求向应用发送FCGI_ABORT_REQUEST*/
+    bool end(fcgi_request &req);
+
+    //按FastCGI的name-value格式追加一个参数
+    static void add_param(string &params, const char *name, const char *value, size_t value_len);
+
+    static void add_param(string &params, const char *name, const string &value) {
+        add_param(params, name, value.data(), value.size());
+    }
+
+private:
+    int connect_app();
+
+    //连接建立后用FCGI_GET_VALUES询问应用是否支持多路复用
+    int query_max_reqs(int fd);
+
+    //连接出错，所有在途请求标记为失败，调用者需持有conn的锁
+    void fail(fcgi_conn *conn);
+
+    //归还连接上的一个请求位
+    void release(fcgi_conn *conn);
+
+private:
+    string m_address;
+    bool m_unix;
+    vector<char> m_sockaddr;
+    int m_size;
+    vector<fcgi_conn *> m_conns;
+    locker m_lock;
+    cond m_free;           //有连接空出请求位时通知
+};
+
+#endif
@@ -1,7 +1,23 @@
 #include "http_conn.h"
+#include "../io/io_pool.h"
+#include "../cache/neg_cache.h"
+#include "../vhost/vhost.h"
+#include "../cache/file_cache.h"
+#include "../cache/prefetcher.h"
+#include "../proxy/proxy_conn.h"
+#include "../proxy/response_cache.h"
+#include "../proxy/coalescer.h"
+#include "../fastcgi/fcgi_pool.h"
+#include "../CGImysql/credential_cache.h"
+#include "../session/session_store.h"
+#include "../limit/rate_limiter.h"
+#ifdef COROUTINE
+#include "../coro/coro_sched.h"
+#endif
 
-#include <mysql/mysql.h>
 #include <fstream>
+#include <set>
+#include <poll.h>
 
 //定义http响应的一些状态信息
 const char *ok_200_title = "OK";
@@ -13,9 +29,31 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the request file.\n";
+const char *error_405_title = "Method Not Allowed";
+const char *error_405_form = "The request method is not supported by this resource.\n";
+const char *error_502_title = "Bad Gateway";
+const char *error_502_form = "The upstream server could not be reached.\n";
+const char *error_429_title = "Too Many Requests";
+const char *error_429_form = "Too many requests from your address, please retry later.\n";
 
-locker m_lock;
-map<string, string> users;
+//完整的404响应报文，按是否长连接各生成一份
+const string not_found_keep_alive = string("HTTP/1.1 404 ") + error_404_title + "\r\nContent-Length:" +
+                                    to_string(strlen(error_404_form)) + "\r\nConnection:keep-alive\r\n\r\n" +
+                                    error_404_form;
+//超出速率的请求都回同一个响应并关闭连接
+const string too_many_requests = string("HTTP/1.1 429 ") + error_429_title + "\r\nRetry-After:1\r\nContent-Length:" +
+                                 to_string(strlen(error_429_form)) + "\r\nConnection:close\r\n\r\n" +
+                                 error_429_form;
+const string not_found_close = string("HTTP/1.1 404 ") + error_404_title + "\r\nContent-Length:" +
+                               to_string(strlen(error_404_form)) + "\r\nConnection:close\r\n\r\n" +
+                               error_404_form;
+
+//保护m_generation，I/O线程恢复连接时不会和fd被新连接复用交错
+locker io_lock;
+
+//正在等待FastCGI响应的连接
+locker fcgi_lock;
+set<int> fcgi_busy;
 
 //对文件描述符设置非阻塞
 int setnonblocking(int fd) {
@@ -62,11 +100,33 @@ void modfd(int epollfd, int fd, int ev, int TRIGMode) {
 
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+io_pool *http_conn::m_io_pool = NULL;
+neg_cache *http_conn::m_neg_cache = NULL;
+vhost_table *http_conn::m_vhosts = NULL;
+file_cache *http_conn::m_file_cache = NULL;
+html_prefetcher *http_conn::m_prefetcher = NULL;
+upstream_pool *http_conn::m_upstreams = NULL;
+response_cache *http_conn::m_response_cache = NULL;
+request_coalescer *http_conn::m_coalescer = NULL;
+fcgi_pool *http_conn::m_fastcgi = NULL;
+const char *http_conn::m_fcgi_prefix = "/cgi/";
+router *http_conn::m_router = NULL;
+credential_cache *http_conn::m_credentials = NULL;
+session_store *http_conn::m_sessions = NULL;
+rate_limiter *http_conn::m_limiter = NULL;
+coro_sched *http_conn::m_sched = NULL;
+int http_conn::m_write_budget = 0;
+
+http_conn::~http_conn() {
+    delete m_proxy;
+}
 
 //关闭连接，关闭一个连接，客户总量减一
 void http_conn::close_conn(bool real_close) {
     if (real_close && (m_sockfd != -1)) {
         printf("close %d\n", m_sockfd);
+        //fd关闭后可能马上被新连接复用，先归还
+        release_client(m_sockfd);
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
         m_user_count--;
@@ -79,6 +139,11 @@ void http_conn::init(int sockfd, const sockaddr_in &addr, char *root, int TRIGMo
     m_sockfd = sockfd;
     m_address = addr;
 
+    //旧连接还没完成的预读不再恢复这个fd
+    io_lock.lock();
+    ++m_generation;
+    io_lock.unlock();
+
     addfd(m_epollfd, sockfd, true, m_TRIGMode);
     m_user_count++;
 
@@ -87,6 +152,12 @@ void http_conn::init(int sockfd, const sockaddr_in &addr, char *root, int TRIGMo
     m_TRIGMode = TRIGMode;
     m_close_log = close_log;
 
+    //同一fd上的旧连接可能在代理途中被定时器关闭
+    abort_proxy();
+    //上一个连接可能在发送途中超时关闭，释放它持有的映射和缓存引用
+    unmap();
+    m_served = 0;
+
     init();
 }
 
@@ -108,6 +179,12 @@ void http_conn::init() {
     m_write_idx = 0;
     cgi = 0;
     m_state = 0;
+    m_header_start = 0;
+    m_upstream = NULL;
+    m_coalesce = true;
+    m_set_cookie.clear();
+    m_inline = false;
+    m_parsed = NO_REQUEST;
     remove_timer_flag = 0;
     conn_io_done_flag = 0;
 
@@ -165,6 +242,9 @@ bool http_conn::read_once() {
         //ET读数据
     else {
         while (true) {
+            //缓冲区已满时recv长度为0会返回0，不能当作对端关闭
+            if (m_read_idx >= READ_BUFFER_SIZE)
+                break;
             bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
             if (bytes_read == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -214,10 +294,8 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) {
 
     if (!m_url || m_url[0] != '/')
         return BAD_REQUEST;
-    //当url为/时，显示判断界面
-    if (strlen(m_url) == 1)
-        strcat(m_url, "index.html");
     m_check_state = CHECK_STATE_HEADER;
+    m_header_start = m_checked_idx;
     return NO_REQUEST;
 }
 
@@ -227,6 +305,9 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text) {
      * 头解析完成
      */
     if (text[0] == '\0') {
+        //Host命中代理配置，请求体不必等待读完，由代理边读边转发
+        if (m_upstreams && (m_upstream = m_upstreams->lookup(m_host)) != NULL)
+            return PROXY_REQUEST;
         if (m_content_length != 0) {
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
@@ -278,6 +359,9 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 ret = parse_request_line(text);
                 if (ret == BAD_REQUEST)
                     return BAD_REQUEST;
+                //每个请求在请求行解析完时计一次数
+                if (m_limiter && !m_limiter->allow(m_address.sin_addr.s_addr))
+                    return TOO_MANY_REQUESTS;
                 break;
             }
             case CHECK_STATE_HEADER: {
@@ -286,7 +370,8 @@ http_conn::HTTP_CODE http_conn::process_read() {
                     return BAD_REQUEST;
                 else if (ret == GET_REQUEST) {
                     return do_request();
-                }
+                } else if (ret == PROXY_REQUEST)
+                    return PROXY_REQUEST;
                 break;
             }
             case CHECK_STATE_CONTENT: {
@@ -304,25 +389,74 @@ http_conn::HTTP_CODE http_conn::process_read() {
 }
 
 http_conn::HTTP_CODE http_conn::do_request() {
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    //printf("m_url:%s\n", m_url);
-    const char *p = strrchr(m_url, '/');
+    //按Host选择站点，未配置虚拟主机时使用默认根目录
+    const vhost *host = m_vhosts ? m_vhosts->lookup(m_host) : NULL;
+    const char *root = host ? host->root.c_str() : doc_root;
+    if (host && !host->keep_alive)
+        m_linger = false;
+
+    //注册过的路径由进程内的处理函数响应
+    if (m_router) {
+        m_route_params.clear();
+        m_handler = m_router->match(m_method, m_url, strcspn(m_url, "?"), m_route_params, m_route_allowed);
+        if (m_handler || m_route_allowed)
+            return HANDLER_REQUEST;
+    }
+
+    //登录和注册在本机校验，之后按普通页面返回；校验可能要查数据库，不在主线程中做
+    if (cgi == 1 && m_credentials) {
+        if (m_inline)
+            return WORKER_REQUEST;
+        check_login();
+    }
+
+    //动态请求交给FastCGI应用，m_real_file记录不带查询串的脚本路径
+    if (m_fastcgi && (cgi || strncmp(m_url, m_fcgi_prefix, strlen(m_fcgi_prefix)) == 0)) {
+        strncpy(m_real_file, root, FILENAME_LEN - 1);
+        size_t len = strlen(m_real_file);
+        size_t path_len = strcspn(m_url, "?");
+        if (path_len > FILENAME_LEN - len - 1)
+            path_len = FILENAME_LEN - len - 1;
+        memcpy(m_real_file + len, m_url, path_len);
+        m_real_file[len + path_len] = '\0';
+        return FCGI_REQUEST;
+    }
+
+    //将请求资源路径与网站根目录相结合
+    strncpy(m_real_file, root, FILENAME_LEN - 1);
+    int len = strlen(m_real_file);
+    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
 
     /**
-     * 如果请求资源路径为/,则默认请求主页index.html
+     * 如果请求资源路径为目录,则默认请求站点首页
      */
-    if (strcmp(m_url,"/")==0) {
-        char *m_url_real = (char *) malloc(sizeof(char) * 30);
-        strcpy(m_url_real, "/index.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+    len = strlen(m_real_file);
+    if (m_real_file[len - 1] == '/') {
+        const char *index = host ? host->index.c_str() : "index.html";
+        strncpy(m_real_file + len, index, FILENAME_LEN - len - 1);
+    }
 
-        free(m_url_real);
-    } else  // 否则将请求资源路径与网站根目录相结合
-        strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    //最近确认不存在的路径直接返回，不再stat
+    if (m_neg_cache && m_neg_cache->lookup(m_real_file))
+        return NO_RESOURCE;
+
+    //命中文件缓存时直接复用已有的映射，省去stat/open/mmap；主线程中不做到期的重新stat
+    if (m_file_cache && (m_file_entry = m_file_cache->acquire(m_real_file, !m_inline))) {
+        m_file_stat = m_file_entry->st;
+        m_file_address = m_file_entry->addr;
+        prefetch_subresources(root);
+        return FILE_REQUEST;
+    }
 
-    if (stat(m_real_file, &m_file_stat) < 0)
+    //缓存未命中要访问磁盘，交给工作线程从头再走一遍
+    if (m_inline)
+        return WORKER_REQUEST;
+
+    if (stat(m_real_file, &m_file_stat) < 0) {
+        if (m_neg_cache && (errno == ENOENT || errno == ENOTDIR))
+            m_neg_cache->insert(m_real_file);
         return NO_RESOURCE;
+    }
 
     if (!(m_file_stat.st_mode & S_IROTH))
         return FORBIDDEN_REQUEST;
@@ -330,14 +464,55 @@ http_conn::HTTP_CODE http_conn::do_request() {
     if (S_ISDIR(m_file_stat.st_mode))
         return BAD_REQUEST;
 
+    if (m_file_cache && (m_file_entry = m_file_cache->load(m_real_file, m_file_stat))) {
+        m_file_address = m_file_entry->addr;
+        prefetch_subresources(root);
+        return FILE_REQUEST;
+    }
+
     int fd = open(m_real_file, O_RDONLY);
-    m_file_address = (char *) mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd < 0)
+        return errno == EACCES ? FORBIDDEN_REQUEST : NO_RESOURCE;
+    //空文件不映射，process_write中返回空页面
+    if (m_file_stat.st_size == 0) {
+        close(fd);
+        return FILE_REQUEST;
+    }
+    //提前发起首个窗口的异步预读，顺序发送时由内核继续预读后续内容
+    if (m_io_pool)
+        posix_fadvise(fd, 0, io_pool::IO_WINDOW, POSIX_FADV_WILLNEED);
+    void *addr = mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close(fd);
+    if (addr == MAP_FAILED)
+        return INTERNAL_ERROR;
+    m_file_address = (char *) addr;
+    madvise(m_file_address, m_file_stat.st_size, MADV_SEQUENTIAL);
     return FILE_REQUEST;
 }
 
+//HTML页面交给后台线程解析，浏览器随后请求的子资源提前载入文件缓存
+void http_conn::prefetch_subresources(const char *root) {
+    if (!m_prefetcher || m_file_entry->scanned != 0)
+        return;
+    const char *ext = strrchr(m_real_file, '.');
+    if (ext && (strcasecmp(ext, ".html") == 0 || strcasecmp(ext, ".htm") == 0))
+        m_prefetcher->submit(m_file_entry, m_url, root);
+}
+
 void http_conn::unmap() {
-    if (m_file_address) {
+    //缓存中的映射只释放引用，由缓存决定何时munmap
+    if (m_file_entry) {
+        m_file_cache->release(m_file_entry);
+        m_file_entry = NULL;
+        m_file_address = 0;
+    } else if (m_cache_entry) {
+        m_response_cache->release(m_cache_entry);
+        m_cache_entry = NULL;
+        m_file_address = 0;
+    } else if (!m_response.empty()) {
+        m_response.clear();
+        m_file_address = 0;
+    } else if (m_file_address) {
         munmap(m_file_address, m_file_stat.st_size);
         m_file_address = 0;
     }
@@ -345,6 +520,7 @@ void http_conn::unmap() {
 
 bool http_conn::write() {
     int temp = 0;
+    int sent = 0;
 
     if (bytes_to_send == 0) {
         modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
@@ -353,7 +529,22 @@ bool http_conn::write() {
     }
 
     while (1) {
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        //即将发送的文件页不在内存中，交给I/O线程读盘，避免缺页阻塞事件循环
+        if (offload_cold_window())
+            return true;
+
+        //按剩余的预算截短这次发送的长度
+        struct iovec iv[2];
+        memcpy(iv, m_iv, sizeof(iv));
+        if (m_write_budget > 0) {
+            size_t left = m_write_budget - sent;
+            for (int i = 0; i < m_iv_count; ++i) {
+                if (iv[i].iov_len > left)
+                    iv[i].iov_len = left;
+                left -= iv[i].iov_len;
+            }
+        }
+        temp = writev(m_sockfd, iv, m_iv_count);
 
         if (temp < 0) {
             if (errno == EAGAIN) {
@@ -380,15 +571,43 @@ bool http_conn::write() {
             modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
 
             if (m_linger) {
+                ++m_served;
                 init();
                 return true;
             } else {
                 return false;
             }
         }
+
+        //本次的发送预算用完，重新注册EPOLLOUT，排到其他就绪的连接之后再继续
+        sent += temp;
+        if (m_write_budget > 0 && sent >= m_write_budget) {
+            modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode);
+            return true;
+        }
     }
 }
 
+bool http_conn::offload_cold_window() {
+    //只有映射的文件会缺页，代理缓存和处理函数的响应都在内存中
+    if (!m_io_pool || m_iv_count < 2 || m_iv[1].iov_len == 0 || m_cache_entry || !m_response.empty())
+        return false;
+    size_t len = m_iv[1].iov_len < io_pool::IO_WINDOW ? m_iv[1].iov_len : io_pool::IO_WINDOW;
+    if (io_pool::resident((char *) m_iv[1].iov_base, len))
+        return false;
+    //EPOLLONESHOT下连接此时不会再被事件循环触发，预读完成后由I/O线程恢复
+    off_t offset = (char *) m_iv[1].iov_base - m_file_address;
+    return m_io_pool->append(this, m_generation, m_real_file, offset, len);
+}
+
+void http_conn::io_done(unsigned generation) {
+    //等待预读期间连接可能已经超时关闭，fd又被新连接复用
+    io_lock.lock();
+    if (generation == m_generation)
+        modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode);
+    io_lock.unlock();
+}
+
 bool http_conn::add_response(const char *format, ...) {
     if (m_write_idx >= WRITE_BUFFER_SIZE)
         return false;
@@ -436,6 +655,29 @@ bool http_conn::add_content(const char *content) {
     return add_response("%s", content);
 }
 
+bool http_conn::add_preload() {
+    //页面扫描完成后才有预加载信息，首次请求不带该响应头
+    if (!m_prefetcher || !m_prefetcher->preload() || !m_file_entry || m_file_entry->scanned != 2 ||
+        m_file_entry->preload.empty())
+        return true;
+    return add_response("Link:%s\r\n", m_file_entry->preload.c_str());
+}
+
+bool http_conn::add_set_cookie() {
+    if (m_set_cookie.empty())
+        return true;
+    return add_response("Set-Cookie:%s\r\n", m_set_cookie.c_str());
+}
+
+bool http_conn::add_not_found() {
+    const string &response = m_linger ? not_found_keep_alive : not_found_close;
+    if (m_write_idx + (int) response.size() >= WRITE_BUFFER_SIZE)
+        return false;
+    memcpy(m_write_buf + m_write_idx, response.data(), response.size());
+    m_write_idx += response.size();
+    return true;
+}
+
 bool http_conn::process_write(HTTP_CODE ret) {
     switch (ret) {
         case INTERNAL_ERROR: {
@@ -449,9 +691,56 @@ bool http_conn::process_write(HTTP_CODE ret) {
          * 此处应该进行无资源响应
          */
         case NO_RESOURCE: {
-            add_status_line(404, error_404_title);
-            add_headers(strlen(error_404_form));
-            if (!add_content(error_404_form))
+            if (!add_not_found())
+                return false;
+            break;
+        }
+        case TOO_MANY_REQUESTS: {
+            m_linger = false;
+            if (m_write_idx + (int) too_many_requests.size() >= WRITE_BUFFER_SIZE)
+                return false;
+            memcpy(m_write_buf + m_write_idx, too_many_requests.data(), too_many_requests.size());
+            m_write_idx += too_many_requests.size();
+            break;
+        }
+        case CACHE_HIT: {
+            //头部很短，拷进写缓冲；响应体直接从缓存条目发送
+            if (!add_response("%s", m_cache_entry->head.c_str()) ||
+                !add_response("Age:%ld\r\n", response_cache::age(m_cache_entry, time(NULL))) || !add_linger() ||
+                !add_blank_line())
+                return false;
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            m_iv_count = 1;
+            bytes_to_send = m_write_idx;
+            if (!m_cache_entry->body.empty()) {
+                m_file_address = (char *) m_cache_entry->body.data();
+                m_iv[1].iov_base = m_file_address;
+                m_iv[1].iov_len = m_cache_entry->body.size();
+                m_iv_count = 2;
+                bytes_to_send += m_cache_entry->body.size();
+            }
+            return true;
+        }
+        case HANDLER_REQUEST: {
+            //整个响应报文都在m_response中，作为writev的第二段发送
+            m_file_address = &m_response[0];
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = 0;
+            m_iv[1].iov_base = m_file_address;
+            m_iv[1].iov_len = m_response.size();
+            m_iv_count = 2;
+            bytes_to_send = m_response.size();
+            return true;
+        }
+        case FCGI_REQUEST: {
+            //响应已经在工作线程中发出，写缓冲里只剩结尾的空块
+            break;
+        }
+        case BAD_GATEWAY: {
+            add_status_line(502, error_502_title);
+            add_headers(strlen(error_502_form));
+            if (!add_content(error_502_form))
                 return false;
             break;
         }
@@ -464,6 +753,8 @@ bool http_conn::process_write(HTTP_CODE ret) {
         }
         case FILE_REQUEST: {
             add_status_line(200, ok_200_title);
+            add_preload();
+            add_set_cookie();
             if (m_file_stat.st_size != 0) {
                 add_headers(m_file_stat.st_size);
                 m_iv[0].iov_base = m_write_buf;
@@ -479,6 +770,7 @@ bool http_conn::process_write(HTTP_CODE ret) {
                 if (!add_content(ok_string))
                     return false;
             }
+            break;
         }
         default:
             return false;
@@ -490,15 +782,482 @@ bool http_conn::process_write(HTTP_CODE ret) {
     return true;
 }
 
+http_conn::HTTP_CODE http_conn::start_proxy() {
+    string request;
+    request.reserve(m_checked_idx + 256);
+    request.append(m_method == POST ? "POST " : "GET ").append(m_url).append(" HTTP/1.1\r\n");
+
+    //请求头在解析时以\0\0分隔，逐行取出并去掉逐跳头部
+    bool expect_continue = false;
+    for (char *line = m_read_buf + m_header_start; *line; line += strlen(line) + 2) {
+        if (strncasecmp(line, "Connection:", 11) == 0 || strncasecmp(line, "Keep-Alive:", 11) == 0 ||
+            strncasecmp(line, "Proxy-Connection:", 17) == 0 || strncasecmp(line, "Host:", 5) == 0)
+            continue;
+        if (strncasecmp(line, "Expect:", 7) == 0) {
+            expect_continue = true;
+            continue;
+        }
+        request.append(line).append("\r\n");
+    }
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, ip, sizeof(ip));
+    request.append("Host: ").append(m_upstream->name().empty() ? m_host : m_upstream->name()).append("\r\n");
+    request.append("X-Forwarded-For: ").append(ip).append("\r\n");
+    request.append("X-Forwarded-Host: ").append(m_host).append("\r\n");
+    request.append("Connection: keep-alive\r\n\r\n");
+
+    string key;
+    if (m_upstream->policy() == upstream_group::HASH_IP)
+        key = ip;
+    else if (m_upstream->policy() == upstream_group::HASH_URI)
+        key = m_url;
+
+    //GET请求先查响应缓存，新鲜或在stale-while-revalidate窗口内的条目直接返回
+    string base;
+    cached_response *stale = NULL;
+    uint64_t flight = 0;
+    if (m_response_cache && m_method == GET && !response_cache::bypass(request)) {
+        base = normalize_host(m_host) + m_url;
+        response_cache::FRESHNESS state;
+        cached_response *entry = m_response_cache->acquire(base, request, state);
+        if (state == response_cache::STALE_REVALIDATE)
+            m_response_cache->refresh(m_upstream, key, base, request, entry);
+        if (state == response_cache::FRESH || state == response_cache::STALE_REVALIDATE) {
+            m_cache_entry = entry;
+            return CACHE_HIT;
+        }
+        stale = entry;
+
+        //同一key已有请求在途时挂起等待，登记之后连接随时可能被主线程恢复，不能再访问任何成员
+        if (m_coalescer && m_coalesce && m_coalescer->join(base, this, m_sockfd, flight)) {
+            if (stale)
+                m_response_cache->release(stale);
+            return PROXY_REQUEST;
+        }
+    }
+
+    long body_ready = m_read_idx - m_checked_idx < m_content_length ? m_read_idx - m_checked_idx : m_content_length;
+    request.append(m_read_buf + m_checked_idx, body_ready);
+    long body_left = m_content_length - body_ready;
+    //请求体边读边发，不必让客户端等待100 Continue超时
+    if (expect_continue && body_left > 0)
+        send(m_sockfd, "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_NOSIGNAL);
+
+    if (!m_proxy)
+        m_proxy = new proxy_conn(this);
+    m_proxy->cache(base, stale, flight);
+    if (!m_proxy->start(m_upstream, key, request, body_left)) {
+        m_proxy->abort();
+        return BAD_GATEWAY;
+    }
+    return PROXY_REQUEST;
+}
+
+int http_conn::phase(long &bytes) const {
+    bytes = 0;
+    if (proxying())
+        return PHASE_OTHER;
+    if (bytes_to_send > 0) {
+        bytes = bytes_to_send;
+        return PHASE_WRITE;
+    }
+    if (m_read_idx == 0)
+        return m_served > 0 ? PHASE_IDLE : PHASE_FIRST_BYTE;
+    if (m_check_state == CHECK_STATE_CONTENT) {
+        bytes = m_content_length;
+        return PHASE_BODY;
+    }
+    return PHASE_HEADER;
+}
+
+bool http_conn::proxying() const {
+    return m_proxy && m_proxy->active();
+}
+
+bool http_conn::proxy_event(uint32_t events) {
+    return m_proxy->on_client_event(events);
+}
+
+void http_conn::abort_proxy() {
+    if (m_proxy)
+        m_proxy->abort();
+}
+
+void http_conn::resume_coalesced() {
+    m_coalesce = false;
+    HTTP_CODE ret = start_proxy();
+    if (ret == PROXY_REQUEST)
+        return;
+    if (!process_write(ret)) {
+        close_conn();
+        return;
+    }
+    modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode);
+}
+
+void http_conn::resume(vector<http_conn *> &waiters) {
+    for (http_conn *conn : waiters)
+        conn->resume_coalesced();
+}
+
+int http_conn::sched_class() {
+    //主线程已经解析过的请求按解析结果分类
+    if (m_parsed != NO_REQUEST)
+        return m_parsed == PROXY_REQUEST ? 2 : (m_parsed == WORKER_REQUEST && !cgi) ? 0 : 1;
+    //请求可能还没读完，缓冲区也不一定以\0结尾，只在已读入的部分里找
+    char *end = m_read_buf + m_read_idx;
+    char *method = m_read_buf;
+    while (method < end && (*method == '\r' || *method == '\n'))
+        ++method;
+    char *sp = (char *) memchr(method, ' ', end - method);
+    if (!sp)
+        return 0;
+    char *url = sp + 1;
+    char *line_end = (char *) memchr(url, '\n', end - url);
+    char *url_end = (char *) memchr(url, ' ', (line_end ? line_end : end) - url);
+    if (!line_end || !url_end)
+        return 0;
+    if (m_upstreams && !m_upstreams->empty()) {
+        for (char *line = line_end + 1; line < end;) {
+            char *next = (char *) memchr(line, '\n', end - line);
+            if (!next)
+                break;
+            if (next - line > 5 && strncasecmp(line, "Host:", 5) == 0) {
+                char host[256];
+                char *h = line + 5;
+                while (h < next && (*h == ' ' || *h == '\t'))
+                    ++h;
+                size_t len = next - h;
+                if (len > 0 && h[len - 1] == '\r')
+                    --len;
+                if (len < sizeof(host)) {
+                    memcpy(host, h, len);
+                    host[len] = '\0';
+                    if (m_upstreams->lookup(host))
+                        return 2;
+                }
+                break;
+            }
+            line = next + 1;
+        }
+    }
+    if (sp - method != 3 || strncasecmp(method, "GET", 3) != 0)
+        return 1;
+    size_t prefix = strlen(m_fcgi_prefix);
+    if (m_fastcgi && (size_t) (url_end - url) >= prefix && strncmp(url, m_fcgi_prefix, prefix) == 0)
+        return 1;
+    if (m_router) {
+        vector<pair<string, string>> params;
+        int allowed = 0;
+        char *query = (char *) memchr(url, '?', url_end - url);
+        if (m_router->match(GET, url, (query ? query : url_end) - url, params, allowed) || allowed)
+            return 1;
+    }
+    return 0;
+}
+
+void http_conn::release_client(int sockfd) {
+    if (m_limiter)
+        m_limiter->release(sockfd);
+}
+
+void http_conn::unpark(int sockfd) {
+    if (m_coalescer)
+        m_coalescer->cancel(sockfd);
+#ifdef COROUTINE
+    if (m_sched)
+        m_sched->cancel(sockfd);
+#endif
+}
+
+//从user=123&passwd=123形式的表单中取出一个字段
+static string form_value(const char *form, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = form; p && *p; p = strchr(p, '&'), p = p ? p + 1 : NULL) {
+        if (strncmp(p, name, len) == 0 && p[len] == '=')
+            return string(p + len + 1, strcspn(p + len + 1, "&"));
+    }
+    return string();
+}
+
+void http_conn::check_login() {
+    const char *p = strrchr(m_url, '/');
+    //2CGISQL.cgi为登录，3CGISQL.cgi为注册
+    if (!p || (strcmp(p + 1, "2CGISQL.cgi") != 0 && strcmp(p + 1, "3CGISQL.cgi") != 0))
+        return;
+    string name = form_value(m_content_length > 0 ? m_string : NULL, "user");
+    string password = form_value(m_content_length > 0 ? m_string : NULL, "passwd");
+
+    credential_cache::RESULT result;
+    if (p[1] == '3') {
+        //如果是注册，先检测是否有重名的，没有重名的再写入数据库
+        if (!name.empty() && m_credentials->add_user(name, password, result))
+            m_url = (char *) "/log.html";
+        else
+            m_url = (char *) "/registerError.html";
+    } else {
+        result = m_credentials->verify(name, password);
+        m_url = (char *) (result == credential_cache::OK ? "/welcome.html" : "/logError.html");
+        //登录成功后下发会话ID，之后的请求凭Cookie识别用户
+        if (result == credential_cache::OK && m_sessions) {
+            string id = m_sessions->create(name);
+            if (!id.empty())
+                m_set_cookie = "sid=" + id + "; Path=/; HttpOnly; Max-Age=" + to_string(m_sessions->ttl());
+        }
+    }
+    //校验结果的页面不再交给FastCGI应用
+    cgi = 0;
+}
+
+http_conn::HTTP_CODE http_conn::handle_request() {
+    response_writer writer;
+    if (!m_handler) {
+        string allow;
+        for (int i = 0; i < router::METHODS; ++i) {
+            if (m_route_allowed & (1 << i))
+                allow.append(allow.empty() ? "" : ", ").append(router::method_name(i));
+        }
+        writer.status(405, error_405_title);
+        writer.header("Allow", allow);
+        writer.write(error_405_form);
+    } else {
+        request_view request;
+        request.method = m_method;
+        request.method_name = router::method_name(m_method);
+        request.path = m_url;
+        request.path_len = strcspn(m_url, "?");
+        request.query = m_url[request.path_len] == '?' ? m_url + request.path_len + 1 : "";
+        request.body = m_content_length > 0 ? m_string : "";
+        request.body_len = m_content_length;
+        request.headers = m_read_buf + m_header_start;
+        request.peer = &m_address;
+        request.params.swap(m_route_params);
+        //处理函数抛出的异常不能带到线程池中
+        try {
+            (*m_handler)(request, writer);
+        } catch (...) {
+            LOG_ERROR("handler for %s threw an exception", m_url);
+            return INTERNAL_ERROR;
+        }
+    }
+    writer.finish(m_response, m_linger);
+    return HANDLER_REQUEST;
+}
+
+bool http_conn::busy(int sockfd) {
+    if (!m_fastcgi)
+        return false;
+    fcgi_lock.lock();
+    bool ret = fcgi_busy.count(sockfd) > 0;
+    fcgi_lock.unlock();
+    return ret;
+}
+
+bool http_conn::send_blocking(struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(m_sockfd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            struct pollfd pfd = {m_sockfd, POLLOUT, 0};
+            if (errno != EAGAIN || poll(&pfd, 1, fcgi_pool::IO_TIMEOUT * 1000) <= 0)
+                return false;
+            continue;
+        }
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+http_conn::HTTP_CODE http_conn::fastcgi() {
+    const char *query = strchr(m_url, '?');
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, ip, sizeof(ip));
+
+    string params;
+    params.reserve(512 + m_checked_idx);
+    fcgi_pool::add_param(params, "GATEWAY_INTERFACE", "CGI/1.1");
+    fcgi_pool::add_param(params, "SERVER_SOFTWARE", "TinyWebServer");
+    fcgi_pool::add_param(params, "SERVER_PROTOCOL", "HTTP/1.1");
+    fcgi_pool::add_param(params, "REQUEST_METHOD", m_method == POST ? "POST" : "GET");
+    fcgi_pool::add_param(params, "REQUEST_URI", m_url);
+    fcgi_pool::add_param(params, "SCRIPT_NAME", string(m_url, query ? query - m_url : strlen(m_url)));
+    fcgi_pool::add_param(params, "SCRIPT_FILENAME", m_real_file);
+    fcgi_pool::add_param(params, "QUERY_STRING", query ? query + 1 : "");
+    fcgi_pool::add_param(params, "REMOTE_ADDR", ip);
+    fcgi_pool::add_param(params, "REMOTE_PORT", to_string(ntohs(m_address.sin_port)));
+    if (m_host)
+        fcgi_pool::add_param(params, "SERVER_NAME", string(m_host, strcspn(m_host, ":")));
+    if (m_content_length > 0)
+        fcgi_pool::add_param(params, "CONTENT_LENGTH", to_string(m_content_length));
+    //其余请求头按CGI约定转换为HTTP_前缀的变量
+    for (char *line = m_read_buf + m_header_start; *line; line += strlen(line) + 2) {
+        const char *colon = strchr(line, ':');
+        if (!colon)
+            continue;
+        const char *value = colon + 1 + strspn(colon + 1, " \t");
+        if (strncasecmp(line, "Content-Type:", 13) == 0) {
+            fcgi_pool::add_param(params, "CONTENT_TYPE", value);
+            continue;
+        }
+        //Proxy会变成HTTP_PROXY，被应用当作出站代理的配置(httpoxy)
+        if (strncasecmp(line, "Content-Length:", 15) == 0 || strncasecmp(line, "Proxy:", 6) == 0)
+            continue;
+        //名字中只允许字母、数字和'-'，否则丢弃，'_'会和'-'转换后的变量名冲突
+        size_t name_len = colon - line;
+        if (name_len == 0 || strspn(line, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-") < name_len)
+            continue;
+        string name = "HTTP_";
+        for (const char *p = line; p < colon; ++p)
+            name.push_back(*p == '-' ? '_' : toupper(*p));
+        fcgi_pool::add_param(params, name.c_str(), value);
+    }
+
+    //等待应用期间定时器不能关闭这个连接
+    fcgi_lock.lock();
+    fcgi_busy.insert(m_sockfd);
+    fcgi_lock.unlock();
+
+    fcgi_request req;
+    string out;
+    bool sent = false;        //响应头是否已经发给客户端
+    bool client_ok = true;
+    bool ok = m_fastcgi->begin(req, params, m_content_length > 0 ? m_string : NULL, m_content_length);
+    while (ok && client_ok && m_fastcgi->read(req, out)) {
+        string frame;
+        if (!sent) {
+            size_t end = out.find("\r\n\r\n"), skip = 4;
+            size_t lf = out.find("\n\n");
+            if (lf < end) {
+                end = lf;
+                skip = 2;
+            }
+            if (end == string::npos)
+                continue;
+
+            //Status和Location决定状态行，长度和连接相关的头部由服务器重新给出
+            string status, headers;
+            bool location = false;
+            size_t pos = 0;
+            while (pos < end) {
+                size_t eol = out.find('\n', pos);
+                if (eol == string::npos || eol > end)
+                    eol = end;
+                string line = out.substr(pos, eol - pos);
+                pos = eol + 1;
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                const char *p = line.c_str();
+                if (strncasecmp(p, "Status:", 7) == 0) {
+                    status = p + 7 + strspn(p + 7, " \t");
+                    continue;
+                }
+                if (strncasecmp(p, "Content-Length:", 15) == 0 || strncasecmp(p, "Connection:", 11) == 0 ||
+                    strncasecmp(p, "Keep-Alive:", 11) == 0 || strncasecmp(p, "Transfer-Encoding:", 18) == 0)
+                    continue;
+                if (strncasecmp(p, "Location:", 9) == 0)
+                    location = true;
+                headers.append(line).append("\r\n");
+            }
+            if (status.empty())
+                status = location ? "302 Found" : "200 OK";
+            frame.append("HTTP/1.1 ").append(status).append("\r\n").append(headers);
+            frame.append("Transfer-Encoding: chunked\r\n");
+            frame.append(m_linger ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+            out.erase(0, end + skip);
+        }
+
+        //应用的输出原样作为一个分块发出，空块留到最后作为结尾
+        char size[20];
+        snprintf(size, sizeof(size), "%zx\r\n", out.size());
+        if (!out.empty())
+            frame.append(size);
+        struct iovec iv[3];
+        iv[0].iov_base = (char *) frame.data();
+        iv[0].iov_len = frame.size();
+        iv[1].iov_base = (char *) out.data();
+        iv[1].iov_len = out.size();
+        iv[2].iov_base = (char *) "\r\n";
+        iv[2].iov_len = out.empty() ? 0 : 2;
+        client_ok = send_blocking(iv, 3);
+        sent = true;
+        out.clear();
+    }
+    bool completed = m_fastcgi->end(req);
+
+    fcgi_lock.lock();
+    fcgi_busy.erase(m_sockfd);
+    fcgi_lock.unlock();
+
+    if (!req.err.empty())
+        LOG_ERROR("fastcgi %s: %s", m_real_file, req.err.c_str());
+    if (!sent)
+        return client_ok ? BAD_GATEWAY : CLOSED_CONNECTION;
+    //响应中途出错时客户端无法从chunked流中得知，只能关闭连接
+    if (!client_ok || !completed)
+        return CLOSED_CONNECTION;
+    m_write_idx = 0;
+    add_response("0\r\n\r\n");
+    return FCGI_REQUEST;
+}
+
+http_conn::INLINE_STATUS http_conn::process_inline() {
+    m_inline = true;
+    HTTP_CODE ret = process_read();
+    m_inline = false;
+    switch (ret) {
+        case NO_REQUEST:
+            modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
+            return INLINE_WAIT;
+        case WORKER_REQUEST:
+        case HANDLER_REQUEST:
+        case FCGI_REQUEST:
+        case PROXY_REQUEST:
+            m_parsed = ret;
+            return INLINE_WORKER;
+        default:
+            break;
+    }
+    return process_write(ret) ? INLINE_REPLY : INLINE_CLOSE;
+}
+
 void http_conn::process() {
-    HTTP_CODE read_ret = process_read();
+    //主线程已经解析过的请求从解析结果继续
+    HTTP_CODE read_ret = m_parsed;
+    m_parsed = NO_REQUEST;
+    if (read_ret == WORKER_REQUEST)
+        read_ret = do_request();
+    else if (read_ret == NO_REQUEST)
+        read_ret = process_read();
     if (read_ret == NO_REQUEST) {
         modfd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
         return;
     }
+    if (read_ret == HANDLER_REQUEST)
+        read_ret = handle_request();
+    //动态请求在工作线程中转发给FastCGI应用，不占用主线程
+    if (read_ret == FCGI_REQUEST)
+        read_ret = fastcgi();
+    //Host命中反向代理，之后的读写都由主线程驱动
+    if (read_ret == PROXY_REQUEST) {
+        read_ret = start_proxy();
+        if (read_ret == PROXY_REQUEST)
+            return;
+    }
     bool write_ret = process_write(read_ret);
     if (!write_ret) {
         close_conn();
     }
+    //冷文件先在I/O线程中读入内存，就绪后再注册EPOLLOUT
+    if (write_ret && offload_cold_window())
+        return;
     modfd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode);
 }
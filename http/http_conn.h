@@ -21,10 +21,30 @@
 #include <sys/wait.h>
 #include <sys/uio.h>
 #include <map>
+#include <vector>
 
 #include "../lock/locker.h"
 #include "../timer/lst_timer.h"
 #include "../log/log.h"
+#include "../router/router.h"
+
+class io_pool;
+class neg_cache;
+class vhost_table;
+class file_cache;
+struct file_entry;
+class html_prefetcher;
+class proxy_conn;
+class upstream_group;
+class upstream_pool;
+class response_cache;
+class request_coalescer;
+struct cached_response;
+class fcgi_pool;
+class credential_cache;
+class session_store;
+class rate_limiter;
+class coro_sched;
 
 class http_conn {
 public:
@@ -55,18 +75,33 @@ public:
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
         INTERNAL_ERROR,
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        PROXY_REQUEST,
+        BAD_GATEWAY,
+        CACHE_HIT,
+        FCGI_REQUEST,
+        HANDLER_REQUEST,
+        TOO_MANY_REQUESTS,
+        WORKER_REQUEST
     };
     enum LINE_STATUS {
         LINE_OK = 0,
         LINE_BAD,
         LINE_OPEN
     };
+    //主线程直接处理请求的结果
+    enum INLINE_STATUS {
+        INLINE_WAIT = 0,    //请求还没有读完，已重新注册EPOLLIN
+        INLINE_REPLY,       //响应已经生成，由主线程立即发送
+        INLINE_WORKER,      //需要交给工作线程
+        INLINE_CLOSE        //生成响应失败，应当关闭连接
+    };
 
 public:
-    http_conn() {}
+    http_conn() : m_coro(NULL), m_file_address(NULL), m_file_entry(NULL), m_cache_entry(NULL), m_proxy(NULL),
+                  m_generation(0) {}
 
-    ~http_conn() {}
+    ~http_conn();
 
 public:
     void init(int sockfd, const sockaddr_in &addr, char *, int, int);
@@ -75,10 +110,60 @@ public:
 
     void process();
 
+    /*在主线程中解析请求，请求不完整、出错或命中缓存等不会阻塞的情况直接生成响应；
+     *需要查库、stat、调用处理函数或转发的请求交给工作线程，工作线程从解析结果继续*/
+    INLINE_STATUS process_inline();
+
     bool read_once();
 
     bool write();
 
+    //I/O线程完成预读后回调，连接仍是提交时的那一个才重新注册EPOLLOUT
+    void io_done(unsigned generation);
+
+    //是否正在代理请求，代理期间的读写事件由主线程直接交给proxy_conn
+    bool proxying() const;
+
+    bool proxy_event(uint32_t events);
+
+    void abort_proxy();
+
+    //合并等待结束，在主线程中重新查缓存，仍未命中时自己去上游
+    void resume_coalesced();
+
+    //在主线程中恢复一组挂起的连接
+    static void resume(vector<http_conn *> &waiters);
+
+    //挂起等待的连接被关闭时撤销等待，协程模型下同时结束该连接的协程
+    static void unpark(int sockfd);
+
+    //工作线程是否正在用该连接等待FastCGI响应，此时定时器不能关闭它
+    static bool busy(int sockfd);
+
+    //连接关闭时归还该客户端IP占用的连接数
+    static void release_client(int sockfd);
+
+    int get_sockfd() const {
+        return m_sockfd;
+    }
+
+    /*公平调度用的请求类别，只看读缓冲中的请求行和Host：0为静态文件，1为动态请求，2为反向代理；
+     *reactor模式下入队时还没有读请求，都算0*/
+    int sched_class();
+
+    long sched_bytes() const {
+        return m_read_idx;
+    }
+
+    //响应还剩多少字节没有发送
+    int bytes_remaining() const {
+        return bytes_to_send;
+    }
+
+    /*连接当前所处的阶段(CONN_PHASE)，bytes为该阶段待接收的请求体或待发送的响应字节数；
+     *由主线程在连接没有交给工作线程时调用*/
+    int phase(long &bytes) const;
+
     sockaddr_in *get_address() {
         return &m_address;
     }
@@ -108,6 +193,8 @@ private:
 
     void unmap();
 
+    void prefetch_subresources(const char *root);
+
     bool add_response(const char *format, ...);
 
     bool add_content(const char *content);
@@ -124,10 +211,53 @@ private:
 
     bool add_blank_line();
 
+    //预先序列化的404响应，不再逐个格式化响应头
+    bool add_not_found();
+
+    bool add_preload();
+
+    bool add_set_cookie();
+
+    //改写请求头，缓存命中时返回CACHE_HIT，否则开始向上游转发并返回PROXY_REQUEST
+    HTTP_CODE start_proxy();
+
+    //在工作线程中把请求交给FastCGI应用，边收边以chunked发给客户端，
+    //全部发完后返回FCGI_REQUEST，写缓冲中只剩结尾的空块
+    HTTP_CODE fastcgi();
+
+    //登录和注册请求按校验结果换成对应的页面
+    void check_login();
+
+    //在工作线程中调用匹配到的处理函数，完整的响应报文写入m_response
+    HTTP_CODE handle_request();
+
+    //在非阻塞的客户端socket上阻塞发完iov中的数据
+    bool send_blocking(struct iovec *iov, int count);
+
+    //待发送的文件窗口不在内存中时交给I/O线程预读
+    bool offload_cold_window();
+
 public:
     static int m_epollfd;
+    static io_pool *m_io_pool;
+    static neg_cache *m_neg_cache;
+    static vhost_table *m_vhosts;
+    static file_cache *m_file_cache;
+    static html_prefetcher *m_prefetcher;
+    static upstream_pool *m_upstreams;
+    static response_cache *m_response_cache;
+    static request_coalescer *m_coalescer;
+    static fcgi_pool *m_fastcgi;
+    static const char *m_fcgi_prefix;   //以此开头的URL和所有POST请求交给FastCGI应用
+    static router *m_router;
+    static credential_cache *m_credentials;
+    static session_store *m_sessions;
+    static rate_limiter *m_limiter;
+    static coro_sched *m_sched;
+    static int m_write_budget;    //每次写事件最多发送的字节数，发完后重新排队，为0时不限制
     static int m_user_count;
     int m_state;  //读为0, 写为1
+    void *m_coro; //协程模型下交给工作线程继续执行的协程
 
 private:
     int m_sockfd;
@@ -147,6 +277,8 @@ private:
     long m_content_length;
     bool m_linger;
     char *m_file_address;
+    file_entry *m_file_entry;   //m_file_address来自文件缓存时指向对应条目
+    cached_response *m_cache_entry;   //m_file_address来自响应缓存时指向对应条目
     struct stat m_file_stat;
     struct iovec m_iv[2];
     int m_iv_count;
@@ -156,9 +288,26 @@ private:
     int bytes_have_send;
     char *doc_root;
 
-    map<string, string> m_users;
     int m_TRIGMode;
     int m_close_log;
+
+    int m_header_start;       //请求头在读缓冲区中的起始位置
+    upstream_group *m_upstream;     //Host命中的上游组，为NULL时由本机处理
+    proxy_conn *m_proxy;
+    bool m_coalesce;          //缓存未命中时是否与同key的在途请求合并
+
+    const route_handler *m_handler;   //匹配到的处理函数，为NULL时路径存在但方法不允许
+    int m_route_allowed;              //路径上已注册方法的位掩码
+    vector<pair<string, string>> m_route_params;
+    string m_response;                //处理函数生成的完整响应报文
+    string m_set_cookie;              //登录成功时下发的会话Cookie
+    int m_served;                     //这个连接上已经发完的请求数
+    unsigned m_generation;            //fd每被一个新连接使用加一，由io_lock保护
+
+    bool m_inline;                    //正在主线程中解析，遇到会阻塞的步骤时返回WORKER_REQUEST
+    HTTP_CODE m_parsed;               //主线程解析到的结果，工作线程从这里继续
+
+    friend class proxy_conn;
 };
 
 #endif
@@ -0,0 +1,67 @@
+#include "io_pool.h"
+#include "../http/http_conn.h"
+
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+io_pool::io_pool(int thread_number, int max_requests) : m_jobs(this, &io_pool::handle, thread_number,
+                                                               max_requests > 0 ? max_requests : 0) {
+}
+
+io_pool::~io_pool() {
+    m_jobs.stop();
+}
+
+bool io_pool::append(http_conn *request, unsigned generation, const char *path, off_t offset, size_t len) {
+    io_request job;
+    job.conn = request;
+    job.generation = generation;
+    job.path = path;
+    job.offset = offset;
+    job.len = len;
+    return m_jobs.push(job);
+}
+
+bool io_pool::resident(const char *addr, size_t len) {
+    if (!addr || len == 0)
+        return true;
+    static const long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) addr & ~(uintptr_t) (page - 1);
+    uintptr_t end = (uintptr_t) addr + len;
+    size_t pages = (end - start + page - 1) / page;
+    //窗口最多IO_WINDOW字节，加上首尾不对齐的两页
+    unsigned char vec[IO_WINDOW / 4096 + 2];
+    if (pages > sizeof(vec))
+        pages = sizeof(vec);
+    if (mincore((void *) start, pages * page, vec) != 0)
+        return true;
+    for (size_t i = 0; i < pages; ++i) {
+        if (!(vec[i] & 1))
+            return false;
+    }
+    return true;
+}
+
+void io_pool::fault_in(const char *path, off_t offset, size_t len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    //先发起异步预读，再顺序读一遍等待数据真正进入page cache
+    posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+    char buf[64 * 1024];
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+        if (n <= 0)
+            break;
+        offset += n;
+        len -= n;
+    }
+    close(fd);
+}
+
+void io_pool::handle(io_request &request) {
+    fault_in(request.path.c_str(), request.offset, request.len);
+    request.conn->io_done(request.generation);
+}
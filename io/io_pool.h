@@ -0,0 +1,47 @@
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <string>
+#include <cstddef>
+#include <sys/types.h>
+#include "../threadpool/job_queue.h"
+
+class http_conn;
+
+class io_pool {
+public:
+    //每次预读并检查驻留的文件窗口大小
+    static const size_t IO_WINDOW = 1024 * 1024;
+
+    /*thread_number是I/O线程数量，max_requests是等待预读的最大请求数*/
+    io_pool(int thread_number = 2, int max_requests = 10000);
+
+    //处理完已提交的预读后join所有I/O线程
+    ~io_pool();
+
+    /*提交一个文件窗口的预读任务，完成后重新注册连接的EPOLLOUT；
+     *按路径重新打开文件读取，不访问连接的映射，连接在预读期间关闭或被复用也不受影响*/
+    bool append(http_conn *request, unsigned generation, const char *path, off_t offset, size_t len);
+
+    //检查[addr, addr + len)是否已全部驻留在page cache中
+    static bool resident(const char *addr, size_t len);
+
+private:
+    struct io_request {
+        http_conn *conn;
+        unsigned generation;    //提交时连接的代数，连接被复用后不再恢复它
+        std::string path;
+        off_t offset;
+        size_t len;
+    };
+
+    void handle(io_request &request);
+
+    //把文件窗口读入page cache，调用线程会阻塞在磁盘上
+    static void fault_in(const char *path, off_t offset, size_t len);
+
+private:
+    job_queue<io_pool, io_request> m_jobs;
+};
+
+#endif
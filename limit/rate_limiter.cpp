@@ -0,0 +1,137 @@
+#include "rate_limiter.h"
+
+#include <ctime>
+
+rate_limiter::rate_limiter(int max_conns, int rate, int max_fd) : m_max_conns(max_conns), m_rate(rate),
+                                                                  m_max_fd(max_fd) {
+    m_slots = new slot[SLOTS];
+    for (uint32_t i = 0; i < SLOTS; ++i) {
+        m_slots[i].ip.store(0, memory_order_relaxed);
+        m_slots[i].conns.store(0, memory_order_relaxed);
+        m_slots[i].bucket.store(0, memory_order_relaxed);
+    }
+    m_owner = new atomic<uint32_t>[max_fd];
+    for (int i = 0; i < max_fd; ++i)
+        m_owner[i].store(0, memory_order_relaxed);
+    //令牌数只有32位
+    if (m_rate > 1000000)
+        m_rate = 1000000;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+    m_start_ms = t.tv_sec * 1000 + t.tv_nsec / 1000000 - 1;
+}
+
+rate_limiter::~rate_limiter() {
+    delete[] m_slots;
+    delete[] m_owner;
+}
+
+uint32_t rate_limiter::now_ms() const {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+    return (uint32_t) (t.tv_sec * 1000 + t.tv_nsec / 1000000 - m_start_ms);
+}
+
+rate_limiter::slot *rate_limiter::find(uint32_t ip, bool create) {
+    //IP的低位常常集中在少数几个值上，先打散
+    uint32_t h = ip * 2654435761u;
+    uint32_t start = h >> 16 & (SLOTS - 1);
+    slot *idle = NULL;
+    uint32_t idle_ip = 0;
+    for (int i = 0; i < MAX_PROBE; ++i) {
+        slot *s = &m_slots[(start + i) & (SLOTS - 1)];
+        uint32_t cur = s->ip.load(memory_order_acquire);
+        if (cur == ip)
+            return s;
+        if (cur == 0) {
+            if (!create)
+                return NULL;
+            if (s->ip.compare_exchange_strong(cur, ip, memory_order_acq_rel) || cur == ip)
+                return s;
+            continue;
+        }
+        //和admit中的fetch_add、重新检查ip按seq_cst排序，两边至少有一边看到对方
+        if (create && !idle && s->conns.load() == 0) {
+            uint64_t bucket = s->bucket.load(memory_order_relaxed);
+            if (bucket == 0 || now_ms() - (uint32_t) (bucket >> 32) >= IDLE_MS) {
+                idle = s;
+                idle_ip = cur;
+            }
+        }
+    }
+    //探测范围内没有空槽，把闲置的槽位让给新IP，抢不到时不限制
+    if (idle && idle->ip.compare_exchange_strong(idle_ip, ip)) {
+        idle->bucket.store(0, memory_order_relaxed);
+        return idle;
+    }
+    return NULL;
+}
+
+bool rate_limiter::admit(int fd, uint32_t ip) {
+    if (fd < 0 || fd >= m_max_fd || ip == 0)
+        return true;
+    slot *s;
+    int32_t conns;
+    while (true) {
+        s = find(ip, true);
+        if (!s)
+            return true;
+        conns = s->conns.fetch_add(1);
+        //find返回后槽位可能已被工作线程的allow当作闲置槽让给了别的IP，撤销后重新查找
+        if (s->ip.load() == ip)
+            break;
+        s->conns.fetch_sub(1);
+    }
+    if (m_max_conns > 0 && conns >= m_max_conns) {
+        s->conns.fetch_sub(1, memory_order_relaxed);
+        return false;
+    }
+    m_owner[fd].store(ip, memory_order_relaxed);
+    return true;
+}
+
+void rate_limiter::release(int fd) {
+    if (fd < 0 || fd >= m_max_fd)
+        return;
+    //同一连接可能分别由定时器和工作线程关闭，只有第一次归还
+    uint32_t ip = m_owner[fd].exchange(0, memory_order_relaxed);
+    if (ip == 0)
+        return;
+    slot *s = find(ip, false);
+    if (s)
+        s->conns.fetch_sub(1, memory_order_relaxed);
+}
+
+bool rate_limiter::allow(uint32_t ip) {
+    if (m_rate <= 0 || ip == 0)
+        return true;
+    slot *s = find(ip, true);
+    if (!s)
+        return true;
+    uint64_t capacity = (uint64_t) m_rate * 1000;
+    uint32_t now = now_ms();
+    uint64_t old = s->bucket.load(memory_order_relaxed);
+    while (true) {
+        uint64_t tokens = capacity;
+        uint32_t stamp = now;
+        if (old != 0) {
+            uint32_t last = (uint32_t) (old >> 32);
+            int32_t elapsed = (int32_t) (now - last);
+            //别的线程可能刚用稍晚的时间更新过
+            if (elapsed < 0) {
+                elapsed = 0;
+                stamp = last;
+            }
+            //每毫秒补充rate个千分之一令牌
+            tokens = (uint32_t) old + (uint64_t) elapsed * m_rate;
+            if (tokens > capacity)
+                tokens = capacity;
+        }
+        bool ok = tokens >= 1000;
+        if (ok)
+            tokens -= 1000;
+        uint64_t next = (uint64_t) stamp << 32 | tokens;
+        if (s->bucket.compare_exchange_weak(old, next, memory_order_relaxed))
+            return ok;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+/*按客户端IP限制并发连接数和请求速率。
+ *IP到计数的映射是固定大小的开放寻址表，槽位只用原子操作认领和更新，主线程接受连接、
+ *工作线程解析请求时都不加锁；表满时不限制*/
+class rate_limiter {
+public:
+    static const uint32_t SLOTS = 65536;    //槽位数，须为2的幂
+    static const int MAX_PROBE = 16;        //线性探测的最大步数
+    static const uint32_t IDLE_MS = 60000;  //没有连接且空闲这么久的槽位可以让给别的IP
+
+    /*max_conns为每个IP的最大并发连接数，rate为每个IP每秒的请求数，突发上限为一秒的量，0表示不限*/
+    rate_limiter(int max_conns, int rate, int max_fd);
+
+    ~rate_limiter();
+
+    //主线程接受连接后调用，超过连接数上限时返回false
+    bool admit(int fd, uint32_t ip);
+
+    //连接关闭时调用，重复调用无副作用
+    void release(int fd);
+
+    //每个请求调用一次，令牌用完时返回false
+    bool allow(uint32_t ip);
+
+private:
+    struct slot {
+        atomic<uint32_t> ip;        //网络字节序，0为空槽
+        atomic<int32_t> conns;
+        atomic<uint64_t> bucket;    //高32位为上次补充令牌的毫秒时间，低32位为千分之一令牌数，0为满桶
+    };
+
+    //查找ip的槽位，create时找不到就认领空槽或闲置槽，表满时返回NULL
+    slot *find(uint32_t ip, bool create);
+
+    //启动后经过的毫秒数，从1开始
+    uint32_t now_ms() const;
+
+private:
+    int m_max_conns;
+    int m_rate;
+    slot *m_slots;
+    int m_max_fd;
+    atomic<uint32_t> *m_owner;      //每个fd计入的客户端IP，0表示未计入
+    long m_start_ms;
+};
+
+#endif
@@ -4,6 +4,8 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <cerrno>
+#include <ctime>
 
 class sem {
 public:
@@ -31,6 +33,13 @@ public:
         return sem_post(&m_sem) == 0;
     }
 
+    //等到绝对时间t为止，超时返回false
+    bool timedwait(struct timespec t) {
+        int ret;
+        while ((ret = sem_timedwait(&m_sem, &t)) != 0 && errno == EINTR);
+        return ret == 0;
+    }
+
 private:
     sem_t m_sem;
 };
@@ -63,6 +72,35 @@ private:
     pthread_mutex_t m_mutex;
 };
 
+//读写锁，读多写少的数据用读锁并发访问
+class rwlocker {
+public:
+    rwlocker() {
+        if (pthread_rwlock_init(&m_rwlock, NULL) != 0) {
+            throw std::exception();
+        }
+    }
+
+    ~rwlocker() {
+        pthread_rwlock_destroy(&m_rwlock);
+    }
+
+    bool rdlock() {
+        return pthread_rwlock_rdlock(&m_rwlock) == 0;
+    }
+
+    bool wrlock() {
+        return pthread_rwlock_wrlock(&m_rwlock) == 0;
+    }
+
+    bool unlock() {
+        return pthread_rwlock_unlock(&m_rwlock) == 0;
+    }
+
+private:
+    pthread_rwlock_t m_rwlock;
+};
+
 class cond {
 public:
     cond() {
@@ -14,8 +14,50 @@ int main(int argc, char *argv[]) {
     //日志
     server.log_write();
 
+    //数据库连接池与登录校验缓存
+    server.sql_pool(config.sql_num, config.sql_user, config.sql_passwd, config.sql_database);
+
+    //登录会话
+    server.sessions(config.session_ttl, config.session_file);
+
+    //单IP连接数与请求速率限制
+    server.client_limits(config.max_conns_per_ip, config.rate_per_ip);
+
+    //连接各阶段超时
+    server.phase_timeouts(config.timeouts);
+
+    //发送预算与短剩余优先
+    server.write_fairness(config.write_budget_kb, config.srpt);
+
+    //主线程直接应答缓存命中
+    server.fast_path(config.inline_reply);
+
     //线程池
-    server.thread_pool();
+    server.thread_pool(config.work_stealing, config.max_thread_num, config.fair_sched);
+
+    //磁盘I/O线程池
+    server.io_thread_pool(config.io_thread_num);
+
+    //不存在路径的负缓存
+    server.negative_cache(config.neg_cache_size, config.neg_cache_ttl);
+
+    //虚拟主机
+    server.virtual_host(config.vhost_file);
+
+    //文件缓存与热点预热
+    server.file_caching(config.file_cache_mb, config.hot_set_file, config.prefetch_mode);
+
+    //反向代理
+    server.reverse_proxy(config.splice_kb);
+
+    //代理响应缓存
+    server.response_caching(config.response_cache_mb);
+
+    //FastCGI网关
+    server.fastcgi(config.fcgi_address);
+
+    //进程内处理函数
+    server.native_handlers();
 
     //触发模式
     server.trig_mode();
@@ -0,0 +1,84 @@
+#include "coalescer.h"
+
+request_coalescer::request_coalescer(int timeout) : m_timeout(timeout), m_next_id(1) {
+}
+
+bool request_coalescer::join(const string &key, http_conn *conn, int sockfd, uint64_t &id) {
+    m_lock.lock();
+    auto it = m_flights.find(key);
+    if (it == m_flights.end()) {
+        flight &f = m_flights[key];
+        f.id = id = m_next_id++;
+        f.deadline = time(NULL) + m_timeout;
+        m_lock.unlock();
+        return false;
+    }
+    waiter w;
+    w.conn = conn;
+    w.sockfd = sockfd;
+    it->second.waiters.push_back(w);
+    m_waiting[sockfd] = key;
+    m_lock.unlock();
+    return true;
+}
+
+void request_coalescer::complete(const string &key, uint64_t id, vector<http_conn *> &waiters) {
+    m_lock.lock();
+    auto it = m_flights.find(key);
+    if (it != m_flights.end() && it->second.id == id) {
+        for (const waiter &w : it->second.waiters) {
+            waiters.push_back(w.conn);
+            m_waiting.erase(w.sockfd);
+        }
+        m_flights.erase(it);
+    }
+    m_lock.unlock();
+}
+
+void request_coalescer::abandon(const string &key, uint64_t id) {
+    m_lock.lock();
+    auto it = m_flights.find(key);
+    if (it != m_flights.end() && it->second.id == id) {
+        //没有等待者时直接删除，否则留给expire统一处理
+        if (it->second.waiters.empty())
+            m_flights.erase(it);
+        else
+            it->second.deadline = 0;
+    }
+    m_lock.unlock();
+}
+
+void request_coalescer::expire(time_t now, vector<http_conn *> &waiters) {
+    m_lock.lock();
+    for (auto it = m_flights.begin(); it != m_flights.end();) {
+        if (it->second.deadline > now) {
+            ++it;
+            continue;
+        }
+        for (const waiter &w : it->second.waiters) {
+            waiters.push_back(w.conn);
+            m_waiting.erase(w.sockfd);
+        }
+        it = m_flights.erase(it);
+    }
+    m_lock.unlock();
+}
+
+void request_coalescer::cancel(int sockfd) {
+    m_lock.lock();
+    auto it = m_waiting.find(sockfd);
+    if (it != m_waiting.end()) {
+        auto f = m_flights.find(it->second);
+        if (f != m_flights.end()) {
+            vector<waiter> &ws = f->second.waiters;
+            for (size_t i = 0; i < ws.size(); ++i) {
+                if (ws[i].sockfd == sockfd) {
+                    ws.erase(ws.begin() + i);
+                    break;
+                }
+            }
+        }
+        m_waiting.erase(it);
+    }
+    m_lock.unlock();
+}
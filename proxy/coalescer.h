@@ -0,0 +1,57 @@
+#ifndef COALESCER_H
+#define COALESCER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include <unordered_map>
+#include "../lock/locker.h"
+
+using namespace std;
+
+class http_conn;
+
+//合并同一缓存key上并发的上游请求，第一个请求去上游，其余的挂起等待它的响应进入缓存
+class request_coalescer {
+public:
+    /*领头请求timeout秒内没有完成时，等待者不再等待，各自去上游*/
+    request_coalescer(int timeout = 3);
+
+    /*没有同key的请求在途时登记为领头并返回false，id为本次在途请求的编号；
+     *否则把conn挂起并返回true，conn此时不能再注册任何事件*/
+    bool join(const string &key, http_conn *conn, int sockfd, uint64_t &id);
+
+    //领头请求结束，取出全部等待者；id不匹配说明已经超时被接管，什么也不做
+    void complete(const string &key, uint64_t id, vector<http_conn *> &waiters);
+
+    //领头请求被放弃，等待者在下一次定时检查时各自去上游
+    void abandon(const string &key, uint64_t id);
+
+    //取出等待超时的连接
+    void expire(time_t now, vector<http_conn *> &waiters);
+
+    //挂起的连接被关闭时撤销等待
+    void cancel(int sockfd);
+
+private:
+    struct waiter {
+        http_conn *conn;
+        int sockfd;
+    };
+
+    struct flight {
+        uint64_t id;
+        time_t deadline;
+        vector<waiter> waiters;
+    };
+
+private:
+    int m_timeout;
+    uint64_t m_next_id;
+    unordered_map<string, flight> m_flights;
+    unordered_map<int, string> m_waiting;   //挂起的套接字对应的key
+    locker m_lock;
+};
+
+#endif
@@ -0,0 +1,700 @@
+#include "proxy_conn.h"
+#include "../http/http_conn.h"
+#include "coalescer.h"
+
+#include <fcntl.h>
+#include <strings.h>
+
+const char *error_502_response = "HTTP/1.1 502 Bad Gateway\r\nContent-Length:44\r\nConnection:close\r\n\r\n"
+                                 "The upstream server did not respond in time.";
+
+void modfd(int epollfd, int fd, int ev, int TRIGMode);
+
+proxy_conn *proxy_conn::m_owners[MAX_FD];
+long proxy_conn::m_splice_min = 64 * 1024;
+
+void chunk_parser::reset() {
+    m_state = CHUNK_SIZE;
+    m_remain = 0;
+    m_empty_line = true;
+}
+
+size_t chunk_parser::feed(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && m_state != CHUNK_DONE) {
+        char c = p[i];
+        switch (m_state) {
+            case CHUNK_SIZE: {
+                if (isxdigit((unsigned char) c)) {
+                    m_remain = m_remain * 16 + (isdigit((unsigned char) c) ? c - '0' : (tolower(c) - 'a' + 10));
+                } else if (c == '\r') {
+                    m_state = CHUNK_SIZE_LF;
+                } else {
+                    m_state = CHUNK_EXT;
+                }
+                ++i;
+                break;
+            }
+            case CHUNK_EXT: {
+                if (c == '\r')
+                    m_state = CHUNK_SIZE_LF;
+                ++i;
+                break;
+            }
+            case CHUNK_SIZE_LF: {
+                //大小为0的块之后是可选的trailer，以空行结束
+                m_state = m_remain == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+                m_empty_line = true;
+                ++i;
+                break;
+            }
+            case CHUNK_DATA: {
+                size_t n = len - i < m_remain ? len - i : m_remain;
+                m_remain -= n;
+                i += n;
+                if (m_remain == 0)
+                    m_state = CHUNK_DATA_CR;
+                break;
+            }
+            case CHUNK_DATA_CR: {
+                m_state = CHUNK_DATA_LF;
+                ++i;
+                break;
+            }
+            case CHUNK_DATA_LF: {
+                m_state = CHUNK_SIZE;
+                ++i;
+                break;
+            }
+            case CHUNK_TRAILER: {
+                m_state = c == '\r' ? CHUNK_TRAILER_LF : CHUNK_TRAILER_LINE;
+                m_empty_line = c == '\r';
+                ++i;
+                break;
+            }
+            case CHUNK_TRAILER_LINE: {
+                if (c == '\r')
+                    m_state = CHUNK_TRAILER_LF;
+                ++i;
+                break;
+            }
+            case CHUNK_TRAILER_LF: {
+                m_state = m_empty_line ? CHUNK_DONE : CHUNK_TRAILER;
+                ++i;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return i;
+}
+
+proxy_conn::proxy_conn(http_conn *conn) : m_conn(conn), m_group(NULL), m_upstream(NULL), m_fd(-1),
+                                          m_registered(false), m_state(PROXY_IDLE), m_stale(NULL), m_flight(0),
+                                          m_capturing(false), m_pipe_len(0), m_splicing(false) {
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+proxy_conn::~proxy_conn() {
+    abort();
+    if (m_pipe[0] >= 0) {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+int proxy_conn::client_fd() const {
+    return m_conn->m_sockfd;
+}
+
+bool proxy_conn::start(upstream_group *group, const string &key, string &request, long body_left) {
+    m_group = group;
+    m_key = key;
+    m_tries = 1;
+    m_upstream = group->select(m_key, NULL);
+    m_request.swap(request);
+    m_request_sent = 0;
+    m_body_left = body_left;
+    m_buf_len = 0;
+    m_out.clear();
+    m_out_sent = 0;
+    m_head_done = false;
+    m_status = 0;
+    m_sent_any = false;
+    m_done = false;
+    m_reusable = false;
+    m_client_close = !m_conn->m_linger;
+    m_chunked = false;
+    m_until_close = false;
+    m_content_left = 0;
+    m_chunk.reset();
+    m_retried = false;
+    m_replayable = true;
+    m_splicing = false;
+    m_group->deposit();
+
+    if (!m_upstream)
+        return false;
+    if (!connect_upstream(false)) {
+        m_upstream->report(false);
+        return false;
+    }
+    m_state = PROXY_SEND_REQUEST;
+    arm_upstream(EPOLLOUT);
+    return true;
+}
+
+void proxy_conn::cache(const string &base, cached_response *stale, uint64_t flight) {
+    m_cache_base = base;
+    m_stale = stale;
+    m_flight = flight;
+}
+
+void proxy_conn::drop_cache() {
+    //被放弃的领头请求不唤醒等待者，由超时检查让它们各自去上游
+    if (m_flight)
+        http_conn::m_coalescer->abandon(m_cache_base, m_flight);
+    m_flight = 0;
+    if (m_stale)
+        http_conn::m_response_cache->release(m_stale);
+    m_stale = NULL;
+    m_cache_base.clear();
+    m_capturing = false;
+    m_capture_head.clear();
+    m_capture.clear();
+}
+
+bool proxy_conn::connect_upstream(bool fresh) {
+    m_fd = m_upstream->acquire(m_reused, fresh);
+    if (m_fd < 0 || m_fd >= MAX_FD) {
+        if (m_fd >= 0)
+            close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    m_registered = false;
+    m_owners[m_fd] = this;
+    m_upstream->begin_request();
+    return true;
+}
+
+void proxy_conn::close_upstream(bool reuse) {
+    if (m_fd < 0)
+        return;
+    if (m_registered)
+        epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_DEL, m_fd, 0);
+    m_owners[m_fd] = NULL;
+    m_upstream->end_request();
+    if (reuse)
+        m_upstream->release(m_fd);
+    else
+        close(m_fd);
+    m_fd = -1;
+    m_registered = false;
+}
+
+void proxy_conn::arm_upstream(uint32_t ev) {
+    epoll_event event;
+    event.data.fd = m_fd;
+    event.events = ev | EPOLLONESHOT;
+    //注册之后事件可能立刻在主线程中被处理，状态必须在epoll_ctl之前更新
+    int op = m_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    m_registered = true;
+    epoll_ctl(http_conn::m_epollfd, op, m_fd, &event);
+}
+
+void proxy_conn::arm_client(uint32_t ev) {
+    modfd(http_conn::m_epollfd, m_conn->m_sockfd, ev, m_conn->m_TRIGMode);
+}
+
+void proxy_conn::abort() {
+    close_upstream(false);
+    m_state = PROXY_IDLE;
+    m_request.clear();
+    m_out.clear();
+    reset_pipe();
+    drop_cache();
+}
+
+bool proxy_conn::on_upstream_event(uint32_t events) {
+    //连接失败或被复位时直接按上游故障处理(可重试时换连接重发)；
+    //接收响应时已到达的数据仍可读出，交给recv发现错误
+    if ((events & EPOLLERR) && m_state != PROXY_RECV_RESPONSE)
+        return upstream_failed();
+    switch (m_state) {
+        case PROXY_SEND_REQUEST:
+            return send_request();
+        case PROXY_SEND_BODY:
+            return m_splicing ? splice_body() : relay_body();
+        case PROXY_RECV_RESPONSE:
+            return m_splicing ? splice_response() : recv_response();
+        default:
+            return false;
+    }
+}
+
+bool proxy_conn::on_client_event(uint32_t events) {
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        abort();
+        return false;
+    }
+    if (m_state == PROXY_SEND_BODY && (events & EPOLLIN) && m_splicing)
+        return splice_body();
+    if (m_state == PROXY_SEND_BODY && (events & EPOLLIN)) {
+        //上一段请求体发送完之后才会监听客户端，m_out此时为空
+        long want = m_body_left < BUFFER_SIZE ? m_body_left : BUFFER_SIZE;
+        ssize_t n = recv(m_conn->m_sockfd, m_buf, want, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            arm_client(EPOLLIN);
+            return true;
+        }
+        if (n <= 0) {
+            abort();
+            return false;
+        }
+        m_body_left -= n;
+        m_out.assign(m_buf, n);
+        m_out_sent = 0;
+        return relay_body();
+    }
+    if (m_state == PROXY_RECV_RESPONSE && (events & EPOLLOUT))
+        return flush_client();
+    return true;
+}
+
+bool proxy_conn::send_request() {
+    while (m_request_sent < m_request.size()) {
+        ssize_t n = send(m_fd, m_request.data() + m_request_sent, m_request.size() - m_request_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                arm_upstream(EPOLLOUT);
+                return true;
+            }
+            return upstream_failed();
+        }
+        m_request_sent += n;
+    }
+
+    if (m_body_left > 0) {
+        //剩余请求体从客户端边读边发，读过的部分不再保留，之后出错不能重试
+        m_state = PROXY_SEND_BODY;
+        m_replayable = false;
+        m_out.clear();
+        m_out_sent = 0;
+        //大的请求体不经过用户态缓冲
+        m_splicing = m_splice_min > 0 && m_body_left >= m_splice_min && open_pipe();
+        arm_client(EPOLLIN);
+        return true;
+    }
+    m_state = PROXY_RECV_RESPONSE;
+    arm_upstream(EPOLLIN);
+    return true;
+}
+
+bool proxy_conn::relay_body() {
+    while (m_out_sent < m_out.size()) {
+        ssize_t n = send(m_fd, m_out.data() + m_out_sent, m_out.size() - m_out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                arm_upstream(EPOLLOUT);
+                return true;
+            }
+            return upstream_failed();
+        }
+        m_out_sent += n;
+    }
+    m_out.clear();
+    m_out_sent = 0;
+
+    if (m_body_left > 0) {
+        arm_client(EPOLLIN);
+        return true;
+    }
+    m_state = PROXY_RECV_RESPONSE;
+    arm_upstream(EPOLLIN);
+    return true;
+}
+
+bool proxy_conn::recv_response() {
+    ssize_t n = recv(m_fd, m_buf + m_buf_len, BUFFER_SIZE - m_buf_len, 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            arm_upstream(EPOLLIN);
+            return true;
+        }
+        return upstream_failed();
+    }
+    if (n == 0) {
+        //以关闭连接结束的响应到此完整
+        if (m_head_done && m_until_close) {
+            m_done = true;
+            close_upstream(false);
+            return flush_client();
+        }
+        return upstream_failed();
+    }
+
+    m_buf_len += n;
+    if (!m_head_done) {
+        int ret = parse_response_head();
+        if (ret < 0)
+            return upstream_failed();
+        if (ret == 2)
+            return serve_stale();
+        if (ret == 0) {
+            arm_upstream(EPOLLIN);
+            return true;
+        }
+    } else {
+        consume_body(m_buf, m_buf_len);
+        m_buf_len = 0;
+    }
+    return flush_client();
+}
+
+//在头部中查找name字段，返回值的起始位置
+static const char *find_header(const char *line, const char *name) {
+    size_t len = strlen(name);
+    if (strncasecmp(line, name, len) != 0)
+        return NULL;
+    line += len;
+    while (*line == ' ' || *line == '\t')
+        ++line;
+    return line;
+}
+
+int proxy_conn::parse_response_head() {
+    char *end = (char *) memmem(m_buf, m_buf_len, "\r\n\r\n", 4);
+    if (!end)
+        return m_buf_len >= BUFFER_SIZE ? -1 : 0;
+    size_t head_len = end + 4 - m_buf;
+
+    //状态行原样转发，逐行过滤逐跳头部
+    char *line = m_buf;
+    char *line_end = (char *) memmem(line, end + 2 - line, "\r\n", 2);
+    if (line_end - line < 12 || strncmp(line, "HTTP/1.", 7) != 0)
+        return -1;
+    int status = atoi(line + 9);
+    m_status = status;
+    bool upstream_close = strncmp(line, "HTTP/1.0", 8) == 0;
+    m_out.assign(line, line_end + 2 - line);
+    bool capture = !m_cache_base.empty();
+    if (capture) {
+        m_policy = cache_policy();
+        m_capture_head.assign(m_out);
+    }
+
+    bool has_length = false;
+    for (line = line_end + 2; line < end; line = line_end + 2) {
+        line_end = (char *) memmem(line, end + 2 - line, "\r\n", 2);
+        *line_end = '\0';
+        const char *value;
+        if ((value = find_header(line, "Connection:")) != NULL) {
+            upstream_close = strcasestr(value, "close") != NULL;
+            continue;
+        }
+        if (find_header(line, "Keep-Alive:") != NULL)
+            continue;
+        if (capture) {
+            response_cache::parse_header(m_policy, line);
+            if (find_header(line, "Age:") == NULL)
+                m_capture_head.append(line, line_end - line).append("\r\n");
+        }
+        if ((value = find_header(line, "Content-Length:")) != NULL) {
+            has_length = true;
+            m_content_left = atoll(value);
+        } else if ((value = find_header(line, "Transfer-Encoding:")) != NULL) {
+            m_chunked = strcasestr(value, "chunked") != NULL;
+        }
+        m_out.append(line, line_end - line);
+        m_out.append("\r\n");
+    }
+
+    if (status < 200)
+        return -1;
+    //上游返回5xx时，过期但仍可用的缓存比错误页更有用
+    if (status >= 500 && stale_usable())
+        return 2;
+    if (status == 204 || status == 304) {
+        m_chunked = false;
+        m_content_left = 0;
+    } else if (!m_chunked && !has_length) {
+        //没有长度信息，响应体到上游关闭连接为止，客户端也只能靠关闭连接判断结束
+        m_until_close = true;
+        m_client_close = true;
+    }
+    m_reusable = !upstream_close && !m_until_close;
+    m_capturing = capture && !m_until_close && response_cache::cacheable(status, m_policy, time(NULL)) &&
+                  m_content_left <= (long long) http_conn::m_response_cache->max_object();
+    if (!m_capturing)
+        m_capture_head.clear();
+    //响应体长度已知或读到关闭为止、且不需要复制进缓存时，头部发完后改用splice转发，chunked仍需逐块解析
+    m_splicing = m_splice_min > 0 && !m_chunked && !m_capturing &&
+                 (m_until_close || m_content_left >= m_splice_min) && open_pipe();
+    m_out.append(m_client_close ? "Connection:close\r\n\r\n" : "Connection:keep-alive\r\n\r\n");
+    m_head_done = true;
+
+    size_t body_len = m_buf_len - head_len;
+    if (m_chunked || m_until_close || m_content_left > 0)
+        consume_body(m_buf + head_len, body_len);
+    else
+        m_done = true;
+    m_buf_len = 0;
+    return 1;
+}
+
+void proxy_conn::consume_body(const char *p, size_t len) {
+    if (m_until_close) {
+        m_out.append(p, len);
+        return;
+    }
+    size_t used;
+    if (m_chunked) {
+        used = m_chunk.feed(p, len);
+        m_done = m_chunk.done();
+    } else {
+        used = (long long) len < m_content_left ? len : m_content_left;
+        m_content_left -= used;
+        m_done = m_content_left == 0;
+    }
+    m_out.append(p, used);
+    if (m_capturing) {
+        m_capture.append(p, used);
+        //超过单个响应的上限后放弃缓存
+        if (m_capture.size() > http_conn::m_response_cache->max_object()) {
+            m_capturing = false;
+            m_capture_head.clear();
+            string().swap(m_capture);
+        }
+    }
+}
+
+bool proxy_conn::flush_client() {
+    while (m_out_sent < m_out.size()) {
+        ssize_t n = send(m_conn->m_sockfd, m_out.data() + m_out_sent, m_out.size() - m_out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                //客户端接收慢，暂停读取上游，等客户端可写后再继续
+                arm_client(EPOLLOUT);
+                return true;
+            }
+            abort();
+            return false;
+        }
+        m_sent_any = true;
+        m_out_sent += n;
+    }
+    m_out.clear();
+    m_out_sent = 0;
+
+    //管道中还有响应体时先由splice_response发完，它在发完后才调用finish
+    if (m_splicing && m_pipe_len > 0)
+        return splice_response();
+    if (m_done)
+        return finish();
+    if (m_splicing)
+        return splice_response();
+    arm_upstream(EPOLLIN);
+    return true;
+}
+
+bool proxy_conn::upstream_failed() {
+    bool resend = m_replayable && !m_head_done && m_buf_len == 0;
+    //复用的连接可能刚好被上游关闭，换新连接重发一次，不算作后端故障
+    if (resend && m_reused && !m_retried) {
+        m_retried = true;
+        close_upstream(false);
+        if (connect_upstream(true)) {
+            m_state = PROXY_SEND_REQUEST;
+            m_request_sent = 0;
+            arm_upstream(EPOLLOUT);
+            return true;
+        }
+    }
+
+    close_upstream(false);
+    m_upstream->report(false);
+
+    //换一个后端重试，次数和重试预算都有上限，避免故障时重试放大流量
+    while (resend && can_resend() && m_tries < m_group->max_tries() && m_group->withdraw()) {
+        upstream *next = m_group->select(m_key, m_upstream);
+        if (!next)
+            break;
+        ++m_tries;
+        m_upstream = next;
+        m_retried = false;
+        if (connect_upstream(false)) {
+            m_state = PROXY_SEND_REQUEST;
+            m_request_sent = 0;
+            arm_upstream(EPOLLOUT);
+            return true;
+        }
+        m_upstream->report(false);
+    }
+
+    if (m_sent_any) {
+        abort();
+        return false;
+    }
+    if (stale_usable())
+        return serve_stale();
+    m_out.assign(error_502_response);
+    m_out_sent = 0;
+    m_done = true;
+    m_client_close = true;
+    return flush_client();
+}
+
+bool proxy_conn::can_resend() const {
+    if (m_state == PROXY_SEND_REQUEST && m_request_sent == 0)
+        return true;
+    return m_conn->m_method == http_conn::GET || m_conn->m_method == http_conn::HEAD;
+}
+
+bool proxy_conn::finish() {
+    //502、503、504说明后端自身出了问题，计入被动健康检查
+    if (m_done && m_upstream && m_status > 0)
+        m_upstream->report(m_status < 502 || m_status > 504);
+    close_upstream(m_reusable && m_done);
+    if (m_capturing && m_done)
+        http_conn::m_response_cache->store(m_cache_base, m_request, m_policy, m_capture_head, m_capture);
+    //响应已进入缓存(或不可缓存)，唤醒等待同一key的连接
+    if (m_flight) {
+        vector<http_conn *> waiters;
+        http_conn::m_coalescer->complete(m_cache_base, m_flight, waiters);
+        m_flight = 0;
+        http_conn::resume(waiters);
+    }
+    drop_cache();
+    reset_pipe();
+    m_state = PROXY_IDLE;
+    m_request.clear();
+    if (m_client_close)
+        return false;
+
+    //长连接，回到http_conn继续处理下一个请求
+    m_conn->init();
+    arm_client(EPOLLIN);
+    return true;
+}
+
+bool proxy_conn::stale_usable() const {
+    return m_stale && time(NULL) < m_stale->sie_until;
+}
+
+bool proxy_conn::serve_stale() {
+    close_upstream(false);
+    char age[64];
+    snprintf(age, sizeof(age), "Age:%ld\r\n", response_cache::age(m_stale, time(NULL)));
+    m_out.assign(m_stale->head).append(age);
+    m_out.append(m_client_close ? "Connection:close\r\n\r\n" : "Connection:keep-alive\r\n\r\n");
+    m_out.append(m_stale->body);
+    m_out_sent = 0;
+    m_capturing = false;
+    m_reusable = false;
+    m_done = true;
+    return flush_client();
+}
+
+bool proxy_conn::open_pipe() {
+    if (m_pipe[0] >= 0)
+        return true;
+    if (pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        m_pipe[0] = m_pipe[1] = -1;
+        return false;
+    }
+    //管道页按需分配，容量大一些可以减少splice次数
+    fcntl(m_pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+    m_pipe_len = 0;
+    return true;
+}
+
+void proxy_conn::reset_pipe() {
+    m_splicing = false;
+    if (m_pipe_len == 0)
+        return;
+    close(m_pipe[0]);
+    close(m_pipe[1]);
+    m_pipe[0] = m_pipe[1] = -1;
+    m_pipe_len = 0;
+}
+
+bool proxy_conn::splice_body() {
+    while (true) {
+        //先把管道中的数据送给上游，上游写不进去时暂停读取客户端
+        while (m_pipe_len > 0) {
+            ssize_t n = splice(m_pipe[0], NULL, m_fd, NULL, m_pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    arm_upstream(EPOLLOUT);
+                    return true;
+                }
+                return upstream_failed();
+            }
+            m_pipe_len -= n;
+        }
+        if (m_body_left == 0) {
+            m_splicing = false;
+            m_state = PROXY_RECV_RESPONSE;
+            arm_upstream(EPOLLIN);
+            return true;
+        }
+
+        size_t want = m_body_left < PIPE_SIZE ? m_body_left : PIPE_SIZE;
+        ssize_t n = splice(m_conn->m_sockfd, NULL, m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            arm_client(EPOLLIN);
+            return true;
+        }
+        if (n <= 0) {
+            abort();
+            return false;
+        }
+        m_body_left -= n;
+        m_pipe_len += n;
+    }
+}
+
+bool proxy_conn::splice_response() {
+    while (true) {
+        //管道中的数据全部发给客户端后才继续读上游，客户端慢时自然形成背压
+        while (m_pipe_len > 0) {
+            ssize_t n = splice(m_pipe[0], NULL, m_conn->m_sockfd, NULL, m_pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    arm_client(EPOLLOUT);
+                    return true;
+                }
+                abort();
+                return false;
+            }
+            m_sent_any = true;
+            m_pipe_len -= n;
+        }
+        if (m_done)
+            return finish();
+
+        size_t want = m_until_close || m_content_left > PIPE_SIZE ? PIPE_SIZE : m_content_left;
+        ssize_t n = splice(m_fd, NULL, m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                arm_upstream(EPOLLIN);
+                return true;
+            }
+            return upstream_failed();
+        }
+        if (n == 0) {
+            if (!m_until_close)
+                return upstream_failed();
+            m_done = true;
+            close_upstream(false);
+            continue;
+        }
+        m_pipe_len += n;
+        if (!m_until_close) {
+            m_content_left -= n;
+            m_done = m_content_left == 0;
+        }
+    }
+}
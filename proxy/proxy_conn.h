@@ -0,0 +1,198 @@
+#ifndef PROXY_CONN_H
+#define PROXY_CONN_H
+
+#include <string>
+#include <cstdint>
+#include <sys/types.h>
+#include "upstream_pool.h"
+#include "response_cache.h"
+
+using namespace std;
+
+class http_conn;
+
+//chunked编码的从状态机，只负责找出响应体的结束位置
+class chunk_parser {
+public:
+    chunk_parser() {
+        reset();
+    }
+
+    void reset();
+
+    //消费[p, p + len)，返回属于本响应的字节数，遇到结束块后不再消费
+    size_t feed(const char *p, size_t len);
+
+    bool done() const {
+        return m_state == CHUNK_DONE;
+    }
+
+private:
+    enum CHUNK_STATE {
+        CHUNK_SIZE = 0,
+        CHUNK_EXT,
+        CHUNK_SIZE_LF,
+        CHUNK_DATA,
+        CHUNK_DATA_CR,
+        CHUNK_DATA_LF,
+        CHUNK_TRAILER,
+        CHUNK_TRAILER_LINE,
+        CHUNK_TRAILER_LF,
+        CHUNK_DONE
+    };
+
+    CHUNK_STATE m_state;
+    uint64_t m_remain;
+    bool m_empty_line;
+};
+
+//一个客户端连接上正在进行的代理请求，所有I/O都在主线程中完成
+class proxy_conn {
+public:
+    static const int BUFFER_SIZE = 16384;
+    static const int MAX_FD = 65536;
+    static const int PIPE_SIZE = 256 * 1024;
+
+    enum PROXY_STATE {
+        PROXY_IDLE = 0,
+        PROXY_SEND_REQUEST,   //向上游发送请求头和已读到的请求体
+        PROXY_SEND_BODY,      //从客户端读取剩余的请求体转发给上游
+        PROXY_RECV_RESPONSE   //从上游读取响应转发给客户端
+    };
+
+public:
+    proxy_conn(http_conn *conn);
+
+    ~proxy_conn();
+
+    /*开始转发，request为改写后的请求头加上已读到的请求体，body_left为尚未读取的请求体长度，
+     *key为一致性哈希选择后端的依据*/
+    bool start(upstream_group *group, const string &key, string &request, long body_left);
+
+    /*在start之前调用，base为响应缓存的基础key，可缓存的响应在转发的同时存入缓存；
+     *stale为已过期的缓存条目，上游出错时用它代替502，引用由proxy_conn接管；
+     *flight非0时本请求是合并请求的领头，结束后唤醒同key的等待者*/
+    void cache(const string &base, cached_response *stale, uint64_t flight = 0);
+
+    //上游套接字上的事件，返回false时需要关闭客户端连接
+    bool on_upstream_event(uint32_t events);
+
+    //代理期间客户端套接字上的事件，返回false时需要关闭客户端连接
+    bool on_client_event(uint32_t events);
+
+    //客户端连接关闭时放弃正在进行的代理
+    void abort();
+
+    bool active() const {
+        return m_state != PROXY_IDLE;
+    }
+
+    int client_fd() const;
+
+    //请求体或响应体不少于该字节数时用splice经管道转发，0表示不启用
+    static long m_splice_min;
+
+    //fd为某个代理正在使用的上游连接时返回其所属的代理
+    static proxy_conn *owner(int fd) {
+        return (fd >= 0 && fd < MAX_FD) ? m_owners[fd] : NULL;
+    }
+
+private:
+    bool connect_upstream(bool fresh);
+
+    void close_upstream(bool reuse);
+
+    void arm_upstream(uint32_t ev);
+
+    void arm_client(uint32_t ev);
+
+    bool send_request();
+
+    bool relay_body();
+
+    bool recv_response();
+
+    //解析上游响应头并改写Connection，头部不完整时返回0，出错返回-1
+    int parse_response_head();
+
+    //把响应体追加到发送缓冲，并判断响应是否结束
+    void consume_body(const char *p, size_t len);
+
+    //向客户端发送缓冲中的数据，发完后继续读上游或结束本次代理
+    bool flush_client();
+
+    //连接或读写上游失败，复用的连接可重试一次，请求可重放时在预算内换一个后端重试，否则返回502
+    bool upstream_failed();
+
+    //请求还没有到达上游，或者方法是幂等的，重发不会产生副作用
+    bool can_resend() const;
+
+    bool finish();
+
+    //按需创建转发用的管道
+    bool open_pipe();
+
+    //管道中残留数据时丢弃整个管道，下次使用时重新创建
+    void reset_pipe();
+
+    //客户端->管道->上游转发剩余的请求体
+    bool splice_body();
+
+    //上游->管道->客户端转发响应体
+    bool splice_response();
+
+    //上游出错或返回5xx时，在stale-if-error窗口内用过期的缓存条目应答
+    bool stale_usable() const;
+
+    bool serve_stale();
+
+    void drop_cache();
+
+private:
+    static proxy_conn *m_owners[MAX_FD];
+
+    http_conn *m_conn;
+    upstream_group *m_group;
+    upstream *m_upstream;
+    string m_key;
+    int m_tries;           //已经尝试过的后端数
+    int m_fd;
+    bool m_registered;     //上游连接是否已加入epoll
+    bool m_reused;         //上游连接是否取自连接池
+    bool m_retried;        //复用连接失效后的重试已经用过
+    bool m_replayable;     //m_request中保留着完整的请求，可以向其他后端重发
+    PROXY_STATE m_state;
+
+    string m_request;
+    size_t m_request_sent;
+    long m_body_left;
+
+    char m_buf[BUFFER_SIZE];
+    size_t m_buf_len;
+    string m_out;          //待发往客户端的数据
+    size_t m_out_sent;
+    bool m_head_done;
+    int m_status;
+    bool m_sent_any;       //是否已经向客户端发送过响应数据
+    bool m_done;           //响应已完整读取
+    bool m_reusable;       //响应结束后上游连接可复用
+    bool m_client_close;   //响应结束后关闭客户端连接
+    bool m_chunked;
+    bool m_until_close;    //响应体以上游关闭连接结束
+    long long m_content_left;
+    chunk_parser m_chunk;
+
+    string m_cache_base;   //为空时不缓存
+    cached_response *m_stale;
+    uint64_t m_flight;
+    bool m_capturing;      //正在把响应复制一份准备存入缓存
+    cache_policy m_policy;
+    string m_capture_head;
+    string m_capture;
+
+    int m_pipe[2];
+    size_t m_pipe_len;     //管道中尚未转出的字节数
+    bool m_splicing;       //当前阶段的数据经管道零拷贝转发
+};
+
+#endif
@@ -0,0 +1,321 @@
+#include "response_cache.h"
+#include "upstream_pool.h"
+#include "proxy_conn.h"
+
+#include <unistd.h>
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
+#include <sys/socket.h>
+
+response_cache::response_cache(size_t max_bytes, size_t max_object) : m_shard_bytes(max_bytes / SHARDS),
+                                                                      m_max_object(max_object),
+                                                                      m_stop(false),
+                                                                      m_jobs(this, &response_cache::handle,
+                                                                             REFRESH_THREADS, MAX_REFRESH) {
+}
+
+response_cache::~response_cache() {
+    m_stop = true;
+    m_jobs.stop();
+    for (int i = 0; i < SHARDS; ++i) {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        while (!s.lru.empty())
+            erase(s, s.lru.back());
+        s.lock.unlock();
+    }
+}
+
+response_cache::shard &response_cache::shard_of(const string &base) {
+    return m_shards[hash<string>()(base) % SHARDS];
+}
+
+string response_cache::variant_key(const string &base, const string &vary, const string &request) {
+    string key = base;
+    size_t pos = 0;
+    while (pos < vary.size()) {
+        size_t end = vary.find(',', pos);
+        if (end == string::npos)
+            end = vary.size();
+        size_t b = vary.find_first_not_of(" \t", pos);
+        size_t e = vary.find_last_not_of(" \t", end - 1);
+        if (b != string::npos && b < end && e >= b) {
+            string name = vary.substr(b, e - b + 1);
+            key.append("\n").append(name).append(":").append(header_value(request, name.c_str()));
+        }
+        pos = end + 1;
+    }
+    return key;
+}
+
+string response_cache::header_value(const string &request, const char *name) {
+    size_t len = strlen(name);
+    size_t pos = request.find("\r\n");
+    while (pos != string::npos && pos + 2 < request.size()) {
+        const char *line = request.data() + pos + 2;
+        size_t end = request.find("\r\n", pos + 2);
+        if (end == string::npos || end == pos + 2)
+            break;
+        if (strncasecmp(line, name, len) == 0 && line[len] == ':') {
+            size_t b = request.find_first_not_of(" \t", pos + 2 + len + 1);
+            return b < end ? request.substr(b, end - b) : string();
+        }
+        pos = end;
+    }
+    return string();
+}
+
+cached_response *response_cache::acquire(const string &base, const string &request, FRESHNESS &state) {
+    state = MISS;
+    shard &s = shard_of(base);
+    s.lock.lock();
+    auto vary = s.vary.find(base);
+    if (vary == s.vary.end()) {
+        s.lock.unlock();
+        return NULL;
+    }
+    auto it = s.index.find(variant_key(base, vary->second, request));
+    if (it == s.index.end()) {
+        s.lock.unlock();
+        return NULL;
+    }
+
+    cached_response *entry = *it->second;
+    time_t now = time(NULL);
+    if (now < entry->fresh_until)
+        state = FRESH;
+    else if (now < entry->swr_until)
+        state = STALE_REVALIDATE;
+    else if (now < entry->sie_until)
+        state = STALE;
+    else {
+        erase(s, entry);
+        s.lock.unlock();
+        return NULL;
+    }
+    entry->refs++;
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    s.lock.unlock();
+    return entry;
+}
+
+void response_cache::release(cached_response *entry) {
+    if (--entry->refs == 0)
+        delete entry;
+}
+
+void response_cache::store(const string &base, const string &request, const cache_policy &policy, string &head,
+                           string &body) {
+    time_t now = time(NULL);
+    if (head.size() > MAX_HEAD)
+        return;
+    cached_response *entry = new cached_response;
+    entry->key = variant_key(base, policy.vary, request);
+    size_t size = entry->key.size() + head.size() + body.size();
+    if (size > m_max_object || size > m_shard_bytes) {
+        delete entry;
+        return;
+    }
+    long lifetime = policy.max_age >= 0 ? policy.max_age : policy.expires - (policy.date > 0 ? policy.date : now);
+    entry->head.swap(head);
+    entry->body.swap(body);
+    entry->stored = now;
+    entry->age = policy.age;
+    entry->fresh_until = now + lifetime - policy.age;
+    entry->swr_until = entry->fresh_until + policy.swr;
+    entry->sie_until = entry->fresh_until + policy.sie;
+    entry->refs = 1;
+    entry->refreshing = false;
+
+    shard &s = shard_of(base);
+    s.lock.lock();
+    s.vary[base] = policy.vary;
+    auto it = s.index.find(entry->key);
+    if (it != s.index.end())
+        erase(s, *it->second);
+    while (s.bytes + size > m_shard_bytes && !s.lru.empty())
+        erase(s, s.lru.back());
+    s.lru.push_front(entry);
+    s.index[entry->key] = s.lru.begin();
+    s.bytes += size;
+    s.lock.unlock();
+}
+
+void response_cache::erase(shard &s, cached_response *entry) {
+    auto it = s.index.find(entry->key);
+    s.lru.erase(it->second);
+    s.index.erase(it);
+    s.bytes -= entry->key.size() + entry->head.size() + entry->body.size();
+    release(entry);
+}
+
+//解析HTTP日期，格式不对时视为已经过期
+static time_t parse_http_date(const char *value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+        return 0;
+    return timegm(&tm);
+}
+
+void response_cache::parse_header(cache_policy &policy, const char *line) {
+    const char *colon = strchr(line, ':');
+    if (!colon)
+        return;
+    size_t len = colon - line;
+    const char *value = colon + 1;
+    while (*value == ' ' || *value == '\t')
+        ++value;
+
+    if (len == 13 && strncasecmp(line, "Cache-Control", len) == 0) {
+        bool shared_age = false;
+        for (const char *p = value; *p;) {
+            while (*p == ' ' || *p == ',')
+                ++p;
+            if (strncasecmp(p, "no-store", 8) == 0 || strncasecmp(p, "private", 7) == 0 ||
+                strncasecmp(p, "no-cache", 8) == 0)
+                policy.no_store = true;
+            else if (strncasecmp(p, "s-maxage=", 9) == 0) {
+                policy.max_age = atol(p + 9);
+                shared_age = true;
+            } else if (strncasecmp(p, "max-age=", 8) == 0 && !shared_age)
+                policy.max_age = atol(p + 8);
+            else if (strncasecmp(p, "stale-while-revalidate=", 23) == 0)
+                policy.swr = atol(p + 23);
+            else if (strncasecmp(p, "stale-if-error=", 15) == 0)
+                policy.sie = atol(p + 15);
+            p += strcspn(p, ",");
+        }
+    } else if (len == 7 && strncasecmp(line, "Expires", len) == 0) {
+        policy.expires = parse_http_date(value);
+    } else if (len == 4 && strncasecmp(line, "Date", len) == 0) {
+        policy.date = parse_http_date(value);
+    } else if (len == 3 && strncasecmp(line, "Age", len) == 0) {
+        policy.age = atol(value);
+    } else if (len == 4 && strncasecmp(line, "Vary", len) == 0) {
+        policy.vary = policy.vary.empty() ? value : policy.vary + "," + value;
+    } else if (len == 10 && strncasecmp(line, "Set-Cookie", len) == 0) {
+        policy.no_store = true;
+    }
+}
+
+bool response_cache::cacheable(int status, const cache_policy &policy, time_t now) {
+    if (status != 200 && status != 203 && status != 300 && status != 301 && status != 404 && status != 410)
+        return false;
+    if (policy.no_store || policy.vary.find('*') != string::npos)
+        return false;
+    //只缓存明确给出有效期的响应，不做启发式推算
+    if (policy.max_age < 0 && policy.expires < 0)
+        return false;
+    long lifetime = policy.max_age >= 0 ? policy.max_age : policy.expires - (policy.date > 0 ? policy.date : now);
+    long usable = lifetime - policy.age + (policy.swr > policy.sie ? policy.swr : policy.sie);
+    return usable > 0;
+}
+
+bool response_cache::bypass(const string &request) {
+    if (!header_value(request, "Authorization").empty())
+        return true;
+    string cc = header_value(request, "Cache-Control");
+    return strcasestr(cc.c_str(), "no-cache") != NULL || strcasestr(cc.c_str(), "no-store") != NULL ||
+           strcasestr(header_value(request, "Pragma").c_str(), "no-cache") != NULL;
+}
+
+void response_cache::refresh(upstream_group *group, const string &hash_key, const string &base,
+                             const string &request, cached_response *entry) {
+    //同一条目同时只有一个后台更新
+    bool expected = false;
+    if (!entry->refreshing.compare_exchange_strong(expected, true))
+        return;
+    entry->refs++;
+    refresh_job job;
+    job.group = group;
+    job.hash_key = hash_key;
+    job.base = base;
+    job.request = request;
+    job.entry = entry;
+    if (!m_jobs.push(job)) {
+        entry->refreshing = false;
+        release(entry);
+    }
+}
+
+void response_cache::handle(refresh_job &job) {
+    if (!m_stop)
+        run_refresh(job);
+    job.entry->refreshing = false;
+    release(job.entry);
+}
+
+void response_cache::run_refresh(refresh_job &job) {
+    upstream *up = job.group->select(job.hash_key, NULL);
+    if (!up)
+        return;
+    int fd = up->connect_blocking(2);
+    if (fd < 0) {
+        up->report(false);
+        return;
+    }
+
+    //后台请求不复用连接，读到上游关闭为止
+    string request = job.request;
+    size_t conn = request.rfind("Connection: keep-alive\r\n");
+    if (conn != string::npos)
+        request.replace(conn, 24, "Connection: close\r\n");
+    string response;
+    bool ok = send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t) request.size();
+    char buf[16384];
+    ssize_t n;
+    while (ok && (n = recv(fd, buf, sizeof(buf), 0)) > 0 && response.size() <= m_max_object + MAX_HEAD * 4)
+        response.append(buf, n);
+    close(fd);
+
+    size_t head_end = response.find("\r\n\r\n");
+    if (!ok || head_end == string::npos || response.compare(0, 7, "HTTP/1.") != 0 || response.size() < 12) {
+        up->report(false);
+        return;
+    }
+    int status = atoi(response.c_str() + 9);
+    up->report(status < 502 || status > 504);
+
+    cache_policy policy;
+    string head;
+    bool chunked = false;
+    long long length = -1;
+    size_t pos = 0;
+    while (pos < head_end) {
+        size_t end = response.find("\r\n", pos);
+        string line = response.substr(pos, end - pos);
+        pos = end + 2;
+        if (head.empty()) {
+            head = line + "\r\n";
+            continue;
+        }
+        const char *p = line.c_str();
+        parse_header(policy, p);
+        if (strncasecmp(p, "Connection:", 11) == 0 || strncasecmp(p, "Keep-Alive:", 11) == 0 ||
+            strncasecmp(p, "Age:", 4) == 0)
+            continue;
+        if (strncasecmp(p, "Content-Length:", 15) == 0)
+            length = atoll(p + 15);
+        else if (strncasecmp(p, "Transfer-Encoding:", 18) == 0)
+            chunked = strcasestr(p, "chunked") != NULL;
+        head.append(line).append("\r\n");
+    }
+    if (!cacheable(status, policy, time(NULL)))
+        return;
+
+    string body = response.substr(head_end + 4);
+    if (chunked) {
+        chunk_parser parser;
+        size_t used = parser.feed(body.data(), body.size());
+        if (!parser.done())
+            return;
+        body.resize(used);
+    } else if (length >= 0 && (long long) body.size() >= length) {
+        body.resize(length);
+    } else {
+        return;
+    }
+    store(job.base, job.request, policy, head, body);
+}
@@ -0,0 +1,137 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <list>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <unordered_map>
+#include <ctime>
+#include "../lock/locker.h"
+#include "../threadpool/job_queue.h"
+
+using namespace std;
+
+class upstream_group;
+
+//一个缓存的上游响应，缓存本身和每个正在发送它的连接各持有一个引用，内容写入后只读
+struct cached_response {
+    string key;               //基础key加上Vary请求头的取值
+    string head;              //状态行和端到端头部，不含Connection、Age和结尾空行
+    string body;              //原样保存的响应体，chunked响应保留分块格式
+    time_t stored;
+    long age;                 //入缓存时上游给出的Age
+    time_t fresh_until;
+    time_t swr_until;         //stale-while-revalidate截止时间
+    time_t sie_until;         //stale-if-error截止时间
+    atomic<int> refs;
+    atomic<bool> refreshing;  //已有后台请求在更新这个条目
+};
+
+//从上游响应头中收集的缓存策略
+struct cache_policy {
+    bool no_store;            //no-store、private、no-cache或带Set-Cookie
+    long max_age;             //s-maxage优先，-1表示未给出
+    long swr;
+    long sie;
+    time_t expires;           //-1表示未给出或无法解析
+    time_t date;
+    long age;
+    string vary;
+
+    cache_policy() : no_store(false), max_age(-1), swr(0), sie(0), expires(-1), date(-1), age(0) {}
+};
+
+class response_cache {
+public:
+    enum FRESHNESS {
+        MISS = 0,
+        FRESH,
+        STALE_REVALIDATE,   //已过期但在stale-while-revalidate窗口内，可以直接返回并在后台更新
+        STALE               //只能在上游出错时返回
+    };
+
+    static const int SHARDS = 16;
+    static const size_t MAX_HEAD = 896;   //头部要拷进http_conn的写缓冲，留出Age和Connection的位置
+    static const int REFRESH_THREADS = 4;    //后台更新线程数，一个慢的上游不会拖住其他站点的更新
+    static const size_t MAX_REFRESH = 256;   //排队的后台更新上限，满时放弃，下次命中再提交
+
+    /*max_bytes为所有分片缓存的响应体和头部总字节数上限，单个响应超过max_object不缓存*/
+    response_cache(size_t max_bytes, size_t max_object = 1024 * 1024);
+
+    ~response_cache();
+
+    /*request为转发给上游的完整请求头，用于匹配Vary；命中时返回增加了引用的条目，
+     *彻底过期的条目被删除并返回NULL*/
+    cached_response *acquire(const string &base, const string &request, FRESHNESS &state);
+
+    void release(cached_response *entry);
+
+    //响应可以缓存时存入，替换同一key下的旧条目
+    void store(const string &base, const string &request, const cache_policy &policy, string &head,
+               string &body);
+
+    //在后台线程中向上游重新请求一次并更新条目，entry的引用由缓存接管；队列满时不更新
+    void refresh(upstream_group *group, const string &hash_key, const string &base, const string &request,
+                 cached_response *entry);
+
+    size_t max_object() const {
+        return m_max_object;
+    }
+
+    //计算返回给客户端的Age
+    static long age(const cached_response *entry, time_t now) {
+        return entry->age + (now - entry->stored);
+    }
+
+    //解析一行响应头并更新缓存策略，line以'\0'结尾，不含CRLF
+    static void parse_header(cache_policy &policy, const char *line);
+
+    //根据状态码和策略判断能否缓存
+    static bool cacheable(int status, const cache_policy &policy, time_t now);
+
+    //请求本身不允许使用缓存，例如带Authorization或no-cache
+    static bool bypass(const string &request);
+
+    //在"Name: value\r\n"格式的请求头中查找name，没有时返回空串
+    static string header_value(const string &request, const char *name);
+
+private:
+    struct shard {
+        locker lock;
+        list<cached_response *> lru;                                   //表头为最近使用
+        unordered_map<string, list<cached_response *>::iterator> index;
+        unordered_map<string, string> vary;                            //基础key对应的Vary头部
+        size_t bytes;
+
+        shard() : bytes(0) {}
+    };
+
+    struct refresh_job {
+        upstream_group *group;
+        string hash_key;
+        string base;
+        string request;
+        cached_response *entry;
+    };
+
+    shard &shard_of(const string &base);
+
+    static string variant_key(const string &base, const string &vary, const string &request);
+
+    //从索引中摘除entry并释放缓存持有的引用，调用者需持有分片的锁
+    void erase(shard &s, cached_response *entry);
+
+    void handle(refresh_job &job);
+
+    void run_refresh(refresh_job &job);
+
+private:
+    size_t m_shard_bytes;
+    size_t m_max_object;
+    shard m_shards[SHARDS];
+    atomic<bool> m_stop;      //析构时不再访问上游，排队的更新直接放弃
+    job_queue<response_cache, refresh_job> m_jobs;
+};
+
+#endif
@@ -0,0 +1,336 @@
+#include "upstream_pool.h"
+#include "../vhost/vhost.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+upstream::upstream(const string &name, const sockaddr_in &addr, int max_idle) : m_name(name),
+                                                                                m_addr(addr),
+                                                                                m_max_idle(max_idle),
+                                                                                m_outstanding(0), m_fails(0),
+                                                                                m_down_until(0), m_healthy(true),
+                                                                                m_check_count(0) {
+}
+
+upstream::~upstream() {
+    for (int fd : m_idle)
+        close(fd);
+}
+
+int upstream::acquire(bool &reused, bool fresh) {
+    while (!fresh) {
+        m_lock.lock();
+        if (m_idle.empty()) {
+            m_lock.unlock();
+            break;
+        }
+        int fd = m_idle.front();
+        m_idle.pop_front();
+        m_lock.unlock();
+
+        //空闲期间对端可能已关闭连接，可读(EOF或多余数据)的连接都不能再用
+        char c;
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            reused = true;
+            return fd;
+        }
+        close(fd);
+    }
+
+    reused = false;
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (connect(fd, (struct sockaddr *) &m_addr, sizeof(m_addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void upstream::release(int fd) {
+    m_lock.lock();
+    if ((int) m_idle.size() < m_max_idle) {
+        m_idle.push_front(fd);
+        m_lock.unlock();
+        return;
+    }
+    m_lock.unlock();
+    close(fd);
+}
+
+void upstream::report(bool ok) {
+    if (ok) {
+        m_fails = 0;
+        return;
+    }
+    if (++m_fails >= MAX_FAILS) {
+        m_fails = 0;
+        m_down_until = time(NULL) + FAIL_TIMEOUT;
+    }
+}
+
+int upstream::connect_blocking(int timeout) {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    struct timeval tv = {timeout, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *) &m_addr, sizeof(m_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void upstream::probe(const string &path, int timeout) {
+    bool ok = false;
+    int fd = connect_blocking(timeout);
+    if (fd >= 0) {
+        string request = "GET " + path + " HTTP/1.0\r\nHost: " + m_name + "\r\nConnection: close\r\n\r\n";
+        char status[13];
+        size_t got = 0;
+        if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t) request.size()) {
+            ssize_t n;
+            while (got < 12 && (n = recv(fd, status + got, 12 - got, 0)) > 0)
+                got += n;
+        }
+        status[got] = '\0';
+        //2xx和3xx视为健康
+        ok = got == 12 && strncmp(status, "HTTP/1.", 7) == 0 && (status[9] == '2' || status[9] == '3');
+        close(fd);
+    }
+
+    //连续多次结果一致才切换状态，避免抖动
+    if (ok == m_healthy) {
+        m_check_count = 0;
+        return;
+    }
+    if (++m_check_count >= (ok ? CHECK_RISE : CHECK_FALL)) {
+        m_check_count = 0;
+        m_healthy = ok;
+        if (ok)
+            m_fails = 0;
+    }
+}
+
+//FNV-1a，保证同一个key在重启前后落到同一个后端
+static uint32_t hash_key(const char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) p[i];
+        h *= 16777619u;
+    }
+    //末尾再混合一次，使相邻key的哈希值在环上分散
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+upstream_group::upstream_group(const string &name, POLICY policy, const string &check_path) : m_name(name),
+                                                                                             m_policy(policy),
+                                                                                             m_check_path(check_path),
+                                                                                             m_next(0),
+                                                                                             m_budget(BUDGET_MAX) {
+}
+
+void upstream_group::add(upstream *up) {
+    m_members.push_back(up);
+    for (int i = 0; i < VIRTUAL_NODES; ++i) {
+        string node = up->name() + "#" + to_string(i);
+        m_ring.push_back(make_pair(hash_key(node.data(), node.size()), up));
+    }
+    sort(m_ring.begin(), m_ring.end());
+}
+
+upstream *upstream_group::select(const string &key, const upstream *exclude) {
+    upstream *up = NULL;
+    if (m_policy != LEAST_CONN)
+        up = consistent_hash(key, exclude);
+    if (!up)
+        up = least_conn(exclude, true);
+    //所有后端都被摘除时仍然尝试，总比直接返回502好
+    if (!up)
+        up = least_conn(exclude, false);
+    return up;
+}
+
+upstream *upstream_group::least_conn(const upstream *exclude, bool check) {
+    time_t now = time(NULL);
+    size_t n = m_members.size();
+    //从轮转的位置开始扫描，请求数相同时依次分给不同后端
+    size_t start = m_next++ % n;
+    upstream *best = NULL;
+    for (size_t i = 0; i < n; ++i) {
+        upstream *up = m_members[(start + i) % n];
+        if (up == exclude || (check && !up->available(now)))
+            continue;
+        if (!best || up->outstanding() < best->outstanding())
+            best = up;
+    }
+    return best;
+}
+
+upstream *upstream_group::consistent_hash(const string &key, const upstream *exclude) {
+    time_t now = time(NULL);
+    uint32_t h = hash_key(key.data(), key.size());
+    size_t pos = lower_bound(m_ring.begin(), m_ring.end(), make_pair(h, (upstream *) NULL)) - m_ring.begin();
+    //顺时针找第一个可用的节点，不可用的后端只影响落在它上面的key
+    for (size_t i = 0; i < m_ring.size(); ++i) {
+        upstream *up = m_ring[(pos + i) % m_ring.size()].second;
+        if (up != exclude && up->available(now))
+            return up;
+    }
+    return NULL;
+}
+
+void upstream_group::deposit() {
+    long budget = m_budget;
+    while (budget < BUDGET_MAX && !m_budget.compare_exchange_weak(budget, budget + BUDGET_DEPOSIT))
+        ;
+}
+
+bool upstream_group::withdraw() {
+    long budget = m_budget;
+    while (budget >= BUDGET_UNIT) {
+        if (m_budget.compare_exchange_weak(budget, budget - BUDGET_UNIT))
+            return true;
+    }
+    return false;
+}
+
+upstream_pool::~upstream_pool() {
+    if (m_checking) {
+        m_check_lock.lock();
+        m_stop = true;
+        m_check_cond.signal();
+        m_check_lock.unlock();
+        pthread_join(m_thread, NULL);
+    }
+    for (auto &it : m_groups)
+        delete it.second;
+    for (auto &it : m_upstreams)
+        delete it.second;
+}
+
+upstream *upstream_pool::get_upstream(const string &target) {
+    auto it = m_upstreams.find(target);
+    if (it != m_upstreams.end())
+        return it->second;
+
+    size_t colon = target.rfind(':');
+    string name = target.substr(0, colon);
+    string port = colon == string::npos ? "80" : target.substr(colon + 1);
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name.c_str(), port.c_str(), &hints, &result) != 0)
+        return NULL;
+    sockaddr_in addr = *(sockaddr_in *) result->ai_addr;
+    freeaddrinfo(result);
+
+    upstream *up = new upstream(target, addr);
+    m_upstreams[target] = up;
+    return up;
+}
+
+bool upstream_pool::add(const string &host, const string &spec) {
+    auto it = m_groups.find(spec);
+    if (it != m_groups.end()) {
+        m_hosts[normalize_host(host.c_str())] = it->second;
+        return true;
+    }
+
+    istringstream fields(spec);
+    string targets, word, check_path;
+    upstream_group::POLICY policy = upstream_group::LEAST_CONN;
+    fields >> targets;
+    while (fields >> word) {
+        if (word == "hash_ip")
+            policy = upstream_group::HASH_IP;
+        else if (word == "hash_uri")
+            policy = upstream_group::HASH_URI;
+        else if (word[0] == '/')
+            check_path = word;
+    }
+
+    vector<upstream *> members;
+    istringstream list(targets);
+    while (getline(list, word, ',')) {
+        if (word.empty())
+            continue;
+        upstream *up = get_upstream(word);
+        if (!up)
+            return false;
+        members.push_back(up);
+    }
+    if (members.empty())
+        return false;
+
+    //单个后端时Host改写为后端地址，多个后端时保留客户端请求的Host
+    upstream_group *group = new upstream_group(members.size() == 1 ? members[0]->name() : string(), policy,
+                                               check_path);
+    for (upstream *up : members)
+        group->add(up);
+    m_groups[spec] = group;
+    m_hosts[normalize_host(host.c_str())] = group;
+    return true;
+}
+
+upstream_group *upstream_pool::lookup(const char *host) const {
+    if (!host || m_hosts.empty())
+        return NULL;
+    auto it = m_hosts.find(normalize_host(host));
+    return it == m_hosts.end() ? NULL : it->second;
+}
+
+void upstream_pool::start_health_check(int interval) {
+    bool need = false;
+    for (auto &it : m_groups)
+        need = need || !it.second->check_path().empty();
+    if (!need || m_checking)
+        return;
+    m_check_interval = interval;
+    if (pthread_create(&m_thread, NULL, checker, this) == 0)
+        m_checking = true;
+}
+
+void *upstream_pool::checker(void *arg) {
+    upstream_pool *pool = (upstream_pool *) arg;
+    while (true) {
+        for (auto &it : pool->m_groups) {
+            upstream_group *group = it.second;
+            if (group->check_path().empty())
+                continue;
+            for (upstream *up : group->members())
+                up->probe(group->check_path(), 2);
+        }
+
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += pool->m_check_interval;
+        pool->m_check_lock.lock();
+        if (!pool->m_stop)
+            pool->m_check_cond.timewait(pool->m_check_lock.get(), t);
+        bool stop = pool->m_stop;
+        pool->m_check_lock.unlock();
+        if (stop)
+            break;
+    }
+    return NULL;
+}
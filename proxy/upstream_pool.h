@@ -0,0 +1,183 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <list>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "../lock/locker.h"
+
+using namespace std;
+
+//一个上游服务器及其空闲长连接
+class upstream {
+public:
+    static const int MAX_FAILS = 3;       //连续失败多少次后摘除
+    static const int FAIL_TIMEOUT = 10;   //被动摘除的秒数
+    static const int CHECK_RISE = 2;      //主动探测连续成功多少次后恢复
+    static const int CHECK_FALL = 3;      //主动探测连续失败多少次后摘除
+
+    /*name为"host:port"，max_idle为最多保留的空闲连接数*/
+    upstream(const string &name, const sockaddr_in &addr, int max_idle = 32);
+
+    ~upstream();
+
+    //取出一个可用的非阻塞连接，没有空闲连接时发起新的非阻塞connect，reused表示是否为复用的连接
+    int acquire(bool &reused, bool fresh = false);
+
+    //响应完整结束后归还连接
+    void release(int fd);
+
+    const string &name() const {
+        return m_name;
+    }
+
+    //未被被动摘除且主动探测正常
+    bool available(time_t now) const {
+        return m_healthy && m_down_until <= now;
+    }
+
+    //正在进行的请求数，最少连接调度依据
+    int outstanding() const {
+        return m_outstanding;
+    }
+
+    void begin_request() {
+        ++m_outstanding;
+    }
+
+    void end_request() {
+        --m_outstanding;
+    }
+
+    //被动健康检查，请求成功时清零失败计数，连续失败MAX_FAILS次后摘除FAIL_TIMEOUT秒
+    void report(bool ok);
+
+    //建立一个带收发超时的阻塞连接，供后台线程使用，失败返回-1
+    int connect_blocking(int timeout);
+
+    //阻塞地发一次HTTP探测请求，只在健康检查线程中调用
+    void probe(const string &path, int timeout);
+
+private:
+    string m_name;
+    sockaddr_in m_addr;
+    int m_max_idle;
+    list<int> m_idle;
+    locker m_lock;
+
+    atomic<int> m_outstanding;
+    atomic<int> m_fails;
+    atomic<time_t> m_down_until;
+    atomic<bool> m_healthy;
+    int m_check_count;     //主动探测连续与当前状态相反的次数
+};
+
+//一个Host对应的一组上游，负责选择后端和控制重试
+class upstream_group {
+public:
+    enum POLICY {
+        LEAST_CONN = 0,   //最少未完成请求
+        HASH_IP,          //按客户端地址一致性哈希
+        HASH_URI          //按请求路径一致性哈希
+    };
+
+    static const int VIRTUAL_NODES = 160;
+    static const int MAX_TRIES = 3;
+
+    upstream_group(const string &name, POLICY policy, const string &check_path);
+
+    void add(upstream *up);
+
+    //选择一个可用的后端，exclude为刚失败的后端，全部不可用时仍返回最空闲的一个
+    upstream *select(const string &key, const upstream *exclude);
+
+    //每个请求向重试预算存入一部分，重试时取出一个完整份额，预算不足时不再重试
+    void deposit();
+
+    bool withdraw();
+
+    //单个请求最多尝试的后端数
+    int max_tries() const {
+        int n = (int) m_members.size();
+        return n < MAX_TRIES ? n : MAX_TRIES;
+    }
+
+    //转发时使用的Host，为空时沿用客户端请求的Host
+    const string &name() const {
+        return m_name;
+    }
+
+    POLICY policy() const {
+        return m_policy;
+    }
+
+    const string &check_path() const {
+        return m_check_path;
+    }
+
+    const vector<upstream *> &members() const {
+        return m_members;
+    }
+
+private:
+    upstream *least_conn(const upstream *exclude, bool check);
+
+    upstream *consistent_hash(const string &key, const upstream *exclude);
+
+private:
+    static const long BUDGET_UNIT = 1000;       //一次重试消耗的份额
+    static const long BUDGET_DEPOSIT = 200;     //每个请求存入的份额，即重试不超过请求数的20%
+    static const long BUDGET_MAX = 10 * BUDGET_UNIT;
+
+    string m_name;
+    POLICY m_policy;
+    string m_check_path;
+    vector<upstream *> m_members;
+    vector<pair<uint32_t, upstream *> > m_ring;   //按哈希值排序的虚拟节点
+    atomic<unsigned> m_next;
+    atomic<long> m_budget;
+};
+
+class upstream_pool {
+public:
+    upstream_pool() : m_check_interval(5), m_checking(false), m_stop(false) {}
+
+    ~upstream_pool();
+
+    /*spec为"host:port[,host:port...] [least|hash_ip|hash_uri] [/check_path]"，
+     *启动时解析，任一后端解析失败返回false*/
+    bool add(const string &host, const string &spec);
+
+    //按Host请求头查找上游组，未配置时返回NULL
+    upstream_group *lookup(const char *host) const;
+
+    bool empty() const {
+        return m_hosts.empty();
+    }
+
+    //配置了探测路径的组由后台线程每interval秒主动探测一次
+    void start_health_check(int interval = 5);
+
+private:
+    upstream *get_upstream(const string &target);
+
+    static void *checker(void *arg);
+
+private:
+    unordered_map<string, upstream_group *> m_hosts;
+    unordered_map<string, upstream_group *> m_groups;   //同一组配置被多个Host共用
+    unordered_map<string, upstream *> m_upstreams;      //同一后端被多个组共用
+    int m_check_interval;
+    bool m_checking;
+    bool m_stop;
+    locker m_check_lock;
+    cond m_check_cond;     //析构时唤醒健康检查线程退出
+    pthread_t m_thread;
+};
+
+#endif
@@ -0,0 +1,198 @@
+#include "router.h"
+
+#include <cstring>
+#include <strings.h>
+
+static const char *method_names[router::METHODS] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS",
+                                                    "CONNECT", "PATCH"};
+
+const char *request_view::header(const char *name) const {
+    size_t len = strlen(name);
+    for (const char *line = headers; *line; line += strlen(line) + 2) {
+        if (strncasecmp(line, name, len) == 0 && line[len] == ':')
+            return line + len + 1 + strspn(line + len + 1, " \t");
+    }
+    return NULL;
+}
+
+const char *request_view::param(const char *name) const {
+    for (auto &it : params) {
+        if (it.first == name)
+            return it.second.c_str();
+    }
+    return NULL;
+}
+
+void response_writer::header(const char *name, const string &value) {
+    if (strcasecmp(name, "Content-Type") == 0)
+        m_has_type = true;
+    m_headers.append(name).append(": ").append(value).append("\r\n");
+}
+
+void response_writer::finish(string &out, bool keep_alive) {
+    out.reserve(out.size() + m_headers.size() + m_body.size() + 128);
+    out.append("HTTP/1.1 ").append(to_string(m_status)).append(" ").append(m_reason).append("\r\n");
+    out.append(m_headers);
+    if (!m_has_type)
+        out.append("Content-Type: text/plain\r\n");
+    out.append("Content-Length: ").append(to_string(m_body.size())).append("\r\n");
+    out.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    out.append(m_body);
+}
+
+router::~router() {
+    destroy(m_root);
+}
+
+void router::destroy(node *n) {
+    if (!n)
+        return;
+    for (node *child : n->children)
+        destroy(child);
+    destroy(n->param);
+    destroy(n->wildcard);
+    for (int i = 0; i < METHODS; ++i)
+        delete n->handlers[i];
+    delete n;
+}
+
+const char *router::method_name(int method) {
+    return method >= 0 && method < METHODS ? method_names[method] : "";
+}
+
+bool router::add(const char *method, const string &pattern, const route_handler &handler) {
+    int m = 0;
+    while (m < METHODS && strcasecmp(method, method_names[m]) != 0)
+        ++m;
+    if (m == METHODS || pattern.empty() || pattern[0] != '/')
+        return false;
+    node *n = insert(m_root, pattern, 0);
+    if (!n || n->handlers[m])
+        return false;
+    n->handlers[m] = new route_handler(handler);
+    m_size++;
+    return true;
+}
+
+router::node *router::insert(node *n, const string &pattern, size_t pos) {
+    if (pos == pattern.size())
+        return n;
+
+    if (pattern[pos] == ':') {
+        size_t end = pattern.find('/', pos);
+        if (end == string::npos)
+            end = pattern.size();
+        string name = pattern.substr(pos + 1, end - pos - 1);
+        if (name.empty())
+            return NULL;
+        //同一位置的参数只能有一个名字
+        if (!n->param) {
+            n->param = new node;
+            n->param_name = name;
+        } else if (n->param_name != name) {
+            return NULL;
+        }
+        return insert(n->param, pattern, end);
+    }
+
+    if (pattern[pos] == '*') {
+        string name = pattern.substr(pos + 1);
+        if (name.empty() || name.find('/') != string::npos)
+            return NULL;
+        if (!n->wildcard) {
+            n->wildcard = new node;
+            n->wildcard_name = name;
+        } else if (n->wildcard_name != name) {
+            return NULL;
+        }
+        return n->wildcard;
+    }
+
+    //静态片段到下一个参数或通配为止
+    size_t end = pattern.find_first_of(":*", pos);
+    if (end == string::npos)
+        end = pattern.size();
+    for (size_t i = 0; i < n->children.size(); ++i) {
+        node *child = n->children[i];
+        if (child->prefix[0] != pattern[pos])
+            continue;
+        size_t common = 0;
+        while (common < child->prefix.size() && pos + common < end &&
+               child->prefix[common] == pattern[pos + common])
+            ++common;
+        //只有部分前缀相同，把子节点拆成公共部分和剩余部分
+        if (common < child->prefix.size()) {
+            node *mid = new node;
+            mid->prefix = child->prefix.substr(0, common);
+            child->prefix.erase(0, common);
+            mid->children.push_back(child);
+            n->children[i] = mid;
+            child = mid;
+        }
+        return insert(child, pattern, pos + common);
+    }
+    node *child = new node;
+    child->prefix = pattern.substr(pos, end - pos);
+    n->children.push_back(child);
+    return insert(child, pattern, end);
+}
+
+const route_handler *router::match(int method, const char *path, size_t len, vector<pair<string, string>> &params,
+                                   int &allowed) const {
+    const route_handler *found = NULL;
+    allowed = 0;
+    if (method < 0 || method >= METHODS)
+        return NULL;
+    match(m_root, method, path, len, 0, params, found, allowed);
+    return found;
+}
+
+bool router::match(const node *n, int method, const char *path, size_t len, size_t pos,
+                   vector<pair<string, string>> &params, const route_handler *&found, int &allowed) const {
+    if (pos == len) {
+        for (int i = 0; i < METHODS; ++i) {
+            if (n->handlers[i])
+                allowed |= 1 << i;
+        }
+        if (n->handlers[method]) {
+            found = n->handlers[method];
+            return true;
+        }
+    }
+
+    //静态子节点首字符互不相同，最多只有一个可能匹配
+    if (pos < len) {
+        for (const node *child : n->children) {
+            if (child->prefix[0] != path[pos])
+                continue;
+            if (len - pos >= child->prefix.size() &&
+                memcmp(path + pos, child->prefix.data(), child->prefix.size()) == 0 &&
+                match(child, method, path, len, pos + child->prefix.size(), params, found, allowed))
+                return true;
+            break;
+        }
+    }
+
+    if (n->param && pos < len && path[pos] != '/') {
+        const char *slash = (const char *) memchr(path + pos, '/', len - pos);
+        size_t end = slash ? slash - path : len;
+        params.push_back(make_pair(n->param_name, string(path + pos, end - pos)));
+        if (match(n->param, method, path, len, end, params, found, allowed))
+            return true;
+        params.pop_back();
+    }
+
+    if (n->wildcard) {
+        const node *w = n->wildcard;
+        for (int i = 0; i < METHODS; ++i) {
+            if (w->handlers[i])
+                allowed |= 1 << i;
+        }
+        if (w->handlers[method]) {
+            params.push_back(make_pair(n->wildcard_name, string(path + pos, len - pos)));
+            found = w->handlers[method];
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,118 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <netinet/in.h>
+
+using namespace std;
+
+//处理函数看到的请求，指针都指向连接的读缓冲区，只在处理函数执行期间有效
+struct request_view {
+    int method;                 //http_conn::METHOD
+    const char *method_name;
+    const char *path;           //不含查询串
+    size_t path_len;
+    const char *query;          //'?'之后的部分，没有时为""
+    const char *body;
+    long body_len;
+    const char *headers;        //解析后以\0\0分隔的请求头，空行结束
+    const sockaddr_in *peer;
+    vector<pair<string, string>> params;   //路径中:name和*name匹配到的片段
+
+    //按名称查找请求头，不区分大小写，没有时返回NULL
+    const char *header(const char *name) const;
+
+    //路径参数，没有时返回NULL
+    const char *param(const char *name) const;
+};
+
+//处理函数写出的响应，由http_conn补上Content-Length和Connection后发送
+class response_writer {
+public:
+    response_writer() : m_status(200), m_reason("OK"), m_has_type(false) {}
+
+    void status(int code, const char *reason) {
+        m_status = code;
+        m_reason = reason;
+    }
+
+    void header(const char *name, const string &value);
+
+    void write(const char *data, size_t len) {
+        m_body.append(data, len);
+    }
+
+    void write(const string &data) {
+        m_body.append(data);
+    }
+
+    //组装完整响应报文追加到out
+    void finish(string &out, bool keep_alive);
+
+private:
+    int m_status;
+    string m_reason;
+    string m_headers;
+    bool m_has_type;
+    string m_body;
+};
+
+typedef function<void(const request_view &, response_writer &)> route_handler;
+
+/*方法+路径模式到处理函数的映射，启动时注册，之后只读。
+ *路径按压缩前缀树(radix trie)组织，静态片段优先于:name参数，参数优先于末尾的*name通配*/
+class router {
+public:
+    static const int METHODS = 9;   //与http_conn::METHOD一一对应
+
+    router() : m_root(new node), m_size(0) {}
+
+    ~router();
+
+    //pattern如/api/users/:id或/files/*path，与已注册的模式冲突或格式错误时返回false
+    bool add(const char *method, const string &pattern, const route_handler &handler);
+
+    /*匹配成功时返回处理函数并把路径参数追加到params；路径存在但方法未注册时返回NULL，
+     *allowed为该路径上已注册方法的位掩码，路径不存在时为0*/
+    const route_handler *match(int method, const char *path, size_t len, vector<pair<string, string>> &params,
+                               int &allowed) const;
+
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    //方法编号对应的名称
+    static const char *method_name(int method);
+
+private:
+    struct node {
+        string prefix;                  //静态片段
+        vector<node *> children;        //静态子节点，首字符互不相同
+        node *param;                    //:name子节点，匹配到下一个'/'为止
+        string param_name;
+        node *wildcard;                 //*name子节点，匹配剩余全部路径
+        string wildcard_name;
+        route_handler *handlers[METHODS];
+
+        node() : param(NULL), wildcard(NULL) {
+            for (int i = 0; i < METHODS; ++i)
+                handlers[i] = NULL;
+        }
+    };
+
+    node *insert(node *n, const string &pattern, size_t pos);
+
+    bool match(const node *n, int method, const char *path, size_t len, size_t pos,
+               vector<pair<string, string>> &params, const route_handler *&found, int &allowed) const;
+
+    static void destroy(node *n);
+
+private:
+    node *m_root;
+    int m_size;
+};
+
+#endif
@@ -0,0 +1,246 @@
+#include "session_store.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+bool session_id::parse(const char *text, size_t len) {
+    if (len != 32)
+        return false;
+    uint64_t parts[2] = {0, 0};
+    for (size_t i = 0; i < 32; ++i) {
+        char c = text[i];
+        int v;
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else
+            return false;
+        parts[i / 16] = parts[i / 16] << 4 | v;
+    }
+    hi = parts[0];
+    lo = parts[1];
+    return true;
+}
+
+string session_id::str() const {
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long) hi, (unsigned long long) lo);
+    return buf;
+}
+
+session_store::session_store(int ttl, const string &file, int interval) : m_ttl(ttl), m_file(file),
+                                                                           m_interval(interval), m_sweep(0),
+                                                                           m_started(false), m_stop(false) {
+}
+
+session_store::~session_store() {
+    if (m_started) {
+        m_stop_lock.lock();
+        m_stop = true;
+        m_stop_cond.broadcast();
+        m_stop_lock.unlock();
+        pthread_join(m_thread, NULL);
+    }
+    if (!m_file.empty())
+        save();
+}
+
+string session_store::create(const string &user) {
+    session_id id;
+    //ID不可预测才能防止会话被猜中
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+        return string();
+    record r;
+    r.user = user;
+    r.expire = time(NULL) + m_ttl;
+
+    shard &s = shard_of(id);
+    s.lock.lock();
+    s.sessions[id] = r;
+    s.lock.unlock();
+    return id.str();
+}
+
+bool session_store::lookup(const char *text, size_t len, string &user) {
+    session_id id;
+    if (!id.parse(text, len))
+        return false;
+    time_t now = time(NULL);
+    shard &s = shard_of(id);
+    s.lock.lock();
+    auto it = s.sessions.find(id);
+    bool found = it != s.sessions.end();
+    if (found && it->second.expire <= now) {
+        s.sessions.erase(it);
+        found = false;
+    } else if (found) {
+        it->second.expire = now + m_ttl;
+        user = it->second.user;
+    }
+    s.lock.unlock();
+    return found;
+}
+
+void session_store::destroy(const char *text, size_t len) {
+    session_id id;
+    if (!id.parse(text, len))
+        return;
+    shard &s = shard_of(id);
+    s.lock.lock();
+    s.sessions.erase(id);
+    s.lock.unlock();
+}
+
+void session_store::expire(time_t now) {
+    for (int i = 0; i < SWEEP_SHARDS; ++i) {
+        shard &s = m_shards[m_sweep];
+        m_sweep = (m_sweep + 1) % SHARDS;
+        s.lock.lock();
+        for (auto it = s.sessions.begin(); it != s.sessions.end();) {
+            if (it->second.expire <= now)
+                it = s.sessions.erase(it);
+            else
+                ++it;
+        }
+        s.lock.unlock();
+    }
+}
+
+const char *session_store::cookie_value(const char *cookies, const char *name, size_t &len) {
+    size_t name_len = strlen(name);
+    for (const char *p = cookies; p && *p;) {
+        p += strspn(p, " \t");
+        size_t end = strcspn(p, ";");
+        if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            len = end - name_len - 1;
+            return p + name_len + 1;
+        }
+        p = p[end] ? p + end + 1 : NULL;
+    }
+    return NULL;
+}
+
+string session_store::escape(const string &user) {
+    string out;
+    for (size_t i = 0; i < user.size(); ++i) {
+        unsigned char c = user[i];
+        if (c <= ' ' || c >= 0x7f || c == '%') {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02X", c);
+            out += hex;
+        } else {
+            out += (char) c;
+        }
+    }
+    return out;
+}
+
+string session_store::unescape(const char *text, size_t len) {
+    string out;
+    for (size_t i = 0; i < len; ++i) {
+        if (text[i] == '%' && i + 2 < len && isxdigit((unsigned char) text[i + 1]) &&
+            isxdigit((unsigned char) text[i + 2])) {
+            char hex[3] = {text[i + 1], text[i + 2], 0};
+            out += (char) strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            out += text[i];
+        }
+    }
+    return out;
+}
+
+int session_store::load() {
+    FILE *fp = fopen(m_file.c_str(), "r");
+    if (!fp)
+        return 0;
+    int loaded = 0;
+    time_t now = time(NULL);
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    //每行为"会话ID 过期时间 转义后的用户名"
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        char id_text[64];
+        long long expire;
+        int user_start = 0;
+        if (sscanf(line, "%63s %lld %n", id_text, &expire, &user_start) != 2 || user_start == 0)
+            continue;
+        session_id id;
+        if (!id.parse(id_text, strlen(id_text)) || expire <= now)
+            continue;
+        record r;
+        r.user = unescape(line + user_start, len - user_start);
+        r.expire = expire;
+        shard &s = shard_of(id);
+        s.lock.lock();
+        s.sessions[id] = r;
+        s.lock.unlock();
+        ++loaded;
+    }
+    free(line);
+    fclose(fp);
+    return loaded;
+}
+
+bool session_store::save() {
+    //先写临时文件再rename，进程在写入中途退出也不会留下残缺的快照
+    string tmp = m_file + ".tmp";
+    //快照中的会话ID可以直接冒充登录用户，只允许本用户读写
+    int fd = open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+    //上次遗留的临时文件保留着原来的权限
+    fchmod(fd, 0600);
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < SHARDS; ++i) {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        for (auto &it : s.sessions) {
+            if (fprintf(fp, "%s %lld %s\n", it.first.str().c_str(), (long long) it.second.expire,
+                        escape(it.second.user).c_str()) < 0)
+                ok = false;
+        }
+        s.lock.unlock();
+    }
+    ok = fclose(fp) == 0 && ok;
+    return ok && rename(tmp.c_str(), m_file.c_str()) == 0;
+}
+
+void session_store::start() {
+    if (m_file.empty())
+        return;
+    m_started = pthread_create(&m_thread, NULL, saver, this) == 0;
+}
+
+void *session_store::saver(void *arg) {
+    session_store *store = (session_store *) arg;
+    store->m_stop_lock.lock();
+    while (!store->m_stop) {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += store->m_interval;
+        store->m_stop_cond.timewait(store->m_stop_lock.get(), t);
+        if (store->m_stop)
+            break;
+        store->m_stop_lock.unlock();
+        store->save();
+        store->m_stop_lock.lock();
+    }
+    store->m_stop_lock.unlock();
+    return store;
+}
@@ -0,0 +1,110 @@
+#ifndef SESSION_STORE_H
+#define SESSION_STORE_H
+
+#include <string>
+#include <cstdint>
+#include <ctime>
+#include <unordered_map>
+#include <pthread.h>
+#include "../lock/locker.h"
+
+using namespace std;
+
+//会话ID为128位随机数，Cookie中以32位十六进制表示，表中直接以两个整数为key
+struct session_id {
+    uint64_t hi;
+    uint64_t lo;
+
+    bool operator==(const session_id &other) const {
+        return hi == other.hi && lo == other.lo;
+    }
+
+    //解析32位十六进制串，格式不对时返回false
+    bool parse(const char *text, size_t len);
+
+    string str() const;
+};
+
+struct session_id_hash {
+    size_t operator()(const session_id &id) const {
+        //ID本身是随机数，直接取低位即可
+        return id.lo;
+    }
+};
+
+/*服务端会话表，按ID分为多个分片各自加锁，工作线程之间很少争用同一把锁。
+ *访问时顺延有效期，过期的会话在访问时或定时器每次tick扫描一部分分片时删除*/
+class session_store {
+public:
+    static const int SHARDS = 64;
+    static const int SWEEP_SHARDS = 8;      //每次tick扫描的分片数
+
+    /*ttl为会话的空闲有效秒数；file不为空时每interval秒把会话写入快照，启动时从快照恢复*/
+    session_store(int ttl, const string &file, int interval = 60);
+
+    ~session_store();
+
+    //为登录成功的用户新建会话，返回会话ID
+    string create(const string &user);
+
+    //按Cookie中的会话ID查找用户并顺延有效期，没有或已过期时返回false
+    bool lookup(const char *id, size_t len, string &user);
+
+    void destroy(const char *id, size_t len);
+
+    //定时器调用，每次清理SWEEP_SHARDS个分片中过期的会话
+    void expire(time_t now);
+
+    //从快照恢复未过期的会话，返回恢复的数量
+    int load();
+
+    //启动后台线程定期写快照
+    void start();
+
+    //立即写一次快照，退出时也会写一次
+    bool save();
+
+    int ttl() const {
+        return m_ttl;
+    }
+
+    //在Cookie请求头的值中查找name，没有时返回NULL，len为取值长度
+    static const char *cookie_value(const char *cookies, const char *name, size_t &len);
+
+private:
+    struct record {
+        string user;
+        time_t expire;
+    };
+
+    struct shard {
+        locker lock;
+        unordered_map<session_id, record, session_id_hash> sessions;
+    };
+
+    shard &shard_of(const session_id &id) {
+        return m_shards[id.hi % SHARDS];
+    }
+
+    static void *saver(void *arg);
+
+    //快照中的用户名按%XX转义空白、控制字符和'%'，一行一个会话，长度不受限
+    static string escape(const string &user);
+
+    static string unescape(const char *text, size_t len);
+
+private:
+    int m_ttl;
+    string m_file;
+    int m_interval;
+    shard m_shards[SHARDS];
+    int m_sweep;            //下一次tick从哪个分片开始扫描，只在主线程中使用
+
+    bool m_started;
+    bool m_stop;
+    locker m_stop_lock;
+    cond m_stop_cond;
+    pthread_t m_thread;
+};
+
+#endif
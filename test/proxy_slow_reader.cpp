@@ -0,0 +1,201 @@
+/*反向代理splice转发的回归检查：客户端读得很慢时，管道中最后一段响应体不能丢。
+ *启动一个本地上游和被测的server，经代理下载一个大响应，边读边停顿，
+ *检查收到的字节数和内容，再在同一连接上发第二个请求确认长连接仍然可用。
+ *用法: proxy_slow_reader <server可执行文件>*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+static const long BODY_SIZE = 4 * 1024 * 1024;     //远大于splice阈值和管道容量
+static const int READ_CHUNK = 4096;
+static const int READ_PAUSE_US = 200;               //每读一块停顿一下，模拟慢客户端
+
+static char body_byte(long i) {
+    return (char) (i * 31 % 251);
+}
+
+static int listen_any(int &port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 ||
+        getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//上游：每个请求返回带Content-Length的BODY_SIZE字节，连接保持
+static void *upstream(void *arg) {
+    int listenfd = (int) (long) arg;
+    string body(BODY_SIZE, '\0');
+    for (long i = 0; i < BODY_SIZE; ++i)
+        body[i] = body_byte(i);
+    char head[128];
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n", BODY_SIZE);
+    while (true) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        string request;
+        char buf[4096];
+        while (true) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                break;
+            request.append(buf, n);
+            size_t end;
+            while ((end = request.find("\r\n\r\n")) != string::npos) {
+                request.erase(0, end + 4);
+                if (!send_all(fd, head, head_len) || !send_all(fd, body.data(), body.size()))
+                    break;
+            }
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+//读一个响应，返回响应体是否完整且内容正确
+static bool fetch(int fd, const char *host) {
+    char request[256];
+    int len = snprintf(request, sizeof(request),
+                       "GET /big HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", host);
+    if (!send_all(fd, request, len))
+        return false;
+
+    string head;
+    char buf[READ_CHUNK];
+    size_t end;
+    while ((end = head.find("\r\n\r\n")) == string::npos) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            fprintf(stderr, "response header not received\n");
+            return false;
+        }
+        head.append(buf, n);
+    }
+    if (head.compare(0, 12, "HTTP/1.1 200") != 0) {
+        fprintf(stderr, "unexpected status: %.40s\n", head.c_str());
+        return false;
+    }
+
+    long got = 0;
+    bool ok = true;
+    for (size_t i = end + 4; i < head.size(); ++i, ++got)
+        ok = ok && head[i] == body_byte(got);
+    while (got < BODY_SIZE) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        for (ssize_t i = 0; i < n; ++i, ++got)
+            ok = ok && buf[i] == body_byte(got);
+        usleep(READ_PAUSE_US);
+    }
+    if (got != BODY_SIZE) {
+        fprintf(stderr, "truncated body: %ld of %ld bytes\n", got, BODY_SIZE);
+        return false;
+    }
+    if (!ok)
+        fprintf(stderr, "body content mismatch\n");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <server>\n", argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int upstream_port, server_port;
+    int upstream_fd = listen_any(upstream_port);
+    //先占一个空闲端口再放掉，交给server监听
+    int probe = listen_any(server_port);
+    if (upstream_fd < 0 || probe < 0)
+        return 2;
+    close(probe);
+    pthread_t thread;
+    pthread_create(&thread, NULL, upstream, (void *) (long) upstream_fd);
+    pthread_detach(thread);
+
+    char conf[] = "/tmp/proxy_slow_reader_XXXXXX";
+    int conf_fd = mkstemp(conf);
+    if (conf_fd < 0)
+        return 2;
+    dprintf(conf_fd, "slow.test 127.0.0.1:%d\n", upstream_port);
+    close(conf_fd);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        char port[16];
+        snprintf(port, sizeof(port), "%d", server_port);
+        //不启用数据库和响应缓存，响应体全部经splice转发
+        execl(argv[1], argv[1], "-p", port, "-x", conf, "-s", "0", "-R", "0", "-c", "1", (char *) NULL);
+        _exit(127);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(server_port);
+    int fd = -1;
+    for (int i = 0; i < 50 && fd < 0; ++i) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        //接收缓冲区很小，代理向客户端splice时很快遇到EAGAIN
+        int rcvbuf = 4096;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+            usleep(100 * 1000);
+        }
+    }
+
+    bool ok = fd >= 0;
+    if (ok) {
+        struct timeval timeout = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ok = fetch(fd, "slow.test") && fetch(fd, "slow.test");
+        close(fd);
+    } else {
+        fprintf(stderr, "cannot connect to server\n");
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(conf);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
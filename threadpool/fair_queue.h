@@ -0,0 +1,129 @@
+#ifndef FAIR_QUEUE_H
+#define FAIR_QUEUE_H
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+
+/*按类别加权、类别内按客户端做差额轮询(DRR)的任务队列，不加锁，由调用方加锁。
+ *类别按权重轮流出队，空类别不占份额；同一类别内每个客户端一个子队列，
+ *轮到时补充QUANTUM的额度，额度够付队首任务的开销才出队，否则排到末尾，
+ *一个客户端灌进大量请求也只能按轮次分到线程*/
+template<typename T>
+class fair_queue {
+public:
+    static const int CLASSES = 3;
+    static const int QUANTUM = 1;   //每轮补充的额度，开销按请求的KB数计，小请求每轮一个
+
+    fair_queue() : m_size(0) {
+        for (int i = 0; i < CLASSES; ++i)
+            m_classes[i].credit = weight(i);
+    }
+
+    ~fair_queue() {
+        for (int i = 0; i < CLASSES; ++i) {
+            for (auto &it : m_classes[i].flows)
+                delete it.second;
+        }
+    }
+
+    //类别越小优先级越高，权重依次为4、2、1
+    static int weight(int klass) {
+        return 4 >> klass;
+    }
+
+    void push(T *request, uint32_t key, int klass, int cost, long enqueue_ms) {
+        category &c = m_classes[klass < 0 ? 0 : klass >= CLASSES ? CLASSES - 1 : klass];
+        flow *&f = c.flows[key];
+        if (!f) {
+            f = new flow;
+            f->key = key;
+            f->deficit = 0;
+            c.active.push_back(f);
+        }
+        item i;
+        i.request = request;
+        i.cost = cost;
+        i.enqueue_ms = enqueue_ms;
+        f->items.push_back(i);
+        ++m_size;
+    }
+
+    bool pop(T *&request, long &enqueue_ms) {
+        if (m_size == 0)
+            return false;
+        category *c = next_category();
+        while (true) {
+            flow *f = c->active.front();
+            item &head = f->items.front();
+            //轮到时补充额度，仍不够付队首的开销就排到末尾
+            if (f->deficit < head.cost) {
+                f->deficit += QUANTUM;
+                if (f->deficit < head.cost) {
+                    c->active.pop_front();
+                    c->active.push_back(f);
+                    continue;
+                }
+            }
+            f->deficit -= head.cost;
+            request = head.request;
+            enqueue_ms = head.enqueue_ms;
+            f->items.pop_front();
+            --m_size;
+            //客户端的请求取完就不再参与轮询，下次来时额度从0开始
+            if (f->items.empty()) {
+                c->active.pop_front();
+                c->flows.erase(f->key);
+                delete f;
+            } else if (f->deficit < f->items.front().cost) {
+                //本轮额度用完，让给下一个客户端
+                c->active.pop_front();
+                c->active.push_back(f);
+            }
+            return true;
+        }
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+private:
+    struct item {
+        T *request;
+        int cost;
+        long enqueue_ms;
+    };
+
+    struct flow {
+        uint32_t key;
+        std::deque<item> items;
+        int deficit;
+    };
+
+    struct category {
+        std::unordered_map<uint32_t, flow *> flows;
+        std::deque<flow *> active;
+        int credit;     //本轮还能出队的次数
+    };
+
+    //取有任务且本轮还有份额的最高优先级类别，都用完时开始新的一轮
+    category *next_category() {
+        while (true) {
+            for (int i = 0; i < CLASSES; ++i) {
+                if (!m_classes[i].active.empty() && m_classes[i].credit > 0) {
+                    --m_classes[i].credit;
+                    return &m_classes[i];
+                }
+            }
+            for (int i = 0; i < CLASSES; ++i)
+                m_classes[i].credit = weight(i);
+        }
+    }
+
+private:
+    category m_classes[CLASSES];
+    size_t m_size;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef JOB_QUEUE_H
+#define JOB_QUEUE_H
+
+#include <list>
+#include <vector>
+#include <cstddef>
+#include <exception>
+#include <pthread.h>
+#include "../lock/locker.h"
+
+/*后台线程共用的任务队列：thread_number个线程依次取出任务，交给owner的handler处理。
+ *队列满或已停止时push返回false；stop处理完已入队的任务后join所有线程，
+ *owner要在handler用到的成员释放之前调用它(析构时也会调用)*/
+template<typename Owner, typename T>
+class job_queue {
+public:
+    typedef void (Owner::*handler)(T &job);
+
+    job_queue(Owner *owner, handler fn, int thread_number, size_t max_jobs) : m_owner(owner), m_handler(fn),
+                                                                              m_max_jobs(max_jobs),
+                                                                              m_stop(false) {
+        if (thread_number <= 0 || max_jobs == 0)
+            throw std::exception();
+        for (int i = 0; i < thread_number; ++i) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, worker, this) != 0) {
+                stop();
+                throw std::exception();
+            }
+            m_threads.push_back(thread);
+        }
+    }
+
+    ~job_queue() {
+        stop();
+    }
+
+    bool push(const T &job) {
+        m_lock.lock();
+        if (m_stop || m_jobs.size() >= m_max_jobs) {
+            m_lock.unlock();
+            return false;
+        }
+        m_jobs.push_back(job);
+        m_cond.signal();
+        m_lock.unlock();
+        return true;
+    }
+
+    void stop() {
+        m_lock.lock();
+        m_stop = true;
+        m_cond.broadcast();
+        m_lock.unlock();
+        for (size_t i = 0; i < m_threads.size(); ++i)
+            pthread_join(m_threads[i], NULL);
+        m_threads.clear();
+    }
+
+private:
+    static void *worker(void *arg) {
+        job_queue *queue = (job_queue *) arg;
+        queue->run();
+        return queue;
+    }
+
+    void run() {
+        m_lock.lock();
+        while (true) {
+            while (m_jobs.empty() && !m_stop)
+                m_cond.wait(m_lock.get());
+            if (m_jobs.empty())
+                break;
+            T job = m_jobs.front();
+            m_jobs.pop_front();
+            m_lock.unlock();
+            (m_owner->*m_handler)(job);
+            m_lock.lock();
+        }
+        m_lock.unlock();
+    }
+
+private:
+    Owner *m_owner;
+    handler m_handler;
+    size_t m_max_jobs;
+    std::vector<pthread_t> m_threads;
+    std::list<T> m_jobs;
+    locker m_lock;
+    cond m_cond;
+    bool m_stop;
+};
+
+#endif
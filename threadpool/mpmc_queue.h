@@ -0,0 +1,168 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+//自旋等待时提示CPU降低功耗，并让出流水线给同核的另一个超线程
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*有界多生产者多消费者无锁队列(Vyukov)。
+ *每个槽位带一个序号：序号等于入队位置时可写，等于入队位置+1时可读，
+ *生产者和消费者各自只在自己的位置计数上CAS，互不加锁，也不为每个元素分配内存*/
+template<typename T>
+class mpmc_queue {
+public:
+    //容量向上取整为2的幂
+    explicit mpmc_queue(size_t capacity) {
+        m_capacity = 2;
+        while (m_capacity < capacity)
+            m_capacity <<= 1;
+        m_mask = m_capacity - 1;
+        m_cells = new cell[m_capacity];
+        for (size_t i = 0; i < m_capacity; ++i)
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        m_enqueue_pos.store(0, std::memory_order_relaxed);
+        m_dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    ~mpmc_queue() {
+        delete[] m_cells;
+    }
+
+    //队列满时返回false
+    bool push(const T &data) {
+        cell *c;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            long diff = (long) seq - (long) pos;
+            if (diff == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->data = data;
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    //队列空时返回false
+    bool pop(T &data) {
+        cell *c;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            long diff = (long) seq - (long) (pos + 1);
+            if (diff == 0) {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        data = c->data;
+        c->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*一次CAS占下连续的count个空槽，返回实际入队的个数。
+     *检查过的槽位只有占到该位置的生产者才能修改，CAS成功说明它们仍然空着*/
+    size_t push_bulk(const T *data, size_t count) {
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        size_t n;
+        while (true) {
+            n = 0;
+            while (n < count && m_cells[(pos + n) & m_mask].seq.load(std::memory_order_acquire) == pos + n)
+                ++n;
+            if (n == 0) {
+                cell *c = &m_cells[pos & m_mask];
+                //槽位还没被消费者释放，队列满
+                if ((long) c->seq.load(std::memory_order_acquire) - (long) pos < 0)
+                    return 0;
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                break;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            cell *c = &m_cells[(pos + i) & m_mask];
+            c->data = data[i];
+            c->seq.store(pos + i + 1, std::memory_order_release);
+        }
+        return n;
+    }
+
+    //一次CAS取出最多count个连续的元素，返回取出的个数
+    size_t pop_bulk(T *data, size_t count) {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        size_t n;
+        while (true) {
+            n = 0;
+            while (n < count && m_cells[(pos + n) & m_mask].seq.load(std::memory_order_acquire) == pos + n + 1)
+                ++n;
+            if (n == 0) {
+                cell *c = &m_cells[pos & m_mask];
+                if ((long) c->seq.load(std::memory_order_acquire) - (long) (pos + 1) < 0)
+                    return 0;
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (m_dequeue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                break;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            cell *c = &m_cells[(pos + i) & m_mask];
+            data[i] = c->data;
+            c->seq.store(pos + i + m_mask + 1, std::memory_order_release);
+        }
+        return n;
+    }
+
+    //近似的元素个数，只用于统计
+    size_t size() const {
+        size_t tail = m_enqueue_pos.load(std::memory_order_relaxed);
+        size_t head = m_dequeue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t capacity() const {
+        return m_capacity;
+    }
+
+private:
+    static const size_t CACHE_LINE = 64;
+
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    //两个位置计数分别被生产者和消费者频繁修改，放在不同的缓存行
+    char m_pad0[CACHE_LINE];
+    cell *m_cells;
+    size_t m_capacity;
+    size_t m_mask;
+    char m_pad1[CACHE_LINE];
+    std::atomic<size_t> m_enqueue_pos;
+    char m_pad2[CACHE_LINE];
+    std::atomic<size_t> m_dequeue_pos;
+    char m_pad3[CACHE_LINE];
+};
+
+#endif
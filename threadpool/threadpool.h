@@ -1,58 +1,165 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
+#include <ctime>
+#include <atomic>
+#include <vector>
 #include <exception>
 #include <pthread.h>
+#include <sys/sysinfo.h>
 #include "../lock/locker.h"
+#include "mpmc_queue.h"
+#include "fair_queue.h"
 #include "../http/http_conn.h"
+#ifdef COROUTINE
+#include <coroutine>
+#endif
 
 template<typename T>
 class threadpool {
 public:
-    /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量*/
-    threadpool(int actor_model, int thread_number = 8, int max_request = 10000);
+    /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量，
+     *work_stealing为1时每个线程一个队列，同一连接的任务交给同一个线程，空闲线程从别的队列窃取；
+     *max_thread_number大于thread_number时任务排队过久就加线程，空闲的线程退出到thread_number个；
+     *fair_sched为1时按请求类别加权、类别内按客户端IP轮流调度，忽略work_stealing*/
+    threadpool(int actor_model, int thread_number = 8, int max_request = 10000, int work_stealing = 0,
+               int max_thread_number = 0, int fair_sched = 0);
 
+    //唤醒并等待所有工作线程退出，正在处理的请求会先处理完
     ~threadpool();
 
     bool append(http_conn *request, int state);
 
     bool append_p(http_conn *request);
 
+    /*主线程一轮epoll_wait中读完的连接一起入队，只唤醒需要的线程数。
+     *返回入队的个数n，队列满时只有前n个入队，其余的由调用方处理*/
+    int append_batch(http_conn **requests, int count);
+
 private:
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void *worker(void *arg);
 
     void run();
 
+    //取出最多TAKE_BATCH个任务，先自旋，仍然没有任务时睡眠等待；线程应当退出时返回0
+    int take(T **requests);
+
+    struct task;
+
+    size_t pop_share(task *tasks);
+
+    void handle(T *request);
+
+    //入队后有睡眠的工作线程时唤醒一个
+    bool push(T *request);
+
+    //工作窃取模式下的取任务和入队
+    T *take_local(int index);
+
+    bool push_local(T *request);
+
+    //公平调度模式下的取任务和入队
+    T *take_fair();
+
+    //返回按顺序入队的个数，队列中已有max_requests个任务时停止
+    int push_fair(T **requests, int count);
+
+    //从其他线程的队列取一个任务
+    bool steal(int index, T *&request);
+
+    //线程index在睡眠时唤醒它
+    bool wake(int index);
+
+    //任务排队超过WAIT_TARGET_MS时加一个线程，throttle时距上次加线程不足WAIT_TARGET_MS不加
+    void grow(bool throttle);
+
+    bool spawn();
+
+    //空闲超时的线程在多于最少线程数时退出
+    bool retire();
+
+    //唤醒并join所有线程
+    void stop();
+
+    static long now_ms() {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+        return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+    }
+
 private:
-    int m_thread_number;        //线程池中的线程数
+    static const int SPIN_COUNT = 128;      //睡眠前自旋检查队列的次数
+    static const long WAIT_TARGET_MS = 50;  //任务排队超过这个时间就加线程，两次加线程也至少间隔这么久
+    static const int IDLE_TIMEOUT = 30;     //多出来的线程空闲这么多秒后退出
+    static const int TAKE_BATCH = 8;        //工作线程一次最多取出的任务数
+
+    struct task {
+        T *request;
+        long enqueue_ms;
+    };
+
+    struct worker_queue {
+        mpmc_queue<T *> *queue;
+        sem wakeup;
+        std::atomic<int> parked;    //1表示已登记睡眠，唤醒方把它换成0后再post
+
+        worker_queue() : queue(NULL), parked(0) {}
+
+        ~worker_queue() {
+            delete queue;
+        }
+    };
+
+private:
+    int m_thread_number;        //线程池中的线程数，弹性伸缩时为最少线程数
+    int m_max_thread_number;    //最多线程数
     int m_max_requests;         //请求队列中允许的最大请求数
-    pthread_t *m_threads;       //描述线程池的数组，其大小为m_thread_number
-    std::list<T *> m_workqueue; //请求队列
-    locker m_queuelocker;       //保护请求队列的互斥锁
-    sem m_queuestat;            //是否有任务需要处理
+    std::vector<pthread_t> m_threads;   //运行中的线程，退出的空闲线程会把自己移除
+    locker m_threads_lock;      //保护m_threads和m_stop
+    std::atomic<bool> m_stop;
+    std::atomic<int> m_alive;   //运行中的线程数
+    std::atomic<long> m_last_take_ms;   //最近一次取出任务的时间
+    std::atomic<long> m_last_grow_ms;   //最近一次加线程的时间
+    mpmc_queue<task> m_workqueue;   //请求队列，无锁环形缓冲
+    sem m_queuestat;            //唤醒睡眠的工作线程
+    std::atomic<int> m_idle;    //正在或即将睡眠的工作线程数
+    int m_spin;                 //单核时自旋只会占住生产者的时间片，不自旋
+    worker_queue *m_local;      //工作窃取模式下每个线程的队列，否则为NULL
+    std::atomic<int> m_next_index;  //工作线程启动时领取自己的编号
+    fair_queue<T> *m_fair;      //公平调度模式下的队列，否则为NULL
+    locker m_fair_lock;
+    cond m_fair_cond;
     int m_actor_model;          //模型切换
 };
 
 template<typename T>
-threadpool<T>::threadpool(int actor_model, int thread_number, int max_requests) : m_actor_model(actor_model),
-                                                                                  m_thread_number(thread_number),
-                                                                                  m_max_requests(max_requests),
-                                                                                  m_threads(nullptr) {
+threadpool<T>::threadpool(int actor_model, int thread_number, int max_requests, int work_stealing,
+                          int max_thread_number, int fair_sched)
+        : m_thread_number(thread_number), m_max_thread_number(max_thread_number), m_max_requests(max_requests),
+          m_stop(false), m_alive(0), m_last_take_ms(now_ms()), m_last_grow_ms(0), m_workqueue(max_requests),
+          m_idle(0), m_spin(get_nprocs() > 1 ? SPIN_COUNT : 0), m_local(NULL), m_next_index(0), m_fair(NULL),
+          m_actor_model(actor_model) {
     if (thread_number <= 0 || max_requests <= 0)
         throw std::exception();
-    m_threads = new pthread_t[m_thread_number];
-    if (!m_threads)
-        throw std::exception();
+    if (fair_sched) {
+        m_fair = new fair_queue<T>;
+        work_stealing = 0;
+    }
+    //每线程队列按编号分配，线程数固定
+    if (work_stealing || m_max_thread_number < m_thread_number)
+        m_max_thread_number = m_thread_number;
+    if (work_stealing) {
+        m_local = new worker_queue[thread_number];
+        int capacity = max_requests / thread_number > 64 ? max_requests / thread_number : 64;
+        for (int i = 0; i < thread_number; ++i)
+            m_local[i].queue = new mpmc_queue<T *>(capacity);
+    }
     for (int i = 0; i < thread_number; ++i) {
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
-            delete[] m_threads;
-            throw std::exception();
-        }
-        if (pthread_detach(m_threads[i])) {
-            delete[] m_threads;
+        m_alive.fetch_add(1);
+        if (!spawn()) {
+            stop();
             throw std::exception();
         }
     }
@@ -60,36 +167,247 @@ threadpool<T>::threadpool(int actor_model, int thread_number, int max_requests)
 
 template<typename T>
 threadpool<T>::~threadpool() {
-    delete[] m_threads;
+    stop();
 }
 
 template<typename T>
-bool threadpool<T>::append(http_conn *request, int state) {
-    m_queuelocker.lock();
-    if (m_workqueue.size() >= m_max_requests) {
-        m_queuelocker.unlock();
+void threadpool<T>::stop() {
+    m_threads_lock.lock();
+    m_stop = true;
+    std::vector<pthread_t> threads = m_threads;
+    m_threads_lock.unlock();
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        m_queuestat.post();
+    if (m_fair) {
+        m_fair_lock.lock();
+        m_fair_cond.broadcast();
+        m_fair_lock.unlock();
+    }
+    if (m_local) {
+        for (int i = 0; i < m_thread_number; ++i)
+            m_local[i].wakeup.post();
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], NULL);
+    m_threads.clear();
+    delete[] m_local;
+    m_local = NULL;
+    delete m_fair;
+    m_fair = NULL;
+}
+
+template<typename T>
+bool threadpool<T>::spawn() {
+    m_threads_lock.lock();
+    pthread_t thread;
+    bool ok = !m_stop && pthread_create(&thread, NULL, worker, this) == 0;
+    if (ok)
+        m_threads.push_back(thread);
+    m_threads_lock.unlock();
+    return ok;
+}
+
+template<typename T>
+void threadpool<T>::grow(bool throttle) {
+    if (m_max_thread_number <= m_thread_number)
+        return;
+    long now = now_ms();
+    long last = m_last_grow_ms.load(std::memory_order_relaxed);
+    if (throttle && (now - last < WAIT_TARGET_MS || !m_last_grow_ms.compare_exchange_strong(last, now)))
+        return;
+    m_last_grow_ms.store(now, std::memory_order_relaxed);
+    int alive = m_alive.load();
+    if (alive >= m_max_thread_number || !m_alive.compare_exchange_strong(alive, alive + 1))
+        return;
+    if (!spawn())
+        m_alive.fetch_sub(1);
+}
+
+template<typename T>
+bool threadpool<T>::retire() {
+    int alive = m_alive.load();
+    if (alive <= m_thread_number || !m_alive.compare_exchange_strong(alive, alive - 1))
         return false;
+    m_threads_lock.lock();
+    //析构时已经记下了这个线程，由析构函数join
+    if (!m_stop) {
+        pthread_t self = pthread_self();
+        for (size_t i = 0; i < m_threads.size(); ++i) {
+            if (pthread_equal(m_threads[i], self)) {
+                m_threads.erase(m_threads.begin() + i);
+                break;
+            }
+        }
+        pthread_detach(self);
     }
-    request->m_rw_state = state;
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    m_threads_lock.unlock();
     return true;
 }
 
 template<typename T>
-bool threadpool<T>::append_p(http_conn *request) {
-    m_queuelocker.lock();
-    if (m_workqueue.size() >= m_max_requests) {
-        m_queuelocker.unlock();
+bool threadpool<T>::push(T *request) {
+    task t;
+    t.request = request;
+    t.enqueue_ms = now_ms();
+    if (!m_workqueue.push(t))
+        return false;
+    //与take中先登记空闲再检查队列配合：两边至少有一方看到对方，不会漏掉唤醒
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_idle.load(std::memory_order_relaxed) > 0)
+        m_queuestat.post();
+    //没有空闲线程，且很久没有线程来取任务，说明线程都阻塞在处理函数里
+    else if (t.enqueue_ms - m_last_take_ms.load(std::memory_order_relaxed) > WAIT_TARGET_MS)
+        grow(true);
+    return true;
+}
+
+template<typename T>
+bool threadpool<T>::push_local(T *request) {
+    //同一连接的任务尽量交给同一个线程，http_conn留在该核的缓存里
+    int sockfd = request->get_sockfd();
+    int home = sockfd >= 0 ? sockfd % m_thread_number : 0;
+    int target = -1;
+    for (int i = 0; i < m_thread_number && target < 0; ++i) {
+        if (m_local[(home + i) % m_thread_number].queue->push(request))
+            target = (home + i) % m_thread_number;
+    }
+    if (target < 0)
         return false;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    //目标线程在睡眠就唤醒它；它正忙时唤醒一个空闲线程来窃取
+    if (wake(target))
+        return true;
+    for (int i = 1; i < m_thread_number; ++i) {
+        if (wake((target + i) % m_thread_number))
+            break;
     }
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
     return true;
 }
 
+template<typename T>
+bool threadpool<T>::wake(int index) {
+    worker_queue &w = m_local[index];
+    if (w.parked.load(std::memory_order_relaxed) == 0 || w.parked.exchange(0) == 0)
+        return false;
+    w.wakeup.post();
+    return true;
+}
+
+template<typename T>
+int threadpool<T>::push_fair(T **requests, int count) {
+    long now = now_ms();
+    m_fair_lock.lock();
+    int pushed = 0;
+    for (; pushed < count && m_fair->size() < (size_t) m_max_requests; ++pushed) {
+        T *request = requests[pushed];
+        //开销按已读入的请求字节数计，每KB算1
+        m_fair->push(request, request->get_address()->sin_addr.s_addr, request->sched_class(),
+                     1 + request->sched_bytes() / 1024, now);
+    }
+    int idle = m_idle.load(std::memory_order_relaxed);
+    if (idle > 0 && pushed > 1)
+        m_fair_cond.broadcast();
+    else if (idle > 0 && pushed > 0)
+        m_fair_cond.signal();
+    m_fair_lock.unlock();
+    if (idle == 0 && now - m_last_take_ms.load(std::memory_order_relaxed) > WAIT_TARGET_MS)
+        grow(true);
+    return pushed;
+}
+
+template<typename T>
+T *threadpool<T>::take_fair() {
+    T *request = NULL;
+    long enqueue_ms = 0;
+    m_fair_lock.lock();
+    while (!m_fair->pop(request, enqueue_ms)) {
+        if (m_stop) {
+            m_fair_lock.unlock();
+            return NULL;
+        }
+        bool woken;
+        m_idle.fetch_add(1, std::memory_order_relaxed);
+        if (m_max_thread_number > m_thread_number) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += IDLE_TIMEOUT;
+            woken = m_fair_cond.timewait(m_fair_lock.get(), deadline);
+        } else {
+            woken = m_fair_cond.wait(m_fair_lock.get());
+        }
+        m_idle.fetch_sub(1, std::memory_order_relaxed);
+        if (!woken && m_fair->size() == 0 && !m_stop && retire()) {
+            m_fair_lock.unlock();
+            return NULL;
+        }
+    }
+    m_fair_lock.unlock();
+    long now = now_ms();
+    m_last_take_ms.store(now, std::memory_order_relaxed);
+    if (now - enqueue_ms > WAIT_TARGET_MS)
+        grow(false);
+    return request;
+}
+
+template<typename T>
+bool threadpool<T>::append(http_conn *request, int state) {
+    request->m_state = state;
+    return append_p(request);
+}
+
+template<typename T>
+bool threadpool<T>::append_p(http_conn *request) {
+    if (m_fair)
+        return push_fair(&request, 1) == 1;
+    return m_local ? push_local(request) : push(request);
+}
+
+template<typename T>
+int threadpool<T>::append_batch(http_conn **requests, int count) {
+    if (m_fair)
+        return push_fair(requests, count);
+    if (m_local) {
+        //各线程的队列分别会满，入队成功的移到前面
+        int pushed = 0;
+        for (int i = 0; i < count; ++i) {
+            if (push_local(requests[i]))
+                std::swap(requests[pushed++], requests[i]);
+        }
+        return pushed;
+    }
+    task tasks[TAKE_BATCH * 8];
+    long now = now_ms();
+    int pushed = 0;
+    while (pushed < count) {
+        int n = count - pushed < TAKE_BATCH * 8 ? count - pushed : TAKE_BATCH * 8;
+        for (int i = 0; i < n; ++i) {
+            tasks[i].request = requests[pushed + i];
+            tasks[i].enqueue_ms = now;
+        }
+        size_t done = 0;
+        while (done < (size_t) n) {
+            size_t k = m_workqueue.push_bulk(tasks + done, n - done);
+            if (k == 0)
+                break;
+            done += k;
+        }
+        pushed += done;
+        if (done < (size_t) n)
+            break;
+    }
+    if (pushed == 0)
+        return 0;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    //醒来的线程会按份额一次取走几个任务，唤醒的线程数不超过任务数
+    int idle = m_idle.load(std::memory_order_relaxed);
+    for (int i = 0; i < idle && i < pushed; ++i)
+        m_queuestat.post();
+    if (idle == 0 && now - m_last_take_ms.load(std::memory_order_relaxed) > WAIT_TARGET_MS)
+        grow(true);
+    return pushed;
+}
+
 template<typename T>
 void *threadpool<T>::worker(void *arg) {
     threadpool *pool = (threadpool *) arg;
@@ -97,45 +415,145 @@ void *threadpool<T>::worker(void *arg) {
     return pool;
 }
 
+template<typename T>
+size_t threadpool<T>::pop_share(task *tasks) {
+    //排队的任务多于线程数时一次多取几个，少于时只取一个，不让别的线程空等
+    size_t share = m_workqueue.size() / (size_t) m_alive.load(std::memory_order_relaxed) + 1;
+    return m_workqueue.pop_bulk(tasks, share < (size_t) TAKE_BATCH ? share : TAKE_BATCH);
+}
+
+template<typename T>
+int threadpool<T>::take(T **requests) {
+    task tasks[TAKE_BATCH];
+    size_t got = 0;
+    //任务密集时自旋一小段就能取到，不必进入内核
+    for (int i = 0; i < m_spin && !got; ++i) {
+        got = pop_share(tasks);
+        if (!got)
+            cpu_relax();
+    }
+    while (!got) {
+        m_idle.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        //登记后再检查一次，登记前入队的任务不会有人来唤醒
+        if ((got = pop_share(tasks)) > 0) {
+            m_idle.fetch_sub(1, std::memory_order_relaxed);
+            break;
+        }
+        bool woken;
+        if (m_max_thread_number > m_thread_number) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += IDLE_TIMEOUT;
+            woken = m_queuestat.timedwait(deadline);
+        } else {
+            woken = m_queuestat.wait();
+        }
+        m_idle.fetch_sub(1, std::memory_order_relaxed);
+        if (m_stop)
+            return 0;
+        //多余的唤醒只会让线程再睡一次
+        got = pop_share(tasks);
+        if (!got && !woken && retire())
+            return 0;
+    }
+    long now = now_ms();
+    m_last_take_ms.store(now, std::memory_order_relaxed);
+    //取到的任务等得太久，再加一个线程处理后面的任务；新线程取到的任务也等了太久时会接着加
+    if (now - tasks[0].enqueue_ms > WAIT_TARGET_MS)
+        grow(false);
+    for (size_t i = 0; i < got; ++i)
+        requests[i] = tasks[i].request;
+    return (int) got;
+}
+
+template<typename T>
+bool threadpool<T>::steal(int index, T *&request) {
+    for (int i = 1; i < m_thread_number; ++i) {
+        if (m_local[(index + i) % m_thread_number].queue->pop(request))
+            return true;
+    }
+    return false;
+}
+
+template<typename T>
+T *threadpool<T>::take_local(int index) {
+    T *request = NULL;
+    worker_queue &self = m_local[index];
+    while (true) {
+        //先取自己的队列，空了再从其他线程的队列窃取
+        for (int i = 0; i <= m_spin; ++i) {
+            if (self.queue->pop(request) || steal(index, request))
+                return request;
+            cpu_relax();
+        }
+        self.parked.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (self.queue->pop(request) || steal(index, request)) {
+            //登记已被唤醒方换成0时，它的post要在这里消耗掉
+            if (self.parked.exchange(0) == 0)
+                self.wakeup.wait();
+            return request;
+        }
+        self.wakeup.wait();
+        if (m_stop)
+            return NULL;
+    }
+}
+
 template<typename T>
 void threadpool<T>::run() {
+    int index = m_next_index.fetch_add(1);
+    T *requests[TAKE_BATCH];
     while (true) {
         /**
          * 从任务队列中取出任务
          */
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if (m_workqueue.empty()) {
-            m_queuelocker.unlock();
-            continue;
-        }
-        http_conn *request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
-        if (!request)
-            continue;
-        // Reactor模型
-        if (1 == m_actor_model) {
-            if (0 == request->m_rw_state) {
-                if (request->read_once()) {
-                    request->conn_io_done_flag = 1;
-                    request->process();
-                } else {
-                    request->conn_io_done_flag = 1;
-                    request->remove_timer_flag = 1;
-                }
+        int count = 0;
+        if (m_fair)
+            count = (requests[0] = take_fair()) != NULL;
+        else if (m_local)
+            count = (requests[0] = take_local(index)) != NULL;
+        else
+            count = take(requests);
+        //线程池析构或空闲线程退出
+        if (count == 0)
+            break;
+        for (int i = 0; i < count; ++i)
+            handle(requests[i]);
+    }
+}
+
+template<typename T>
+void threadpool<T>::handle(T *request) {
+    // Reactor模型
+    if (1 == m_actor_model) {
+        if (0 == request->m_state) {
+            if (request->read_once()) {
+                request->conn_io_done_flag = 1;
+                request->process();
             } else {
-                if (request->write()) {
-                    request->conn_io_done_flag = 1;
-                } else {
-                    request->conn_io_done_flag = 1;
-                    request->remove_timer_flag = 1;
-                }
+                request->conn_io_done_flag = 1;
+                request->remove_timer_flag = 1;
             }
         } else {
-            request->process();
+            if (request->write()) {
+                request->conn_io_done_flag = 1;
+            } else {
+                request->conn_io_done_flag = 1;
+                request->remove_timer_flag = 1;
+            }
         }
     }
+#ifdef COROUTINE
+    //协程模型：接着执行连接的协程，它处理完请求后自己回到主线程
+    else if (2 == m_actor_model) {
+        std::coroutine_handle<>::from_address(request->m_coro).resume();
+    }
+#endif
+    else {
+        request->process();
+    }
 }
 
 #endif
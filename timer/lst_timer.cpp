@@ -1,124 +1,148 @@
 #include "lst_timer.h"
 #include "../http/http_conn.h"
 
-sort_timer_lst::sort_timer_lst() {
-    head = NULL;
-    tail = NULL;
+time_wheel::time_wheel() : m_free(NULL) {
+    for (int i = 0; i < LEVELS; ++i) {
+        for (int j = 0; j < SLOTS; ++j)
+            m_slots[i][j].prev = m_slots[i][j].next = &m_slots[i][j];
+    }
+    for (int i = 0; i < PHASE_COUNT; ++i)
+        m_expired[i].store(0, std::memory_order_relaxed);
+    m_current = time(NULL);
 }
 
-sort_timer_lst::~sort_timer_lst() {
-    util_timer *tmp = head;
-    while (tmp) {
-        head = tmp->next;
-        delete tmp;
-        tmp = head;
-    }
+const char *time_wheel::phase_name(int phase) {
+    static const char *names[PHASE_COUNT] = {"first_byte", "header", "body", "write", "idle", "other"};
+    return names[phase];
 }
 
-void sort_timer_lst::add_timer(util_timer *timer) {
-    if (!timer) {
-        return;
-    }
-    if (!head) {
-        head = tail = timer;
-        return;
+time_wheel::~time_wheel() {
+    for (size_t i = 0; i < m_chunks.size(); ++i)
+        delete[] m_chunks[i];
+}
+
+util_timer *time_wheel::alloc_timer() {
+    if (!m_free) {
+        util_timer *chunk = new util_timer[CHUNK];
+        m_chunks.push_back(chunk);
+        for (int i = 0; i < CHUNK; ++i)
+            free_timer(chunk + i);
     }
-    if (timer->expire < head->expire) {
-        timer->next = head;
-        head->prev = timer;
-        head = timer;
-        return;
+    util_timer *timer = m_free;
+    m_free = timer->next;
+    timer->prev = timer->next = NULL;
+    return timer;
+}
+
+void time_wheel::free_timer(util_timer *timer) {
+    timer->prev = NULL;
+    timer->next = m_free;
+    m_free = timer;
+}
+
+void time_wheel::link(util_timer *head, util_timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void time_wheel::unlink(util_timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+void time_wheel::place(util_timer *timer) {
+    //已经过期的放到下一个要处理的槽
+    time_t due = timer->expire < m_current ? m_current : timer->expire;
+    int level = 0;
+    //槽号相差不到一圈的最低层，保证在到期之前会被处理或下放
+    while (level < LEVELS - 1 &&
+           (due >> (level * SLOT_BITS)) - (m_current >> (level * SLOT_BITS)) >= SLOTS)
+        ++level;
+    if (level == LEVELS - 1) {
+        //超出时间轮范围的放在最高层最远的槽，下放时再重新计算
+        time_t limit = ((m_current >> (level * SLOT_BITS)) + SLOTS - 1) << (level * SLOT_BITS);
+        if (due > limit)
+            due = limit;
     }
-    add_timer(timer, head);
+    timer->due = due;
+    link(&m_slots[level][(due >> (level * SLOT_BITS)) & (SLOTS - 1)], timer);
 }
 
-void sort_timer_lst::adjust_timer(util_timer *timer) {
+void time_wheel::add_timer(util_timer *timer) {
     if (!timer) {
         return;
     }
-    util_timer *tmp = timer->next;
-    if (!tmp || (timer->expire < tmp->expire)) {
+    place(timer);
+}
+
+void time_wheel::adjust_timer(util_timer *timer) {
+    if (!timer || timer->expire >= timer->due) {
         return;
     }
-    if (timer == head) {
-        head = head->next;
-        head->prev = NULL;
-        timer->next = NULL;
-        add_timer(timer, head);
-    } else {
-        timer->prev->next = timer->next;
-        timer->next->prev = timer->prev;
-        add_timer(timer, timer->next);
-    }
+    unlink(timer);
+    place(timer);
 }
 
-void sort_timer_lst::del_timer(util_timer *timer) {
+void time_wheel::del_timer(util_timer *timer) {
     if (!timer) {
         return;
     }
-    if ((timer == head) && (timer == tail)) {
-        delete timer;
-        head = NULL;
-        tail = NULL;
-        return;
-    }
-    if (timer == head) {
-        head = head->next;
-        head->prev = NULL;
-        delete timer;
-        return;
-    }
-    if (timer == tail) {
-        tail = tail->prev;
-        tail->next = NULL;
-        delete timer;
-        return;
-    }
-    timer->prev->next = timer->next;
-    timer->next->prev = timer->prev;
-    delete timer;
+    unlink(timer);
+    free_timer(timer);
 }
 
-void sort_timer_lst::tick() {
-    if (!head) {
-        return;
+void time_wheel::cascade(int level) {
+    util_timer *head = &m_slots[level][(m_current >> (level * SLOT_BITS)) & (SLOTS - 1)];
+    //先整体摘下，重新放置的节点可能回到同一个槽
+    util_timer list;
+    list.prev = list.next = &list;
+    if (head->next != head) {
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->prev = head->next = head;
     }
-
-    time_t cur = time(NULL);
-    util_timer *tmp = head;
-    while (tmp) {
-        if (cur < tmp->expire) {
-            break;
-        }
-        tmp->cb_func(tmp->user_data);
-        head = tmp->next;
-        if (head) {
-            head->prev = NULL;
-        }
-        delete tmp;
-        tmp = head;
+    while (list.next != &list) {
+        util_timer *timer = list.next;
+        unlink(timer);
+        place(timer);
     }
 }
 
-void sort_timer_lst::add_timer(util_timer *timer, util_timer *lst_head) {
-    util_timer *prev = lst_head;
-    util_timer *tmp = prev->next;
-    while (tmp) {
-        if (timer->expire < tmp->expire) {
-            prev->next = timer;
-            timer->next = tmp;
-            tmp->prev = timer;
-            timer->prev = prev;
-            break;
+void time_wheel::tick(time_t now) {
+    while (m_current <= now) {
+        //第0层转完一圈时，从最高的需要下放的层开始逐层下放，上层下放的节点可能落到下层当前的槽
+        int top = 0;
+        while (top < LEVELS - 1 && ((m_current >> (top * SLOT_BITS)) & (SLOTS - 1)) == 0)
+            ++top;
+        for (int level = top; level > 0; --level)
+            cascade(level);
+
+        util_timer *head = &m_slots[0][m_current & (SLOTS - 1)];
+        while (head->next != head) {
+            util_timer *timer = head->next;
+            unlink(timer);
+            //活跃的连接只推后了expire，按新的到期时间重新放置
+            if (timer->expire > m_current) {
+                place(timer);
+                continue;
+            }
+            //工作线程仍在使用这个连接，顺延到下一秒再检查
+            if (http_conn::busy(timer->user_data->sockfd)) {
+                timer->expire = now + 1;
+                place(timer);
+                continue;
+            }
+            m_expired[timer->user_data->phase].fetch_add(1, std::memory_order_relaxed);
+            timer->cb_func(timer->user_data);
+            timer->user_data->timer = NULL;
+            free_timer(timer);
         }
-        prev = tmp;
-        tmp = tmp->next;
-    }
-    if (!tmp) {
-        prev->next = timer;
-        timer->prev = prev;
-        timer->next = NULL;
-        tail = timer;
+        ++m_current;
     }
 }
 
@@ -172,7 +196,7 @@ void Utils::addsig(int sig, void(handler)(int), bool restart) {
 
 //定时处理任务，重新定时以不断触发SIGALRM信号
 void Utils::timer_handler() {
-    m_timer_lst.tick();
+    m_timer_wheel.tick(time(NULL));
     alarm(m_TIMESLOT);
 }
 
@@ -189,6 +213,8 @@ class Utils;
 void cb_func(client_data *user_data) {
     assert(user_data);
     epoll_ctl(Utils::u_epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
+    http_conn::unpark(user_data->sockfd);
+    http_conn::release_client(user_data->sockfd);
     close(user_data->sockfd);
     http_conn::m_user_count--;
 }
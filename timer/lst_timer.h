@@ -22,14 +22,41 @@
 #include <sys/uio.h>
 
 #include <time.h>
+#include <vector>
+#include <atomic>
 #include "../log/log.h"
 
 class util_timer;
 
+//连接所处的阶段，各阶段的超时规则不同
+enum CONN_PHASE {
+    PHASE_FIRST_BYTE = 0,   //建立连接后还没有收到数据
+    PHASE_HEADER,           //正在接收请求行和请求头
+    PHASE_BODY,             //正在接收请求体
+    PHASE_WRITE,            //正在发送响应
+    PHASE_IDLE,             //keep-alive连接等待下一个请求
+    PHASE_OTHER,            //代理转发等，按活动顺延
+    PHASE_COUNT
+};
+
 struct client_data {
     sockaddr_in address;
     int sockfd;
     util_timer *timer;
+    int phase;              //到期时间按哪个阶段计算
+    time_t phase_since;     //进入该阶段的时间
+    long phase_bytes;       //进入该阶段时待接收或待发送的字节数
+};
+
+/*连接各阶段的超时设置。首字节、请求头和空闲为从进入该阶段起的秒数，期间有数据也不顺延；
+ *请求体和响应为最低速率(字节/秒)，期限为进入阶段时的字节数按该速率所需的时间再加宽限。
+ *为0的阶段按活动顺延，与只有一个超时时间时相同*/
+struct conn_timeouts {
+    int first_byte;
+    int header;
+    int body_rate;
+    int write_rate;
+    int idle;
 };
 
 class util_timer {
@@ -38,6 +65,7 @@ public:
 
 public:
     time_t expire;
+    time_t due;         //节点在时间轮中所在槽位的到期时间，expire推后时不移动节点
 
     void (*cb_func)(client_data *);
 
@@ -46,25 +74,61 @@ public:
     util_timer *next;
 };
 
-class sort_timer_lst {
+/*分层时间轮，秒级精度，每层64个槽，共4层，可以表示约194天内的到期时间。
+ *到期时间与当前时间相差不到64秒的定时器放在第0层，否则按相差的量级放在高层，
+ *第0层转完一圈时把上一层的一个槽重新分配到下层。插入、删除都是O(1)；
+ *连接活跃时只推后expire，节点留在原来的槽里，到那个槽时再按新的expire重新放置。
+ *定时器节点从池中分配，用完归还，不逐个new/delete*/
+class time_wheel {
 public:
-    sort_timer_lst();
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int CHUNK = 1024;      //节点池每次扩充的节点数
 
-    ~sort_timer_lst();
+    time_wheel();
+
+    ~time_wheel();
+
+    //从节点池取一个定时器，del_timer或到期后自动归还
+    util_timer *alloc_timer();
 
     void add_timer(util_timer *timer);
 
+    //修改expire后调用，推后时什么都不做，提前时移到新的槽
     void adjust_timer(util_timer *timer);
 
     void del_timer(util_timer *timer);
 
-    void tick();
+    //处理到now为止经过的每一秒的槽
+    void tick(time_t now);
+
+    //按阶段统计的超时关闭的连接数
+    long expired(int phase) const {
+        return m_expired[phase].load(std::memory_order_relaxed);
+    }
+
+    static const char *phase_name(int phase);
 
 private:
-    void add_timer(util_timer *timer, util_timer *lst_head);
+    //按expire放入对应层的槽
+    void place(util_timer *timer);
+
+    //把第level层当前的槽重新分配到下层
+    void cascade(int level);
+
+    static void link(util_timer *head, util_timer *timer);
 
-    util_timer *head;
-    util_timer *tail;
+    static void unlink(util_timer *timer);
+
+    void free_timer(util_timer *timer);
+
+private:
+    util_timer m_slots[LEVELS][SLOTS];      //每个槽是带哨兵的双向循环链表
+    time_t m_current;                       //下一个要处理的秒
+    util_timer *m_free;                     //节点池的空闲链表
+    vector<util_timer *> m_chunks;
+    atomic<long> m_expired[PHASE_COUNT];    //工作线程中的状态接口会读取
 };
 
 class Utils {
@@ -94,7 +158,7 @@ public:
 
 public:
     static int *u_pipefd;
-    sort_timer_lst m_timer_lst;
+    time_wheel m_timer_wheel;
     static int u_epollfd;
     int m_TIMESLOT;
 };
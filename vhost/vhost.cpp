@@ -0,0 +1,65 @@
+#include "vhost.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+string normalize_host(const char *host) {
+    string name;
+    for (const char *p = host; *p && *p != ':' && *p != ' ' && *p != '\t'; ++p)
+        name.push_back((char) tolower((unsigned char) *p));
+    if (!name.empty() && name.back() == '.')
+        name.pop_back();
+    return name;
+}
+
+void vhost_table::add(const string &pattern, const vhost &host) {
+    if (pattern.compare(0, 2, "*.") == 0)
+        m_wildcard[normalize_host(pattern.c_str() + 2)] = host;
+    else
+        m_exact[normalize_host(pattern.c_str())] = host;
+}
+
+bool vhost_table::load(const char *file_name, const char *server_path) {
+    ifstream in(file_name);
+    if (!in)
+        return false;
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string pattern, root, option;
+        if (!(fields >> pattern) || pattern[0] == '#' || !(fields >> root))
+            continue;
+
+        vhost host;
+        host.root = root[0] == '/' ? root : string(server_path) + "/" + root;
+        host.index = "index.html";
+        host.keep_alive = true;
+        while (fields >> option) {
+            if (option.compare(0, 6, "index=") == 0)
+                host.index = option.substr(6);
+            else if (option == "keepalive=off")
+                host.keep_alive = false;
+        }
+        add(pattern, host);
+    }
+    return true;
+}
+
+const vhost *vhost_table::lookup(const char *host) const {
+    if (!host || empty())
+        return NULL;
+    string name = normalize_host(host);
+    auto it = m_exact.find(name);
+    if (it != m_exact.end())
+        return &it->second;
+    //a.b.example.com依次尝试b.example.com、example.com、com
+    for (size_t pos = name.find('.'); pos != string::npos; pos = name.find('.', pos + 1)) {
+        it = m_wildcard.find(name.substr(pos + 1));
+        if (it != m_wildcard.end())
+            return &it->second;
+    }
+    return NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef VHOST_H
+#define VHOST_H
+
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+//Host请求头规范化：转为小写，去掉端口和末尾的点
+string normalize_host(const char *host);
+
+//单个站点的配置
+struct vhost {
+    string root;        //网站根目录
+    string index;       //请求目录时返回的默认首页
+    bool keep_alive;    //是否允许长连接
+};
+
+class vhost_table {
+public:
+    vhost_table() {}
+
+    ~vhost_table() {}
+
+    //pattern为精确主机名或*.example.com形式的通配符
+    void add(const string &pattern, const vhost &host);
+
+    //从配置文件加载站点，root为相对路径时以server_path为基准
+    bool load(const char *file_name, const char *server_path);
+
+    //按Host请求头查找站点，未配置时返回NULL
+    const vhost *lookup(const char *host) const;
+
+    bool empty() const {
+        return m_exact.empty() && m_wildcard.empty();
+    }
+
+private:
+    unordered_map<string, vhost> m_exact;
+    unordered_map<string, vhost> m_wildcard;   //键为去掉"*."后的后缀
+};
+
+#endif
@@ -1,12 +1,33 @@
 #include "webserver.h"
 
 #include <utility>
+#include <algorithm>
 
 WebServer::WebServer() {
     //http_conn类对象
     users = new http_conn[MAX_FD];
     //定时器
     users_timer = new client_data[MAX_FD];
+    m_ready.reserve(MAX_EVENT_NUMBER);
+    m_srpt = 0;
+    m_writable.reserve(MAX_EVENT_NUMBER);
+    m_inline_reply = 0;
+    m_pool = NULL;
+    m_io_pool = NULL;
+    m_neg_cache = NULL;
+    m_file_cache = NULL;
+    m_hot_set = NULL;
+    m_prefetcher = NULL;
+    m_response_cache = NULL;
+    m_coalescer = NULL;
+    m_fastcgi = NULL;
+    m_connPool = NULL;
+    m_credentials = NULL;
+    m_sessions = NULL;
+    m_limiter = NULL;
+    m_sched = NULL;
+    m_now = time(NULL);
+    memset(&m_timeouts, 0, sizeof(m_timeouts));
 }
 
 WebServer::~WebServer() {
@@ -14,9 +35,29 @@ WebServer::~WebServer() {
     close(m_listenfd);
     close(m_pipefd[1]);
     close(m_pipefd[0]);
+    //工作线程可能还在处理连接，先等它们退出再释放users
+    delete m_pool;
+    //I/O线程完成预读后会回调连接，同样要在释放users之前join
+    delete m_io_pool;
+#ifdef COROUTINE
+    //销毁还挂起着的协程，它们引用users
+    delete m_sched;
+#endif
     delete[] users;
     delete[] users_timer;
-    delete m_pool;
+    delete m_neg_cache;
+    delete m_hot_set;
+    delete m_prefetcher;
+    delete m_file_cache;
+    //连接中的代理会释放缓存条目，缓存要在users之后删除
+    delete m_response_cache;
+    delete m_coalescer;
+    delete m_fastcgi;
+    delete m_credentials;
+    //退出前把未过期的会话写入快照
+    delete m_sessions;
+    delete m_limiter;
+    delete m_connPool;
     // 删除动态分配的 静态资源路径存储空间
     free(m_root);
 }
@@ -98,9 +139,218 @@ void WebServer::log_write() {
     }
 }
 
-void WebServer::thread_pool() {
+void WebServer::thread_pool(int work_stealing, int max_thread_num, int fair_sched) {
     //线程池
-    m_pool = new threadpool<http_conn>(m_actormodel, m_thread_num);
+    m_pool = new threadpool<http_conn>(m_actormodel, m_thread_num, 10000, work_stealing, max_thread_num,
+                                       fair_sched);
+}
+
+void WebServer::io_thread_pool(int io_thread_num) {
+    m_io_thread_num = io_thread_num;
+    //为0时不启用，冷文件仍由发送线程直接缺页读取
+    if (m_io_thread_num > 0) {
+        m_io_pool = new io_pool(m_io_thread_num);
+        http_conn::m_io_pool = m_io_pool;
+    }
+}
+
+void WebServer::negative_cache(int neg_cache_size, int neg_cache_ttl) {
+    if (neg_cache_size > 0 && neg_cache_ttl > 0) {
+        m_neg_cache = new neg_cache(neg_cache_size, neg_cache_ttl);
+        http_conn::m_neg_cache = m_neg_cache;
+    }
+}
+
+void WebServer::virtual_host(const string &vhost_file) {
+    if (vhost_file.empty())
+        return;
+
+    char server_path[200];
+    getcwd(server_path, 200);
+    if (!m_vhosts.load(vhost_file.c_str(), server_path)) {
+        LOG_ERROR("load vhost file %s failed", vhost_file.c_str());
+        return;
+    }
+    http_conn::m_vhosts = &m_vhosts;
+}
+
+void WebServer::file_caching(int file_cache_mb, const string &hot_set_file, int prefetch_mode) {
+    if (file_cache_mb <= 0)
+        return;
+    m_file_cache = new file_cache((size_t) file_cache_mb * 1024 * 1024);
+    http_conn::m_file_cache = m_file_cache;
+
+    //HTML子资源预取: 1只预热文件缓存, 2同时返回Link预加载头
+    if (prefetch_mode > 0) {
+        m_prefetcher = new html_prefetcher(m_file_cache, 2 == prefetch_mode);
+        http_conn::m_prefetcher = m_prefetcher;
+    }
+
+    if (hot_set_file.empty())
+        return;
+    //开始监听之前按上次的热点快照预热，重启后无需等待缓存逐渐变热
+    m_hot_set = new hot_set(m_file_cache, hot_set_file);
+    int loaded = m_hot_set->warm();
+    LOG_INFO("warm up %d files from %s", loaded, hot_set_file.c_str());
+    m_hot_set->start();
+}
+
+void WebServer::reverse_proxy(int splice_kb) {
+    //大的请求体和响应体经管道零拷贝转发
+    proxy_conn::m_splice_min = splice_kb > 0 ? (long) splice_kb * 1024 : 0;
+
+    //上游地址只在启动时解析一次，请求路径上不做DNS查询
+    for (auto &it : m_proxy_map) {
+        if (!m_upstreams.add(it.first, it.second)) {
+            LOG_ERROR("resolve upstream %s for %s failed", it.second.c_str(), it.first.c_str());
+        }
+    }
+    if (!m_upstreams.empty()) {
+        http_conn::m_upstreams = &m_upstreams;
+        m_upstreams.start_health_check();
+    }
+}
+
+void WebServer::response_caching(int response_cache_mb) {
+    if (response_cache_mb <= 0 || m_upstreams.empty())
+        return;
+    m_response_cache = new response_cache((size_t) response_cache_mb * 1024 * 1024);
+    http_conn::m_response_cache = m_response_cache;
+    //缓存未命中时合并同一key的并发请求
+    m_coalescer = new request_coalescer();
+    http_conn::m_coalescer = m_coalescer;
+}
+
+void WebServer::sql_pool(int sql_num, const string &user, const string &passwd, const string &databasename) {
+    if (sql_num <= 0)
+        return;
+    //初始化数据库连接池，数据库暂时连不上时取用连接时再重连
+    m_connPool = new connection_pool;
+    if (!m_connPool->init("localhost", user, passwd, databasename, 3306, sql_num, m_close_log))
+        LOG_ERROR("connect to mysql %s failed", databasename.c_str());
+
+    //用户名和密码整体载入分片缓存，之后的登录很少需要访问数据库
+    m_credentials = new credential_cache(m_connPool, m_close_log);
+    if (!m_credentials->load())
+        LOG_ERROR("%s", "load users from mysql failed");
+    http_conn::m_credentials = m_credentials;
+}
+
+void WebServer::sessions(int session_ttl, const string &session_file) {
+    if (session_ttl <= 0)
+        return;
+    m_sessions = new session_store(session_ttl, session_file);
+    if (!session_file.empty()) {
+        //重启前登录的用户不必重新登录
+        int loaded = m_sessions->load();
+        LOG_INFO("load %d sessions from %s", loaded, session_file.c_str());
+        m_sessions->start();
+    }
+    http_conn::m_sessions = m_sessions;
+}
+
+void WebServer::client_limits(int max_conns_per_ip, int rate_per_ip) {
+    if (max_conns_per_ip <= 0 && rate_per_ip <= 0)
+        return;
+    m_limiter = new rate_limiter(max_conns_per_ip, rate_per_ip, MAX_FD);
+    http_conn::m_limiter = m_limiter;
+}
+
+void WebServer::phase_timeouts(const conn_timeouts &timeouts) {
+    //慢速客户端在各阶段分别受限，不能靠零星的数据一直占着连接
+    m_timeouts = timeouts;
+}
+
+void WebServer::write_fairness(int write_budget_kb, int srpt) {
+    //大文件每次写事件只发一部分，其余连接在同一轮中都能发送
+    http_conn::m_write_budget = write_budget_kb > 0 ? write_budget_kb * 1024 : 0;
+    m_srpt = srpt;
+}
+
+void WebServer::fast_path(int inline_reply) {
+    //缓存命中的响应在主线程中几微秒就能生成，交给线程池反而要多一次入队、唤醒和回到主线程
+    m_inline_reply = inline_reply;
+}
+
+bool WebServer::over_limit(int connfd, const sockaddr_in &client_address) {
+    if (!m_limiter || m_limiter->admit(connfd, client_address.sin_addr.s_addr))
+        return false;
+    //超过单个IP的连接数上限，直接复位连接，不占用线程和定时器
+    struct linger rst = {1, 0};
+    setsockopt(connfd, SOL_SOCKET, SO_LINGER, &rst, sizeof(rst));
+    close(connfd);
+    LOG_INFO("too many connections from %s", inet_ntoa(client_address.sin_addr));
+    return true;
+}
+
+void WebServer::fastcgi(const string &fcgi_address) {
+    if (fcgi_address.empty())
+        return;
+    m_fastcgi = new fcgi_pool(fcgi_address);
+    if (!m_fastcgi->init()) {
+        LOG_ERROR("bad fastcgi address %s", fcgi_address.c_str());
+        delete m_fastcgi;
+        m_fastcgi = NULL;
+        return;
+    }
+    http_conn::m_fastcgi = m_fastcgi;
+}
+
+void WebServer::native_handlers() {
+    //进程内的处理函数在这里按方法和路径模式注册，在工作线程中执行
+    time_wheel *wheel = &utils.m_timer_wheel;
+    m_router.add("GET", "/api/status", [wheel](const request_view &, response_writer &res) {
+        //各阶段超时关闭的连接数
+        string timeouts;
+        for (int i = 0; i < PHASE_COUNT; ++i) {
+            timeouts += i ? "," : "";
+            timeouts += "\"" + string(time_wheel::phase_name(i)) + "\":" + to_string(wheel->expired(i));
+        }
+        res.header("Content-Type", "application/json");
+        res.write("{\"connections\":" + to_string(http_conn::m_user_count) + ",\"timeouts\":{" + timeouts + "}}");
+    });
+
+    if (m_sessions) {
+        session_store *store = m_sessions;
+        //查询当前会话对应的用户，未登录时返回401
+        m_router.add("GET", "/api/session", [store](const request_view &req, response_writer &res) {
+            const char *cookies = req.header("Cookie");
+            size_t len = 0;
+            const char *sid = cookies ? session_store::cookie_value(cookies, "sid", len) : NULL;
+            string user;
+            res.header("Content-Type", "application/json");
+            if (!sid || !store->lookup(sid, len, user)) {
+                res.status(401, "Unauthorized");
+                res.write("{\"user\":null}");
+                return;
+            }
+            //注册表单中的用户名原样保存，可能带控制字符，按JSON的要求转义
+            string escaped;
+            for (char c : user) {
+                if ((unsigned char) c < 0x20) {
+                    char code[8];
+                    snprintf(code, sizeof(code), "\\u%04x", (unsigned char) c);
+                    escaped += code;
+                    continue;
+                }
+                if (c == '"' || c == '\\')
+                    escaped += '\\';
+                escaped += c;
+            }
+            res.write("{\"user\":\"" + escaped + "\"}");
+        });
+        m_router.add("POST", "/api/logout", [store](const request_view &req, response_writer &res) {
+            const char *cookies = req.header("Cookie");
+            size_t len = 0;
+            const char *sid = cookies ? session_store::cookie_value(cookies, "sid", len) : NULL;
+            if (sid)
+                store->destroy(sid, len);
+            res.header("Set-Cookie", "sid=; Path=/; HttpOnly; Max-Age=0");
+        });
+    }
+
+    if (!m_router.empty())
+        http_conn::m_router = &m_router;
 }
 
 void WebServer::eventListen() {
@@ -148,6 +398,24 @@ void WebServer::eventListen() {
     utils.setnonblocking(m_pipefd[1]);
     utils.addfd(m_epollfd, m_pipefd[0], false, 0);
 
+#ifdef COROUTINE
+    //协程模型下工作线程处理完请求，经eventfd把协程交回主循环
+    if (2 == m_actormodel) {
+        m_sched = new coro_sched(MAX_FD);
+        utils.addfd(m_epollfd, m_sched->get_fd(), false, 0);
+        http_conn::m_sched = m_sched;
+    }
+#else
+    if (2 == m_actormodel) {
+        LOG_ERROR("%s", "coroutine model needs BUILD_COROUTINE, fall back to proactor");
+        m_actormodel = 0;
+    }
+#endif
+
+    //负缓存依赖的inotify事件同样由主循环处理
+    if (m_neg_cache && m_neg_cache->get_fd() >= 0)
+        utils.addfd(m_epollfd, m_neg_cache->get_fd(), false, 0);
+
     utils.addsig(SIGPIPE, SIG_IGN);
     utils.addsig(SIGALRM, utils.sig_handler, false);
     utils.addsig(SIGTERM, utils.sig_handler, false);
@@ -161,40 +429,96 @@ void WebServer::eventListen() {
 
 void WebServer::timer(int connfd, struct sockaddr_in client_address) {
     // todo 连接初始化的地方
-    users[connfd].init(connfd, client_address, m_root, m_CONNTrigmode, m_close_log,m_proxy_map);
+    users[connfd].init(connfd, client_address, m_root, m_CONNTrigmode, m_close_log);
 
     //初始化client_data数据
     //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
     users_timer[connfd].address = client_address;
     users_timer[connfd].sockfd = connfd;
-    util_timer *timer = new util_timer;
+    users_timer[connfd].phase = PHASE_FIRST_BYTE;
+    users_timer[connfd].phase_since = m_now;
+    users_timer[connfd].phase_bytes = 0;
+    util_timer *timer = utils.m_timer_wheel.alloc_timer();
     timer->user_data = &users_timer[connfd];
     timer->cb_func = cb_func;
-    time_t cur = time(NULL);
-    timer->expire = cur + 3 * TIMESLOT;
+    timer->expire = phase_expire(users_timer[connfd]);
     users_timer[connfd].timer = timer;
-    utils.m_timer_lst.add_timer(timer);
+    utils.m_timer_wheel.add_timer(timer);
+
+#ifdef COROUTINE
+    //协程运行到第一次等待事件时返回
+    if (m_sched)
+        serve(connfd);
+#endif
 }
 
-//若有数据传输，则将定时器往后延迟3个单位
-//并对新的定时器在链表上的位置进行调整
+//若有数据传输，按连接所处的阶段重新计算到期时间
+//每个读写事件都会调用，只用本轮缓存的时钟，推后时节点留在时间轮原来的槽里
 void WebServer::adjust_timer(util_timer *timer) {
-    time_t cur = time(NULL);
-    timer->expire = cur + 3 * TIMESLOT;
-    utils.m_timer_lst.adjust_timer(timer);
+    client_data *data = timer->user_data;
+    long bytes;
+    int phase = users[data->sockfd].phase(bytes);
+    //进入新阶段时开始计时，同一阶段内的数据不顺延期限
+    if (phase != data->phase) {
+        data->phase = phase;
+        data->phase_since = m_now;
+        data->phase_bytes = bytes;
+    }
+    timer->expire = phase_expire(*data);
+    utils.m_timer_wheel.adjust_timer(timer);
+}
 
-    LOG_INFO("%s", "adjust timer once");
+time_t WebServer::phase_expire(const client_data &data) {
+    switch (data.phase) {
+        case PHASE_FIRST_BYTE:
+            if (m_timeouts.first_byte > 0)
+                return data.phase_since + m_timeouts.first_byte;
+            break;
+        case PHASE_HEADER:
+            if (m_timeouts.header > 0)
+                return data.phase_since + m_timeouts.header;
+            break;
+        case PHASE_BODY:
+            if (m_timeouts.body_rate > 0)
+                return data.phase_since + RATE_GRACE + data.phase_bytes / m_timeouts.body_rate;
+            break;
+        case PHASE_WRITE:
+            if (m_timeouts.write_rate > 0)
+                return data.phase_since + RATE_GRACE + data.phase_bytes / m_timeouts.write_rate;
+            break;
+        case PHASE_IDLE:
+            if (m_timeouts.idle > 0)
+                return data.phase_since + m_timeouts.idle;
+            break;
+    }
+    //未单独限制的阶段有数据传输就顺延3个单位
+    return m_now + 3 * TIMESLOT;
 }
 
 void WebServer::deal_timer(util_timer *timer, int sockfd) {
     timer->cb_func(&users_timer[sockfd]);
     if (timer) {
-        utils.m_timer_lst.del_timer(timer);
+        utils.m_timer_wheel.del_timer(timer);
     }
+    users_timer[sockfd].timer = NULL;
 
     LOG_INFO("close fd %d", users_timer[sockfd].sockfd);
 }
 
+void WebServer::drop_ready(http_conn *conn) {
+#ifdef COROUTINE
+    //协程挂起在offload上，没有别人会恢复它，就在主线程中接着处理
+    if (m_sched) {
+        std::coroutine_handle<>::from_address(conn->m_coro).resume();
+        return;
+    }
+#endif
+    //连接的ONESHOT事件已经触发，不入队就不会再被处理，直接关闭
+    int sockfd = conn - users;
+    LOG_WARN("request queue full, close fd %d", sockfd);
+    deal_timer(users_timer[sockfd].timer, sockfd);
+}
+
 bool WebServer::dealclinetdata() {
     struct sockaddr_in client_address;
     socklen_t client_addrlength = sizeof(client_address);
@@ -210,6 +534,8 @@ bool WebServer::dealclinetdata() {
             LOG_ERROR("%s", "Internal server busy");
             return false;
         }
+        if (over_limit(connfd, client_address))
+            return false;
         /**
          * 只对新客户连接起作用
          */
@@ -226,6 +552,8 @@ bool WebServer::dealclinetdata() {
                 LOG_ERROR("%s", "Internal server busy");
                 break;
             }
+            if (over_limit(connfd, client_address))
+                continue;
             timer(connfd, client_address);
         }
         return false;
@@ -262,6 +590,20 @@ bool WebServer::dealwithsignal(bool &timeout, bool &stop_server) {
 void WebServer::dealwithread(int sockfd) {
     util_timer *timer = users_timer[sockfd].timer;
 
+    //代理中的连接不进入线程池，由主线程直接转发
+    if (users[sockfd].proxying()) {
+        dealwithproxy(sockfd, EPOLLIN);
+        return;
+    }
+
+#ifdef COROUTINE
+    //协程模型：由连接的协程读取和处理
+    if (m_sched) {
+        m_sched->deliver(sockfd, EPOLLIN);
+        return;
+    }
+#endif
+
     //reactor
     /**
      *
@@ -296,12 +638,23 @@ void WebServer::dealwithread(int sockfd) {
         if (users[sockfd].read_once()) {
             LOG_INFO("deal with the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
 
-            //若监测到读事件，将该事件放入请求队列
-            m_pool->append_p(users + sockfd);
-
             if (timer) {
                 adjust_timer(timer);
             }
+
+            //先在主线程中解析，能直接应答的立即发送
+            http_conn::INLINE_STATUS status = m_inline_reply ? users[sockfd].process_inline() : http_conn::INLINE_WORKER;
+            if (status == http_conn::INLINE_WORKER) {
+                //若监测到读事件，先记下，本轮事件处理完后一起放入请求队列
+                m_ready.push_back(users + sockfd);
+            } else if (status == http_conn::INLINE_REPLY) {
+                if (m_srpt)
+                    m_writable.push_back(sockfd);
+                else
+                    dealwithwrite(sockfd);
+            } else if (status == http_conn::INLINE_CLOSE) {
+                deal_timer(timer, sockfd);
+            }
         } else {
             deal_timer(timer, sockfd);
         }
@@ -310,6 +663,17 @@ void WebServer::dealwithread(int sockfd) {
 
 void WebServer::dealwithwrite(int sockfd) {
     util_timer *timer = users_timer[sockfd].timer;
+
+    if (users[sockfd].proxying()) {
+        dealwithproxy(sockfd, EPOLLOUT);
+        return;
+    }
+#ifdef COROUTINE
+    if (m_sched) {
+        m_sched->deliver(sockfd, EPOLLOUT);
+        return;
+    }
+#endif
     //reactor
     if (1 == m_actormodel) {
         if (timer) {
@@ -342,6 +706,88 @@ void WebServer::dealwithwrite(int sockfd) {
     }
 }
 
+void WebServer::dealwithproxy(int sockfd, uint32_t events) {
+    util_timer *timer = users_timer[sockfd].timer;
+    if (users[sockfd].proxy_event(events)) {
+        if (timer) {
+            adjust_timer(timer);
+        }
+    } else {
+        deal_timer(timer, sockfd);
+    }
+}
+
+void WebServer::dealwithupstream(int fd, uint32_t events) {
+    proxy_conn *proxy = proxy_conn::owner(fd);
+    int sockfd = proxy->client_fd();
+    util_timer *timer = users_timer[sockfd].timer;
+
+    //客户端连接已经超时关闭，放弃这次代理
+    if (!timer) {
+        proxy->abort();
+        return;
+    }
+
+    //上游有进展时同样延长客户端连接的定时器
+    if (proxy->on_upstream_event(events)) {
+        if (timer) {
+            adjust_timer(timer);
+        }
+    } else {
+        deal_timer(timer, sockfd);
+    }
+}
+
+#ifdef COROUTINE
+coro_task WebServer::serve(int sockfd) {
+    coro_sched::waiter w(m_sched, sockfd);
+    http_conn *conn = users + sockfd;
+    while (true) {
+        uint32_t events = co_await m_sched->wait(w);
+        //定时器或错误事件已经关闭了连接
+        if (events & coro_sched::CLOSED)
+            co_return;
+
+        util_timer *timer = users_timer[sockfd].timer;
+        bool ok;
+        if (events & EPOLLIN) {
+            ok = conn->read_once();
+            if (ok) {
+                LOG_INFO("deal with the client(%s)", inet_ntoa(conn->get_address()->sin_addr));
+                if (timer) {
+                    adjust_timer(timer);
+                }
+                http_conn::INLINE_STATUS status = m_inline_reply ? conn->process_inline() : http_conn::INLINE_WORKER;
+                if (status == http_conn::INLINE_WAIT)
+                    continue;
+                if (status == http_conn::INLINE_WORKER) {
+                    //请求在工作线程中处理，处理完回到主线程等待下一个事件；
+                    //处理过程中注册的事件可能先于协程回来到达，由wait直接返回
+                    co_await coro_sched::offload(conn, m_ready);
+                    conn->process();
+                    co_await m_sched->to_main();
+                    continue;
+                }
+                //主线程中已经生成的响应直接发送
+                ok = status == http_conn::INLINE_REPLY && conn->write();
+            }
+        } else {
+            ok = conn->write();
+            if (ok)
+                LOG_INFO("send data to the client(%s)", inet_ntoa(conn->get_address()->sin_addr));
+        }
+
+        if (!ok) {
+            deal_timer(timer, sockfd);
+            co_return;
+        }
+        if (timer) {
+            adjust_timer(timer);
+        }
+    }
+}
+#endif
+
 void WebServer::eventLoop() {
     bool timeout = false;
     bool stop_server = false;
@@ -352,6 +798,8 @@ void WebServer::eventLoop() {
             LOG_ERROR("%s", "epoll failure");
             break;
         }
+        //本轮事件共用一次取到的时间，不必每个事件都调用time()
+        m_now = time(NULL);
 
         for (int i = 0; i < number; i++) {
             int sockfd = events[i].data.fd;
@@ -361,6 +809,20 @@ void WebServer::eventLoop() {
                 bool flag = dealclinetdata();
                 if (!flag)
                     continue;
+            }
+                //被监视的目录发生变化，使负缓存失效
+            else if (m_neg_cache && sockfd == m_neg_cache->get_fd()) {
+                m_neg_cache->handle_events();
+            }
+#ifdef COROUTINE
+                //工作线程处理完请求的协程回到主线程
+            else if (m_sched && sockfd == m_sched->get_fd()) {
+                m_sched->run_posted();
+            }
+#endif
+                //反向代理的上游连接
+            else if (proxy_conn::owner(sockfd)) {
+                dealwithupstream(sockfd, events[i].events);
             }
                 /**
                  * 错误处理
@@ -368,6 +830,7 @@ void WebServer::eventLoop() {
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
                 //服务器端关闭连接，移除对应的定时器
                 util_timer *timer = users_timer[sockfd].timer;
+                users[sockfd].abort_proxy();
                 deal_timer(timer, sockfd);
             }
                 //处理超时与终止信号
@@ -382,12 +845,43 @@ void WebServer::eventLoop() {
             }
                 // 写数据
             else if (events[i].events & EPOLLOUT) {
-                dealwithwrite(sockfd);
+                if (m_srpt)
+                    m_writable.push_back(sockfd);
+                else
+                    dealwithwrite(sockfd);
             }
         }
+        //剩余字节少的响应先发，快要发完的连接不用排在大文件后面
+        if (!m_writable.empty()) {
+            http_conn *conns = users;
+            sort(m_writable.begin(), m_writable.end(), [conns](int a, int b) {
+                return conns[a].bytes_remaining() < conns[b].bytes_remaining();
+            });
+            for (size_t i = 0; i < m_writable.size(); ++i)
+                dealwithwrite(m_writable[i]);
+            m_writable.clear();
+        }
+        //本轮读完的连接一次入队，只唤醒一次
+        if (!m_ready.empty()) {
+            size_t queued = m_pool->append_batch(&m_ready[0], m_ready.size());
+            for (size_t i = queued; i < m_ready.size(); ++i)
+                drop_ready(m_ready[i]);
+            m_ready.clear();
+        }
         if (timeout) {
             utils.timer_handler();
 
+            //每次tick清理一部分会话分片中过期的会话
+            if (m_sessions)
+                m_sessions->expire(m_now);
+
+            //领头请求超时或被放弃，等待者各自去上游
+            if (m_coalescer) {
+                vector<http_conn *> waiters;
+                m_coalescer->expire(m_now, waiters);
+                http_conn::resume(waiters);
+            }
+
             LOG_INFO("%s", "timer tick");
 
             timeout = false;
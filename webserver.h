@@ -14,10 +14,29 @@
 
 #include "./threadpool/threadpool.h"
 #include "./http/http_conn.h"
+#include "./io/io_pool.h"
+#include "./cache/neg_cache.h"
+#include "./vhost/vhost.h"
+#include "./cache/file_cache.h"
+#include "./cache/hot_set.h"
+#include "./cache/prefetcher.h"
+#include "./proxy/upstream_pool.h"
+#include "./proxy/proxy_conn.h"
+#include "./proxy/response_cache.h"
+#include "./proxy/coalescer.h"
+#include "./fastcgi/fcgi_pool.h"
+#include "./CGImysql/sql_connection_pool.h"
+#include "./CGImysql/credential_cache.h"
+#include "./session/session_store.h"
+#include "./limit/rate_limiter.h"
+#ifdef COROUTINE
+#include "./coro/coro_sched.h"
+#endif
 
 const int MAX_FD = 65536;           //最大文件描述符
 const int MAX_EVENT_NUMBER = 10000; //最大事件数
 const int TIMESLOT = 5;             //最小超时单位
+const int RATE_GRACE = 10;          //按最低速率计算期限时额外允许的秒数
 
 class WebServer {
 public:
@@ -31,7 +50,35 @@ public:
     void init(int port, int log_write, int opt_linger, int trigmode,
               int thread_num, int close_log, int actor_model, string &web_root,map<string,string> &);
 
-    void thread_pool();
+    void sql_pool(int sql_num, const string &user, const string &passwd, const string &databasename);
+
+    void sessions(int session_ttl, const string &session_file);
+
+    void client_limits(int max_conns_per_ip, int rate_per_ip);
+
+    void phase_timeouts(const conn_timeouts &timeouts);
+
+    void write_fairness(int write_budget_kb, int srpt);
+
+    void fast_path(int inline_reply);
+
+    void thread_pool(int work_stealing, int max_thread_num, int fair_sched);
+
+    void io_thread_pool(int io_thread_num);
+
+    void negative_cache(int neg_cache_size, int neg_cache_ttl);
+
+    void virtual_host(const string &vhost_file);
+
+    void file_caching(int file_cache_mb, const string &hot_set_file, int prefetch_mode);
+
+    void reverse_proxy(int splice_kb);
+
+    void response_caching(int response_cache_mb);
+
+    void fastcgi(const string &fcgi_address);
+
+    void native_handlers();
 
     void log_write();
 
@@ -45,8 +92,17 @@ public:
 
     void adjust_timer(util_timer *timer);
 
+    //按连接所处的阶段计算定时器的到期时间
+    time_t phase_expire(const client_data &data);
+
     void deal_timer(util_timer *timer, int sockfd);
 
+    //请求队列已满，本轮没能入队的连接
+    void drop_ready(http_conn *conn);
+
+    //客户端IP超过连接数上限时关闭connfd并返回true
+    bool over_limit(int connfd, const sockaddr_in &client_address);
+
     bool dealclinetdata();
 
     bool dealwithsignal(bool &timeout, bool &stop_server);
@@ -55,6 +111,15 @@ public:
 
     void dealwithwrite(int sockfd);
 
+    void dealwithproxy(int sockfd, uint32_t events);
+
+    void dealwithupstream(int fd, uint32_t events);
+
+#ifdef COROUTINE
+    //协程模型下一个连接的全部处理流程，连接关闭时结束
+    coro_task serve(int sockfd);
+#endif
+
 public:
     //基础
     int m_port;
@@ -72,6 +137,21 @@ public:
     threadpool<http_conn> *m_pool;
     int m_thread_num;
 
+    //磁盘I/O线程池相关
+    io_pool *m_io_pool;
+    int m_io_thread_num;
+
+    //不存在路径的负缓存
+    neg_cache *m_neg_cache;
+
+    //虚拟主机表，启动后只读
+    vhost_table m_vhosts;
+
+    //静态文件映射缓存及其热点快照
+    file_cache *m_file_cache;
+    hot_set *m_hot_set;
+    html_prefetcher *m_prefetcher;
+
     //epoll_event相关
     epoll_event events[MAX_EVENT_NUMBER];
 
@@ -81,12 +161,46 @@ public:
     int m_LISTENTrigmode;
     int m_CONNTrigmode;
 
+    //proactor模式下本轮epoll_wait中读完、等待一起交给线程池的连接
+    vector<http_conn *> m_ready;
+
+    //短剩余优先时本轮可写的连接，按剩余字节数从少到多发送
+    int m_srpt;
+    vector<int> m_writable;
+
+    //proactor模式下命中缓存和出错的请求在主线程中直接应答，不经过线程池
+    int m_inline_reply;
+
     //定时器相关
     client_data *users_timer;
     Utils utils;
+    time_t m_now;       //每轮epoll_wait返回后更新的秒级时钟
+    conn_timeouts m_timeouts;
 
     // 代理相关
     map<string ,string> m_proxy_map;
+    upstream_pool m_upstreams;
+    response_cache *m_response_cache;
+    request_coalescer *m_coalescer;
+
+    //数据库连接池与按用户名分片的密码缓存
+    connection_pool *m_connPool;
+    credential_cache *m_credentials;
+
+    //登录会话表
+    session_store *m_sessions;
+
+    //单个客户端IP的连接数和请求速率限制
+    rate_limiter *m_limiter;
+
+    //FastCGI应用的长连接池
+    fcgi_pool *m_fastcgi;
+
+    //进程内处理函数的路由表，启动后只读
+    router m_router;
+
+    //协程模型的调度器，其他模型下为NULL
+    coro_sched *m_sched;
 };
 
 #endif